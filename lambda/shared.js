@@ -95,3 +95,57 @@ var buildSpeechletResponse = function (title, output, repromptText, shouldEndSes
 }
 // Export function so it can be used external to this module.
 module.exports.buildSpeechletResponse = buildSpeechletResponse;
+
+/*
+ * Decode the compact binary status returned by the 'sendBIN' server command.
+ * The reply must be collected as a Buffer, not as a string.
+ * Returns an object with the same fields as the 'sendJSON' reply, except that
+ * lastTruePred holds seconds since the epoch (0 if never true) and the LED
+ * lights and active zones are given as flags.
+ *
+ */
+var decodeStatusBin = function (buf) {
+    var off = 19;
+    var readVarint = function () {
+        var val = 0, mul = 1, b;
+        do {
+            b = buf[off++];
+            val += (b & 0x7f) * mul;
+            mul *= 128;
+        } while (b & 0x80);
+        return val;
+    };
+    var readArray = function (num) {
+        var arr = [];
+        for (var i = 0; i < num; i++) {
+            arr[i] = readVarint();
+        }
+        return arr;
+    };
+
+    if (buf.length < 19 || buf.toString('ascii', 0, 2) !== 'KS' || buf[2] !== 1) {
+        return null;
+    }
+
+    var led = buf[3], numZones = buf[17], numPred = buf[18];
+    var status = {
+        version: buf.readUInt32LE(4),
+        obsTime: buf.readUInt32LE(8),
+        activeZones: buf.readUInt32LE(12),
+        numOcc: buf[16],
+        led: {
+            ready: !!(led & 0x01),
+            error: !!(led & 0x02),
+            bypass: !!(led & 0x04),
+            memory: !!(led & 0x08),
+            armed: !!(led & 0x10),
+            program: !!(led & 0x20)
+        }
+    };
+    status.zoneAct = readArray(numZones);
+    status.zoneDeAct = readArray(numZones);
+    status.lastTruePred = readArray(numPred);
+    return status;
+}
+// Export function so it can be used external to this module.
+module.exports.decodeStatusBin = decodeStatusBin;
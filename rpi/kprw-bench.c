@@ -0,0 +1,455 @@
+/*
+ *
+ * kprw-bench.c
+ *
+ * Times the hot paths of kprw-server: getBinaryData(), decode(), the panel fifo,
+ * the Rscript zone argument formatting in predict() and the status rendering in panserv().
+ * Builds the server source without main(), so it needs no GPIO, no certificates and no root,
+ * and runs the same on the Pi and on a desktop.
+ *
+ * Compile with "gcc -O2 -Wall -o kprw-bench kprw-bench.c -lrt -lpthread -lssl -lcrypto -lz".
+ * Use the same compiler flags as for kprw-server when comparing results.
+ *
+ * Usage: kprw-bench [options] [capture]
+ *  -l, --label TEXT   tag every result with TEXT, e.g. a commit id.
+ *  -t, --time MS      run each benchmark for at least MS ms (default 500).
+ *
+ * The decode benchmarks run over capture, a file of panel words as written by
+ *   "kprw-server --trace" (msg_io word lines) or one 64 character binary word per line.
+ *   Without one, a built-in mix in the proportions seen on a quiet keybus is used.
+ *
+ * The *_contended benchmarks read the status the way predict and panserv do while a
+ *   second thread, on another cpu if there is one, updates it the way msg_io does.
+ *   Their cache misses are mostly cache lines taken away by the writer's core.
+ *
+ * Prints one JSON object per benchmark on stdout:
+ *   {"label":..,"bench":..,"ops":..,"ns_per_op":..,"cycles_per_op":..,
+ *    "cache_misses_per_op":..,"allocs_per_op":..}
+ * Cycles and cache misses are null when the kernel does not allow perf counters
+ *   (see /proc/sys/kernel/perf_event_paranoid).
+ *
+ * Copyright (c) 2016 - 2019 by Lindo St. Angel.
+ *
+ */
+
+#define KPRW_NO_MAIN
+#pragma GCC diagnostic ignored "-Wunused-function" // server threads are unused without main()
+#include "kprw-server.c"
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+
+#define BENCH_TIME	500  // default min ms each benchmark runs
+#define BENCH_BATCH	1024 // operations between clock reads
+#define BENCH_WORDS	4096 // max words read from a capture
+#define BENCH_LED_EVERY	4    // contended writer updates the LED block every 4th word
+#define BENCH_ZONE_EVERY 64  // and the zone block every 64th
+
+// glibc's own allocator, wrapped below to count allocations
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static unsigned long allocs; // allocations made by the code under test
+static int counting;         // set while a benchmark runs
+
+void *malloc(size_t size) {
+  if (counting) allocs++;
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+  if (counting) allocs++;
+  return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  if (counting) allocs++;
+  return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+  __libc_free(ptr);
+}
+
+// words the decode benchmarks run over, as 64 '0'/'1' chars
+static char words[BENCH_WORDS][MAX_BITS];
+static int numWords;
+
+static struct status bstat;
+static volatile unsigned long sink; // keeps results alive
+
+static struct status cstat;         // status shared with the contended writer
+static volatile int writerStop;
+
+// Set a word from its two 32-bit halves, as in an EV_WORD trace event.
+static void word_set(char *word, uint32_t a, uint32_t b) {
+  int i;
+
+  for (i = 0; i < MAX_BITS; i++)
+    word[i] = (((i < 32) ? a >> (31 - i) : b >> (63 - i)) & 1) ? '1' : '0';
+}
+
+/*
+ * Built-in word mix. The panel sends LED status and keypad queries most often,
+ *   keypads answer with idle words, and zone, date and key words are rarer.
+ */
+static void words_default(void) {
+  static const struct { uint32_t a, b; int n; } mix[] = {
+    {0x05810000, 0x00000000, 8}, // LED status, ready
+    {0x05850000, 0x00000000, 2}, // LED status, ready and armed
+    {0x11000000, 0x00000000, 6}, // keypad query
+    {0xffffffff, 0xffffffff, 8}, // keypad idle
+    {0x27000000, 0x00028000, 2}, // zones 1 - 8, zone 2 open
+    {0x2d000000, 0x00000000, 1}, // zones 9 - 16 ready
+    {0x34000000, 0x00000000, 1}, // zones 17 - 24 ready
+    {0x3e000000, 0x00780000, 1}, // zones 25 - 32, interior zones open
+    {0xa5132610, 0x9d000000, 1}, // date
+    {0xff82ffff, 0xffffffff, 1}, // key 1
+    {0x0a000000, 0x00000000, 1}, // program mode
+  };
+  unsigned int i;
+  int j;
+
+  for (i = 0; i < sizeof(mix) / sizeof(mix[0]); i++)
+    for (j = 0; j < mix[i].n && numWords < BENCH_WORDS; j++)
+      word_set(words[numWords++], mix[i].a, mix[i].b);
+}
+
+// Read panel words from a capture. Returns the number read, -1 if the file can't be opened.
+static int words_load(const char *path) {
+  char line[256], bits[MAX_BITS + 1];
+  unsigned int a, b;
+  FILE *fp;
+
+  if ((fp = fopen(path, "r")) == NULL) return -1;
+
+  while (numWords < BENCH_WORDS && fgets(line, sizeof(line), fp)) {
+    if (sscanf(line, "%*s msg_io word %u %u", &a, &b) == 2)
+      word_set(words[numWords++], a, b);
+    else if (sscanf(line, "%64[01]", bits) == 1 && strlen(bits) == MAX_BITS)
+      memcpy(words[numWords++], bits, MAX_BITS);
+  }
+  fclose(fp);
+
+  return numWords;
+}
+
+// A status as predict and msg_io leave it after a day of activity.
+static void status_default(struct status *s) {
+  int i;
+
+  memset(s, 0, sizeof(*s));
+  strcpy(s->led.ledStatus, "LED Status Ready, ");
+  strcpy(s->led.zoneStatus[0], "Zone1 Ready ");
+  strcpy(s->led.zoneStatus[1], "Zone2 Ready ");
+  strcpy(s->led.zoneStatus[2], "Zone3 Ready ");
+  strcpy(s->led.zoneStatus[3], "Zone4 4, 5, 6, 7, ");
+  s->obsTime = 86400000; // ms
+  for (i = 0; i < NUMZONES; i++) {
+    s->zone.zoneAct[i] = 1000000 + 2503217 * i;
+    s->zone.zoneDeAct[i] = s->zone.zoneAct[i] + 37412 * (i % 5);
+  }
+  s->pred.numOcc = 2;
+  for (i = 0; i < NUMPRED; i++) {
+    s->pred.lastTruePredTime[i] = 1560000000 + 60 * i;
+    strcpy(s->pred.lastTruePred[i], "2019-06-08T13:20:00Z");
+  }
+  s->led.ledBits = LED_READY;
+  s->zone.seq = s->led.seq = s->pred.seq = 2;
+}
+
+// Open and start a hardware counter for this thread. Returns -1 if perf counters are not available.
+static int counter_open(int config) {
+  struct perf_event_attr pe;
+  int fd;
+
+  memset(&pe, 0, sizeof(pe));
+  pe.type = PERF_TYPE_HARDWARE;
+  pe.size = sizeof(pe);
+  pe.config = config;
+  pe.disabled = 1;
+  pe.exclude_kernel = 1;
+  pe.exclude_hv = 1;
+
+  fd = syscall(__NR_perf_event_open, &pe, 0, -1, -1, 0);
+  if (fd >= 0) ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+
+  return fd;
+}
+
+static long long counter_read(int fd) {
+  long long c;
+
+  if (fd < 0 || read(fd, &c, sizeof(c)) != sizeof(c)) return -1;
+
+  return c;
+}
+
+// the benchmarks, each runs one operation n times
+
+static void bench_getbinarydata(long n) {
+  unsigned long acc = 0;
+  long i;
+
+  for (i = 0; i < n; i++)
+    acc += getBinaryData(words[i % numWords], 0, 8) + getBinaryData(words[i % numWords], 41, 8);
+  sink += acc;
+}
+
+static void bench_decode(long n) {
+  char msg[50];
+  int allZones[NUMZONES];
+  unsigned long acc = 0;
+  long i;
+
+  for (i = 0; i < n; i++)
+    acc += decode(words[i % numWords], msg, allZones) + msg[0];
+  sink += acc;
+}
+
+static void bench_fifo(long n) {
+  char word[MAX_BITS];
+  uint64_t stamp;
+  unsigned long acc = 0;
+  long i;
+
+  for (i = 0; i < n; i++) {
+    pushElement1(&buses[0], words[i % numWords], MAX_BITS, i);
+    acc += popElement1(&buses[0], word, MAX_BITS, &stamp) + word[7] + stamp;
+  }
+  sink += acc;
+}
+
+static void bench_zone_args(long n) {
+  char zoneBuf[RARG_SIZE];
+  unsigned long acc = 0;
+  long i;
+
+  for (i = 0; i < n; i++) {
+    bstat.zone.zoneAct[i % NUMZONES]++;
+    acc += zone_args(&bstat.zone, zoneBuf, sizeof(zoneBuf));
+  }
+  sink += acc;
+}
+
+static void bench_status_json(long n) {
+  char out[REPLY_LEN];
+  unsigned long acc = 0;
+  long i;
+
+  for (i = 0; i < n; i++)
+    acc += status_json(&bstat, i, out, sizeof(out));
+  sink += acc;
+}
+
+static void bench_status_bin(long n) {
+  unsigned char out[BIN_MAX];
+  unsigned long acc = 0;
+  long i;
+
+  for (i = 0; i < n; i++)
+    acc += status_bin(&bstat, i, out);
+  sink += acc;
+}
+
+/*
+ * Contended writer, updates cstat like msg_io does for a stream of panel words:
+ *   the observation time for every word, now and then the LED block, rarely the zone block.
+ */
+static void * status_writer(void *arg) {
+  unsigned long n;
+
+  for (n = 1; !writerStop; n++) {
+    status_set_obs_time(&cstat, n);
+    if (n % BENCH_LED_EVERY == 0) {
+      status_write_begin(&cstat, BLK_LED);
+      cstat.led.ledStatus[11] ^= 1;
+      cstat.led.ledBits ^= LED_READY;
+      status_write_end(&cstat, BLK_LED);
+    }
+    if (n % BENCH_ZONE_EVERY == 0) {
+      status_write_begin(&cstat, BLK_ZONE);
+      cstat.zone.zoneAct[n % NUMZONES] = n;
+      status_write_end(&cstat, BLK_ZONE);
+    }
+  }
+
+  return NULL;
+}
+
+// panserv deciding whether its rendering is stale, as status_cache() and push_status() do
+static void bench_version_contended(long n) {
+  unsigned long acc = 0;
+  long i;
+
+  for (i = 0; i < n; i++)
+    acc += status_version(&cstat) + __atomic_load_n(&cstat.obsTime, __ATOMIC_RELAXED);
+  sink += acc;
+}
+
+// predict taking the zone times it passes to the Rscript
+static void bench_zone_read_contended(long n) {
+  struct zone_block z;
+  unsigned long acc = 0;
+  long i;
+
+  for (i = 0; i < n; i++) {
+    zone_read(&cstat, &z);
+    __asm__ volatile("" : : "r" (&z) : "memory"); // keep the whole copy
+    acc += z.zoneAct[i % NUMZONES];
+  }
+  sink += acc;
+}
+
+// panserv taking a snapshot to render
+static void bench_status_read_contended(long n) {
+  struct status snap;
+  unsigned long acc = 0;
+  long i;
+
+  for (i = 0; i < n; i++) {
+    acc += status_read(&cstat, &snap);
+    __asm__ volatile("" : : "r" (&snap) : "memory"); // keep the whole copy
+  }
+  sink += acc;
+}
+
+static const struct {
+  const char *name;
+  void (*run)(long n);
+  int contended; // run with status_writer() going
+} benches[] = {
+  {"getBinaryData", bench_getbinarydata, 0},
+  {"decode", bench_decode, 0},
+  {"fifo1_push_pop", bench_fifo, 0},
+  {"zone_args", bench_zone_args, 0},
+  {"status_json", bench_status_json, 0},
+  {"status_bin", bench_status_bin, 0},
+  {"status_version_contended", bench_version_contended, 1},
+  {"zone_read_contended", bench_zone_read_contended, 1},
+  {"status_read_contended", bench_status_read_contended, 1},
+};
+
+// Start status_writer() on the last cpu, with the benchmark thread on the first.
+static pthread_t writer_start(void) {
+  cpu_set_t cpus;
+  pthread_t tid;
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+  status_default(&cstat);
+  writerStop = 0;
+  if (pthread_create(&tid, NULL, status_writer, NULL)) {
+    perror("kprw-bench: can't start the status writer");
+    exit(EXIT_FAILURE);
+  }
+  if (ncpu > 1) {
+    CPU_ZERO(&cpus);
+    CPU_SET(ncpu - 1, &cpus);
+    pthread_setaffinity_np(tid, sizeof(cpus), &cpus);
+    CPU_ZERO(&cpus);
+    CPU_SET(0, &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+  }
+
+  return tid;
+}
+
+// Run a benchmark for at least ms milliseconds and print its result.
+static void bench_run(int b, const char *label, long ms, int cyclesFd, int missFd) {
+  struct timespec t0, t1;
+  long long c0, c1, m0, m1;
+  long ops = 0, ns;
+  pthread_t writer = 0;
+
+  if (benches[b].contended) writer = writer_start();
+  benches[b].run(BENCH_BATCH); // warm up caches and branch predictors
+
+  allocs = 0;
+  c0 = counter_read(cyclesFd);
+  m0 = counter_read(missFd);
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  counting = 1;
+  do {
+    benches[b].run(BENCH_BATCH);
+    ops += BENCH_BATCH;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    ns = (t1.tv_sec - t0.tv_sec) * NSEC_PER_SEC + (t1.tv_nsec - t0.tv_nsec);
+  } while (ns < ms * 1000000L);
+  counting = 0;
+  c1 = counter_read(cyclesFd);
+  m1 = counter_read(missFd);
+
+  if (benches[b].contended) {
+    writerStop = 1;
+    pthread_join(writer, NULL);
+  }
+
+  printf("{\"label\":\"%s\",\"bench\":\"%s\",\"ops\":%ld,\"ns_per_op\":%.2f,",
+         label, benches[b].name, ops, (double) ns / ops);
+  if (c0 < 0 || c1 < 0)
+    printf("\"cycles_per_op\":null,");
+  else
+    printf("\"cycles_per_op\":%.2f,", (double) (c1 - c0) / ops);
+  if (m0 < 0 || m1 < 0)
+    printf("\"cache_misses_per_op\":null,");
+  else
+    printf("\"cache_misses_per_op\":%.4f,", (double) (m1 - m0) / ops);
+  printf("\"allocs_per_op\":%.4f}\n", (double) allocs / ops);
+  fflush(stdout);
+}
+
+static const struct option long_opts[] = {
+  {"label", required_argument, NULL, 'l'},
+  {"time", required_argument, NULL, 't'},
+  {NULL, 0, NULL, 0}
+};
+
+int main(int argc, char *argv[])
+{
+  const char *label = "";
+  long ms = BENCH_TIME;
+  int opt, cyclesFd, missFd;
+  unsigned int b;
+
+  while ((opt = getopt_long(argc, argv, "l:t:", long_opts, NULL)) != -1) {
+    switch (opt) {
+      case 'l':
+        label = optarg;
+        break;
+      case 't':
+        ms = atol(optarg);
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-l|--label TEXT] [-t|--time MS] [capture]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+  }
+
+  if (optind < argc) {
+    if (words_load(argv[optind]) == -1) {
+      perror("kprw-bench: can't open capture");
+      exit(EXIT_FAILURE);
+    }
+    if (numWords == 0) {
+      fprintf(stderr, "kprw-bench: no panel words in %s\n", argv[optind]);
+      exit(EXIT_FAILURE);
+    }
+  } else {
+    words_default();
+  }
+  status_default(&bstat);
+
+  cyclesFd = counter_open(PERF_COUNT_HW_CPU_CYCLES);
+  missFd = counter_open(PERF_COUNT_HW_CACHE_MISSES);
+
+  for (b = 0; b < sizeof(benches) / sizeof(benches[0]); b++)
+    bench_run(b, label, ms, cyclesFd, missFd);
+
+  if (cyclesFd >= 0) close(cyclesFd);
+  if (missFd >= 0) close(missFd);
+
+  return 0;
+} // main
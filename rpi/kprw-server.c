@@ -6,11 +6,64 @@
  *
  * This version supports machine learning via R.
  *
- * Compile with "gcc -Wall -o kprw-server kprw-server.c -lrt -lpthread -lwrap -lssl -lcrypto".
- * To enable R logging, add -DRLOG=\"/home/pi/all/R/rlog.txt\" (change path as required).
+ * Compile with "gcc -Wall -o kprw-server kprw-server.c -lrt -lpthread -lssl -lcrypto -lz".
  * To output status messages to stdout, add -DVERBOSE.
  * To run a real-time safe test at start of program, add -DTESTRT.
  *
+ * Usage: kprw-server [options] port
+ *  -k, --ktls      hand the TLS record layer to the kernel (kTLS) after each handshake.
+ *                  Falls back to user space TLS if openssl or the kernel lack kTLS support.
+ *  -i, --push-interval MS
+ *                  min time between status pushes to a subscribed client (default 50 ms).
+ *  -r, --key-rate N, -b, --key-burst N
+ *                  key presses per second and burst allowed from one client address
+ *                  (default 5 and 8). Commands over the limit get "busy, retry after N ms".
+ *  -g, --key-global-rate N
+ *                  key presses per second allowed from all clients together (default 15).
+ *  -q, --key-queue N
+ *                  max keypad words waiting to be sent to the panel (default 16).
+ *  -h, --http PORT
+ *                  serve the status as JSON on /status and counters on /metrics, over plain
+ *                  http on 127.0.0.1:PORT, for local monitoring without a client certificate.
+ *                  /stats has the zone statistics, /trace the most recent trace events.
+ *  -t, --trace FILE
+ *                  append every trace event to FILE as text. The last events of each thread
+ *                  are kept in memory regardless and dumped to stderr on SIGUSR1 or a crash.
+ *  -l, --rlog FILE
+ *                  log the output of every Rscript run to FILE, e.g. /home/pi/all/R/rlog.txt.
+ *                  Entries are buffered and written in batches by a thread of its own.
+ *  -j, --rlog-json
+ *                  log one JSON record per Rscript run, with its inputs, predictions and run
+ *                  time, instead of the raw output.
+ *  -m, --rlog-max BYTES, -n, --rlog-keep N
+ *                  rotate the R log when it reaches BYTES (default 1 MB), keeping N older
+ *                  segments compressed as FILE.1.gz ... FILE.N.gz (default 4).
+ *  -d, --deadline  run panel_io and msg_io under SCHED_DEADLINE, each with a guaranteed
+ *                  share of its period, so no SCHED_FIFO thread can starve them. A thread
+ *                  the kernel refuses stays SCHED_FIFO. See sched_deadline().
+ *  -s, --spin-guard US
+ *                  place keybus samples by sleeping until US before the sample instant and
+ *                  spinning on the clock from there (1 - 100 us, default off). Not with -d.
+ *  -u, --takeover  take over from a server running on the same port: its listening sockets,
+ *                  status and queued keypad words are handed over and the keybus changes
+ *                  hands between two words. Starts as usual if there is no server to take
+ *                  over from. See handoff_serve().
+ *  -p, --bus CLOCK,DATA_IN,DATA_OUT
+ *                  serve a keybus on these BCM gpio pins (default 13,5,16). Repeat for up
+ *                  to 4 keybuses, each with a panel of its own. Commands starting with
+ *                  "bus N " and /status?bus=N go to the Nth, all others to the first.
+ *  -v, --replay FILE
+ *                  test mode without the keybus: replay the words in FILE, a --trace file or
+ *                  lines of "<seconds> <64 binary digits>", into the first bus at their times
+ *                  on a virtual clock, which skips ahead whenever panel_io, msg_io and predict
+ *                  are all waiting. Hours of traffic replay in seconds, with the decisions of
+ *                  real time. Needs no PREEMPT RT kernel. Not with -d or -u. See clk_sleep().
+ *  -e, --rules FILE
+ *                  take the interior and exit zones for the occupancy estimate, and the
+ *                  actions to run on zone events and predictions, from FILE, e.g.
+ *                  /home/pi/all/rpi/kprw-rules.conf. Edits apply within a second, without a
+ *                  restart. See rules_reload().
+ *
  * Tested with:
  *  Raspberry Pi 2 and Raspbian Wheezy + PREEMPT_RT patched kernel 3.18.9-rt5-v7.
  *  Raspberry Pi 3 and Raspbian Buster + PREEMPT-RT patched kernel 4.19.59-rt23-v7+.
@@ -39,24 +92,83 @@
 #include <sys/utsname.h>
 #include <ctype.h>		// Needed for isdigit()
 #include <malloc.h>		// Needed for mallopt()
+#include <getopt.h>		// Needed for getopt_long()
+#include <stdarg.h>
+#include <errno.h>
+#include <zlib.h>		// Needed to compress rotated R logs
+#include <limits.h>		// Needed for PATH_MAX
 
 // socket
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <signal.h>
-#include <tcpd.h> //for hosts_ctl()
 #include <netdb.h>
-#define	BUF_LEN		16  // size of string to hold longest message incl '\n'
-#define BACKLOG		1   // only allow one client to connect
-//#define	_BSD_SOURCE // to get definitions of NI_MAXHOST and NI_MAXSERV from <netdb.h>
-#define ADDRSTRLEN	(NI_MAXHOST + NI_MAXSERV + 10)
+#include <semaphore.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <stddef.h>		// Needed for offsetof()
+#include <sys/syscall.h>	// Needed for SYS_sched_setattr
+#include <sys/un.h>		// Needed for the handoff socket
+#include <sys/wait.h>		// Needed for waitpid()
+#include <spawn.h>		// Needed for posix_spawn()
+#define	BUF_LEN		64  // size of string to hold longest message incl '\n'
+#define BACKLOG		8   // max connections waiting to be accepted
+#define MAX_CLIENTS	8   // max simultaneous client connections
+#define RX_BUF_LEN	(4*1024)  // per client receive buffer
+#define TX_BUF_LEN	(16*1024) // per client transmit buffer
+#define FRAME_MAGIC	0xA1 // first byte of every frame, never the start of a legacy text command
+#define FRAME_HDR_LEN	8    // magic, type, 16-bit payload length, 32-bit request id
+#define FRAME_MAX	(RX_BUF_LEN - FRAME_HDR_LEN) // max frame payload
+#define FRAME_REQ	0x01 // request from client
+#define FRAME_REPLY	0x02 // reply to a request
+#define FRAME_ERROR	0x03 // request could not be processed
+#define FRAME_PUSH	0x04 // status pushed to a subscriber
+#define REPLY_LEN	2048 // max length of a single reply
+#define STATS_LEN	(160 + 8 * 21 * NUMZONES) // longest zone statistics reply, see stats_json()
+#define PUSH_INTERVAL	50   // default min ms between status pushes to a subscriber
+#define SUB_BACKLOG	(TX_BUF_LEN / 2) // unsent bytes above which a subscriber is stalled
+#define SUB_STALL_TIMEOUT 30000 // ms a subscriber may stay stalled before it is dropped
+#define HISTORY_LEN	16   // status versions kept to answer "sendJSON since=<version>"
+#define BIN_VERSION	1    // version of the binary status format, see status_bin()
+#define BIN_MAX		(19 + 5 * (2 * NUMZONES + NUMPRED)) // max size of the binary status
+#define HANDSHAKE_TIMEOUT 10  // seconds allowed for handshake and legacy command
+#define IDLE_TIMEOUT	300 // seconds a framed connection may stay idle
+#define POLL_PERIOD	1000 // ms between server housekeeping passes
+#define HOSTS_ALLOW	"/etc/hosts.allow" // tcp wrapper access rules
+#define HOSTS_DENY	"/etc/hosts.deny"
+#define ACL_MAX_RULES	64   // max access rules that apply to this server
+#define ACL_MAX_NETS	16   // max client patterns per access rule
+#define HOSTLOG_LEN	16   // client addresses waiting to be logged by name
+#define KEY_WORD_MS	64   // approx ms the panel takes to consume one keypad word
+#define KEY_QUEUE	16   // default max keypad words waiting to be sent to the panel
+#define KEY_RATE	5    // default key presses per second allowed from one client address
+#define KEY_BURST	8    // default key presses one client address may send at once
+#define KEY_MAX		4    // most key presses a single command can make (a 4-digit code)
+#define KEY_BUCKETS	32   // client addresses tracked for keypad rate limiting
+#define HTTP_CLIENTS	4    // max simultaneous connections to the local http listener
+#define HTTP_REQ_LEN	512  // longest http request header read
+#define HTTP_BUF_LEN	(32*1024) // http response body, holds /metrics for a few hundred command bytes
+#define HTTP_HDR_LEN	256  // http response header, see http_service()
+#define HANDOFF_NAME	"kprw-handoff-%d" // abstract unix socket a new instance takes over by, per port
+#define HANDOFF_MAGIC	0x4b505248 // "KPRH", start of the state handed over
+#define HANDOFF_WAIT	500  // max ms panel_io and msg_io may take to stop for a handoff
+#define HANDOFF_ACK	2000 // max ms the new instance may take to confirm a handoff
+#define NOTIFY_WAIT	1000 // max ms to wait for systemd to take a new MAINPID, below HANDOFF_ACK
 
 // openssl
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 #include <openssl/evp.h>
 
+// status published in shared memory for local readers
+#include "kprw-shm.h"
+
+// kernel tls offload is available from openssl 3.0
+#ifdef SSL_OP_ENABLE_KTLS
+#define HAVE_KTLS
+#endif
+
 // GPIO Access from ARM Running Linux. Based on Dom and Gert rev 15-feb-13
 #define BCM_PERI_BASE 0x3F000000 // modified for Pi 2/3
 #define GPIO_BASE     (BCM_PERI_BASE + 0x200000) // GPIO controller
@@ -77,16 +189,17 @@
 #define GPIO_PULL *(gpio+37) // Pull up/pull down
 #define GPIO_PULLCLK0 *(gpio+38) // Pull up/pull down clock (BCM Clock 0)
 
-// GPIO pin mapping.
+// GPIO pin mapping of bus 0, unless pins are given with --bus.
 #define PI_CLOCK_IN	(13) // BRCM GPIO13 / PI J8 Pin 33
 #define PI_DATA_IN	(5)  // BRCM GPIO05 / PI J8 Pin 29
 #define PI_DATA_OUT	(16) // BRCM GPIO16 / PI J8 Pin 36
+#define PI_GPIO_MAX	(27) // highest GPIO on the header, all in BCM bank 0
 
-// GPIO high and low level mapping macros.
-#define PI_CLOCK_HI (1<<PI_CLOCK_IN)
-#define PI_CLOCK_LO (0)
-#define PI_DATA_HI  (1<<PI_DATA_IN)
-#define PI_DATA_LO  (0)
+// GPIO high and low level mapping macros, for the pins of bus b.
+#define PI_CLOCK_HI(b) (1<<(b)->clockIn)
+#define PI_CLOCK_LO(b) (0)
+#define PI_DATA_HI(b)  (1<<(b)->dataIn)
+#define PI_DATA_LO(b)  (0)
 
 // GPIO invert macro
 #define INV(g,s)	((1<<g) - s)
@@ -96,8 +209,11 @@
 #define MSG_IO_PRI     (70) // message io thread priority
 #define PREDICT_PRI    (50) // predict thread priority
 #define PANEL_IO_PRI   (90) // panel io thread priority - panel io pri must be highest
-#define MAX_SAFE_STACK (32*1024*1024) // 32MB pagefault free buffer
 #define MY_STACK_SIZE  (100*1024) // 100KB thread stack size
+#define MAIN_STACK     (256*1024) // 256KB of main thread stack pre-faulted for panserv
+#define HEAP_BASE      (1024*1024) // 1MB heap for openssl's context, certificates and stdio
+#define TLS_CONN_HEAP  (96*1024) // 96KB heap per tls connection, record buffers and handshake
+#define PREDICT_HEAP   (64*1024) // 64KB heap for the predict thread's popen() and stdio
 
 // panel i/o thread
 #define NSEC_PER_SEC   (1000000000LU) // 1 second.
@@ -107,88 +223,548 @@
 #define SAMPLE_OFFSET  (120000L) // 0.12 ms sample offset from clk edge for panel read
 #define KSAMPLE_OFFSET (300000L) // 0.30 ms sample offset from clk edge for keypad read
 #define HOLD_DATA      (220000L) // 0.22 ms data hold time from clk edge for keypad write
+#define SPIN_GUARD_MAX (100000L) // 0.1 ms max spin before a sample, less than SAMPLE_OFFSET
 #define CLK_BLANK      (5000000L) // 5 ms min clock blank.
 #define NEW_WORD_VALID (2500000L) // if a bit arrives > 2.5 ms after last one, declare start of new word.
+#define WORD_KEEPALIVE (1000000000L) // 1 s max between words queued while the panel repeats itself
 #define MAX_BITS       (64) // max 64-bit word read from panel
 #define MAX_DATA       (1*1024) // 1 KB data buffer of 64-bit data words - ~66 seconds @ 1 kHz.
 #define FIFO_SIZE      (MAX_BITS*MAX_DATA) // FIFO depth
+#define MAX_BUSES      4 // keybus interfaces served by one server, see struct bus
 
-// keypad button bit mappings
-// no button:	0xff 0xff 0xff 0xff 0xff 0xff 0xff 0xff
+// keypad idle word, what panel_io sends when no key is queued
 #define IDLE	"1111111111111111111111111111111111111111111111111111111111111111"
-// *:		0xff 0x94 0x7f 0xff 0xff 0xff 0xff 0xff
-#define STAR	"1111111110010100011111111111111111111111111111111111111111111111"
-// #:		0xff 0x96 0xff 0xff 0xff 0xff 0xff 0xff
-#define POUND	"1111111110010110111111111111111111111111111111111111111111111111"
-// 0:		0xff 0x80 0x7f 0xff 0xff 0xff 0xff 0xff
-#define ZERO	"1111111110000000011111111111111111111111111111111111111111111111"
-// 1:		0xff 0x82 0xff 0xff 0xff 0xff 0xff 0xff
-#define ONE	"1111111110000010111111111111111111111111111111111111111111111111"
-// 2:		0xff 0x85 0x7f 0xff 0xff 0xff 0xff 0xff
-#define TWO	"1111111110000101011111111111111111111111111111111111111111111111"
-// 3:		0xff 0x87 0xff 0xff 0xff 0xff 0xff 0xff
-#define THREE	"1111111110000111011111111111111111111111111111111111111111111111"
-// 4: 		0xff 0x88 0xff 0xff 0xff 0xff 0xff 0xff
-#define FOUR	"1111111110001000111111111111111111111111111111111111111111111111"
-// 5: 		0xff 0x8b 0x7f 0xff 0xff 0xff 0xff 0xff
-#define FIVE	"1111111110001011100011111111111111111111111111111111111111111111"
-// 6:		0xff 0x8d 0xff 0xff 0xff 0xff 0xff 0xff
-#define SIX	"1111111110001101111111111111111111111111111111111111111111111111"
-// 7: 		0xff 0x8e 0x7f 0xff 0xff 0xff 0xff 0xff
-#define SEVEN	"1111111110001110111111111111111111111111111111111111111111111111"
-// 8: 		0xff 0x91 0x7f 0xff 0xff 0xff 0xff 0xff
-#define EIGHT	"1111111110010001011111111111111111111111111111111111111111111111"
-// 9: 		0xff 0x93 0xff 0xff 0xff 0xff 0xff 0xff
-#define NINE	"1111111110010011111111111111111111111111111111111111111111111111"
-// stay:        0xff 0xd7 0xff 0xff 0xff 0xff 0xff 0xff
-#define STAY	"1111111111010111111111111111111111111111111111111111111111111111"
-// away:	0xff 0xd8 0xff 0xff 0xff 0xff 0xff 0xff
-#define AWAY	"1111111111011000111111111111111111111111111111111111111111111111"
+
+/*
+ * Keybus message schema. decode() and key_encode() are generated from these tables,
+ *   so a new message type or key is a new line here rather than new bit handling code.
+ *
+ * Fields, X(name, offset, width): a field is width bits of a word starting at bit offset,
+ *   most significant bit first, as read by getBinaryData(). FIELD(word, name) reads one.
+ */
+#define KEYBUS_FIELDS(X) \
+  X(F_CMD,          0,  8) /* command byte, selects the message type below */ \
+  X(F_LED_ERROR,   12,  1) /* LED status lights */ \
+  X(F_LED_BYPASS,  13,  1) \
+  X(F_LED_MEMORY,  14,  1) \
+  X(F_LED_ARMED,   15,  1) \
+  X(F_LED_READY,   16,  1) \
+  X(F_LED_PROGRAM, 17,  1) \
+  X(F_YEAR3,        9,  4) /* date and time, year is 20<year3><year4> */ \
+  X(F_YEAR4,       13,  4) \
+  X(F_MONTH,       19,  4) \
+  X(F_DAY,         23,  5) \
+  X(F_HOUR,        28,  5) \
+  X(F_MINUTE,      33,  6) \
+  X(F_ZONES,       41,  8) /* zone lights, bit n set if zone base + n + 1 is open */ \
+  X(F_KEYPAD,       8, 32) /* keypad to panel data, all ones while the keypad is idle */ \
+  X(F_KEY_START,    8,  1) /* key word: always 1 */ \
+  X(F_KEY_CODE,     9,  6) /* key word: key code, see KEYPAD_KEYS */ \
+  X(F_KEY_SUM,     15,  2) /* key word: checksum, see key_sum() */ \
+  X(F_KEY_STOP,    17, 11) /* key word: always all ones, like the rest of the word */
+
+/*
+ * Message types, X(command byte, decoder, text, argument): decode() writes text and then
+ *   calls decode_<decoder>(word, msg, argument, allZones) to append the fields.
+ * For zone messages the argument is the zone number of bit 0 of F_ZONES.
+ */
+#define KEYBUS_MSGS(X) \
+  X(0x05, led,    "LED Status ",   0) \
+  X(0xa5, date,   "Date: 20",      0) \
+  X(0x27, zones,  "Zone1 ",        0) \
+  X(0x2d, zones,  "Zone2 ",        8) \
+  X(0x34, zones,  "Zone3 ",       16) \
+  X(0x3e, zones,  "Zone4 ",       24) \
+  X(0x0a, text,   "Panel Program Mode", 0) \
+  X(0x63, text,   "Undefined command from panel", 0) \
+  X(0x64, text,   "Undefined command from panel", 0) \
+  X(0x69, text,   "Undefined command from panel", 0) \
+  X(0x5d, text,   "Undefined command from panel", 0) \
+  X(0x39, text,   "Undefined command from panel", 0) \
+  X(0xb1, text,   "Undefined command from panel", 0) \
+  X(0x11, text,   "Keypad query",  0) \
+  X(0xff, keypad, "From Keypad ",  0)
+
+// LED status lights in the order decode() lists them, X(LED_ flag, field, text)
+#define KEYBUS_LEDS(X) \
+  X(LED_READY,   F_LED_READY,   "Ready, ") \
+  X(LED_ERROR,   F_LED_ERROR,   "Error, ") \
+  X(LED_BYPASS,  F_LED_BYPASS,  "Bypass, ") \
+  X(LED_MEMORY,  F_LED_MEMORY,  "Memory, ") \
+  X(LED_ARMED,   F_LED_ARMED,   "Armed, ") \
+  X(LED_PROGRAM, F_LED_PROGRAM, "Program, ")
+
+/*
+ * Keypad keys, X(name, key code, text). A key word is all ones except for the key code
+ *   in bits 9 - 14 and its checksum in bits 15 - 16, see key_encode(),
+ *   e.g. * is 0xff 0x94 0x7f 0xff 0xff 0xff 0xff 0xff.
+ */
+#define KEYPAD_KEYS(X) \
+  X(KP_0,     0x00, "button 0 pressed") \
+  X(KP_1,     0x01, "button 1 pressed") \
+  X(KP_2,     0x02, "button 2 pressed") \
+  X(KP_3,     0x03, "button 3 pressed") \
+  X(KP_4,     0x04, "button 4 pressed") \
+  X(KP_5,     0x05, "button 5 pressed") \
+  X(KP_6,     0x06, "button 6 pressed") \
+  X(KP_7,     0x07, "button 7 pressed") \
+  X(KP_8,     0x08, "button 8 pressed") \
+  X(KP_9,     0x09, "button 9 pressed") \
+  X(KP_STAR,  0x0a, "button * pressed") \
+  X(KP_POUND, 0x0b, "button # pressed") \
+  X(KP_STAY,  0x2b, "stay button pressed") \
+  X(KP_AWAY,  0x2c, "away button pressed")
+
+#define X(name, offset, width) name##_OFF = (offset), name##_LEN = (width),
+enum { KEYBUS_FIELDS(X) };
+#undef X
+#define X(name, code, text) name = (code),
+enum { KEYPAD_KEYS(X) };
+#undef X
+
+#define FIELD(word, name) getBinaryData((word), name##_OFF, name##_LEN)
 
 // predict thread
-#define POPEN_FMT      "Rscript --vanilla /home/pi/all/R/predsvm2.R %s %s %s 2> /dev/null"
-#define RARG_SIZE      256 // max number of characters allowed in argument to the Rscript
+#define POPEN_FMT      "Rscript --vanilla /home/pi/all/R/predsvm2.R %s %s %s %s 2> /dev/null"
+#define RARG_SIZE      1024 // max number of characters allowed in argument to the Rscript
 #define ROUT_MAX       256 // max number of characters read from output of Rscript
 #define TS_BUF_SIZE    sizeof("2016-05-22T12:15:22Z")
-#define PCMD_BUF_SIZE  (sizeof(POPEN_FMT) + TS_BUF_SIZE + 2 * RARG_SIZE) // size of buffer passed to popen()
-#define INTZONES       {26, 27, 28, 29} // list of interior zones (zone numbering starts with 0)
-#define EXITZONE       0 // zone number of front door which is main exit point from house
-#define CONZONELL      0 // lower limit of concurent zone activity in seconds
-#define CONZONEUL      10 // upper limit of concurent zone activity in seconds
+#define PCMD_BUF_SIZE  (sizeof(POPEN_FMT) + TS_BUF_SIZE + 4 * RARG_SIZE) // size of buffer passed to popen()
+#define INTZONES       {26, 27, 28, 29} // interior zones without a rules file (numbering starts with 0)
+#define EXITZONE       0 // front door, the main exit point from the house, without a rules file
+#define CONZONELL      0 // lower limit of concurent zone activity in seconds, without a rules file
+#define CONZONEUL      10 // upper limit of concurent zone activity in seconds, without a rules file
 #define PREDICT_UPDATE 5000000 // 5 ms predict thread update period in nanoseconds
-#define PRLIGHTIP      "192.168.1.105" // IP addr of Playroom Light switch
-#define MBLIGHTIP      "192.168.1.115" // Master Bedroom Light
-#define BPLIGHTIP      "192.168.1.101" // Back Porch Light
-#define FPLIGHTIP      "192.168.1.116" // Master Bedroom Light
-#define SCMD_BUF_SIZE  sizeof("/home/pi/all/scripts/wemo.sh 192.168.1.105 OFF > /dev/null")
-#define SCMD_FMT       "/home/pi/all/scripts/wemo.sh %s %s > /dev/null"
 #define NUMPRED        10 // max number of predictions
 #define MINPROB        50 // min probability estimate (in %) to be taken as valid
+#define RULES_MAX      64 // max rules in the rules file
+#define RULES_TEXT     4096 // max bytes of action commands in the rules file, incl '\0's
+#define RULES_RUNNING  8 // max actions running at once
+#define RLOG_BUF_LEN   (64*1024) // R log entries waiting to be written, must be a power of 2
+#define RLOG_BATCH     (4*1024) // buffered R log bytes that wake the writer before RLOG_FLUSH
+#define RLOG_FLUSH     1 // max seconds an R log entry waits to be written
+#define RLOG_MAX       (1024*1024) // default R log size that triggers a rotation
+#define RLOG_KEEP      4 // default number of compressed R log segments kept
+#define RLOG_REC_LEN   4096 // max length of a structured R log record
 
 // message i/o thread
 #define NUMZONES        32 // number of zones in system
 #define MSG_IO_UPDATE   5000000 // 5 ms message io thread update period in nanoseconds
+#define ZSTAT_WINDOWS   3 // decaying activation count windows per zone, see zstatWindow[]
+#define ZSTAT_DWELLS    64 // dwells after which a zone's dwell mean and variance favor recent ones
+#define PIO_DL_RUNTIME  (INTERVAL / 5) // panel io cpu time per INTERVAL under SCHED_DEADLINE
+#define MIO_DL_RUNTIME  (MSG_IO_UPDATE / 10) // message io cpu time per MSG_IO_UPDATE
+
+// tracing
+#define TRACE_LEN       1024 // events kept per thread, must be a power of 2
+#define TRACE_DRAIN     100000000L // 100 ms between trace drains in nanoseconds
+#define TRACE_LINE      96 // max length of a trace event as text
+
+// panel main led status lights, packed
+#define LED_READY      0x01
+#define LED_ERROR      0x02
+#define LED_BYPASS     0x04
+#define LED_MEMORY     0x08
+#define LED_ARMED      0x10
+#define LED_PROGRAM    0x20
 
-// structure to hold a snapshot of the panel status, sensor observations and predictions
-struct status {
+/*
+ * Snapshot of the panel status, sensor observations and predictions.
+ * It is split into blocks by writer and by how often they change, each on cache lines of
+ *   its own with its own sequence lock, see status_write_begin(). A reader of one block is
+ *   not disturbed by writes to the others, and obsTime, rewritten for every panel word,
+ *   does not share a cache line with anything a reader polls.
+ */
+#define CACHE_LINE      64 // bytes, Cortex-A7 and A53
+enum { BLK_ZONE = 1, BLK_LED = 2, BLK_PRED = 4, BLK_ALL = 7 };
+
+// zone sensor times, written by msg_io on zone transitions
+struct zone_block {
+  unsigned long seq;                        // odd while being updated
+  uint64_t zoneAct[NUMZONES];               // zone sensor activation times, capture ms
+  uint64_t zoneDeAct[NUMZONES];             // zone sensor deactivation times, capture ms
+} __attribute__((aligned(CACHE_LINE)));
+
+// panel lights, written by msg_io when they change
+struct led_block {
+  unsigned long seq;                        // odd while being updated
+  unsigned char ledBits;                    // panel main led status lights as LED_ flags
   char ledStatus[50];                       // panel main led status lights
-  char zone1Status[50];                     // panel zone 1 status lights
-  char zone2Status[50];                     // panel zone 2 status lights
-  char zone3Status[50];                     // panel zone 3 status lights
-  char zone4Status[50];                     // panel zone 4 status lights
-  long unsigned obsTime;                    // zone sensor absolute observation time
-  long unsigned zoneAct[32];                // zone sensor absolute activation times
-  long unsigned zoneDeAct[32];              // zone sensor absolute deactivation times
+  char zoneStatus[4][50];                   // panel zone 1 - 4 status lights
+} __attribute__((aligned(CACHE_LINE)));
+
+// occupancy and predictions, written by predict
+struct pred_block {
+  unsigned long seq;                        // odd while being updated
   int numOcc;                               // estimated number of occupants in house
+  long unsigned lastTruePredTime[NUMPRED];  // same as lastTruePred, wall clock s since the epoch
   char lastTruePred[NUMPRED][TS_BUF_SIZE];  // time of last true predictions
+} __attribute__((aligned(CACHE_LINE)));
+
+struct status {
+  struct zone_block zone;
+  struct led_block led;
+  struct pred_block pred;
+  uint64_t obsTime __attribute__((aligned(CACHE_LINE))); // capture ms of the last panel word
+};
+
+/*
+ * Activity statistics of a zone, kept up by msg_io at constant cost per zone transition.
+ * count[w] is the number of activations in about the last zstatWindow[w] seconds as of
+ *   lastAct, each activation counting less the older it is, see zstat_count().
+ * The mean and variance of how long the zone stays active are exact over its first
+ *   ZSTAT_DWELLS dwells and weighted towards the recent ones after that, see zstat_dwell().
+ */
+struct zone_stats {
+  uint64_t lastAct;                         // capture ms of the last activation, 0 if none
+  uint32_t acts;                            // activations seen
+  uint32_t dwells;                          // deactivations seen
+  float count[ZSTAT_WINDOWS];               // decaying activation counts as of lastAct
+  float dwellMean, dwellVar;                // time active, in s and s^2
+};
+
+// zone statistics of a bus, written by msg_io with the zone block, see stats_read()
+struct stats_block {
+  unsigned long seq;                        // odd while being updated
+  struct zone_stats zone[NUMZONES];
+} __attribute__((aligned(CACHE_LINE)));
+
+/*
+ * One keybus interface: its pins, fifos, panel_io and msg_io state and status.
+ * panel_io and msg_io each serve every bus from a single loop, see bus_step() and
+ *   bus_decode(). Clients address a bus by its id, see bus_select().
+ */
+enum { PIO_POLL, PIO_KSAMPLE, PIO_HOLD, PIO_SAMPLE }; // panel_io steps, see bus_step()
+struct bus {
+  struct status status;
+  int id;                               // index in buses[]
+  int clockIn, dataIn, dataOut;         // BCM GPIO numbers
+
+  // fifos, panel_io to msg_io (1) and panserv to panel_io (2)
+  volatile int m_Read1, m_Write1, m_Read2, m_Write2;
+  volatile char m_Data1[FIFO_SIZE], m_Data2[FIFO_SIZE];
+  volatile uint64_t m_Time1[FIFO_SIZE / MAX_BITS]; // capture ms of each fifo1 word, by slot
+
+  // panel_io
+  int step;                             // next step, PIO_
+  struct timespec due;                  // when it is due
+  struct timespec tmark;                // last clock high
+  int flag, bitCnt, parked;
+  char word[MAX_BITS], wordkw[MAX_BITS], wordkr[MAX_BITS], wordkrTemp;
+  struct {                              // last word queued for each command byte
+    char word[MAX_BITS], wordkr[MAX_BITS];
+  } lastWords[256];
+  struct timespec lastQueued;           // when any word was last queued, see word_end()
+  char heldKey[MAX_BITS];               // keypad word to send next after a handoff
+
+  // msg_io
+  int allZones[NUMZONES];               // zones the last zone word showed active
+  struct stats_block stats;             // activity of each zone
+} __attribute__((aligned(CACHE_LINE)));
+
+// run-time configuration, set from the command line in main()
+struct config {
+  int port; // server port number
+  int ktls; // hand the tls record layer to the kernel after the handshake
+  int pushInterval; // min ms between status pushes to a subscriber
+  int keyRate, keyBurst; // key presses per second and burst allowed from one client address
+  int keyGlobalRate; // key presses per second allowed from all clients together
+  int keyQueue; // max keypad words waiting to be sent to the panel
+  int httpPort; // local http status and metrics port, 0 if disabled
+  const char *traceFile; // file trace events are appended to, NULL if none
+  const char *rlogFile; // R prediction log, NULL if none
+  int rlogJson; // log one JSON record per Rscript run instead of its raw output
+  long rlogMax; // R log size in bytes that triggers a rotation
+  int rlogKeep; // compressed R log segments kept
+  int deadline; // run panel_io and msg_io under SCHED_DEADLINE
+  long spinGuard; // ns panel_io spins before each sample instant, 0 to only sleep
+  int takeover; // take over from a server running on the same port
+  int buses; // keybus interfaces, set up from pins[]
+  int pins[MAX_BUSES][3]; // clock in, data in and data out GPIO of each bus
+  const char *replayFile; // keybus words replayed on the virtual clock, NULL to use the keybus
+  const char *rulesFile; // zone and prediction rules, NULL for the built-in ones
+};
+
+static struct config cfg = {
+  .port = 0,
+  .ktls = 0,
+  .pushInterval = PUSH_INTERVAL,
+  .keyRate = KEY_RATE,
+  .keyBurst = KEY_BURST,
+  .keyGlobalRate = 1000 / KEY_WORD_MS,
+  .keyQueue = KEY_QUEUE,
+  .httpPort = 0,
+  .traceFile = NULL,
+  .rlogFile = NULL,
+  .rlogJson = 0,
+  .rlogMax = RLOG_MAX,
+  .rlogKeep = RLOG_KEEP,
+  .deadline = 0,
+  .spinGuard = 0,
+  .takeover = 0,
+  .buses = 1,
+  .pins = {{PI_CLOCK_IN, PI_DATA_IN, PI_DATA_OUT}},
+  .replayFile = NULL,
+  .rulesFile = NULL,
+};
+
+// state of one client connection served by panserv()
+enum { CL_HANDSHAKE, CL_OPEN, CL_CLOSING };
+enum { CL_UNKNOWN, CL_LEGACY, CL_FRAMED };
+struct client {
+  int fd;                     // socket, -1 if the slot is free
+  SSL *ssl;
+  int state;                  // CL_HANDSHAKE, CL_OPEN or CL_CLOSING
+  int mode;                   // CL_UNKNOWN until the first byte arrives, then CL_LEGACY or CL_FRAMED
+  int ktls;                   // kernel tls state, see ktls_state()
+  int wantWrite;              // openssl needs the socket writable to make progress
+  char addr[INET_ADDRSTRLEN]; // peer address for logging
+  uint32_t ip;                // peer address, host byte order
+  time_t lastActive;          // CLOCK_MONOTONIC seconds of last i/o
+  int subscribed;             // status is pushed when it changes
+  struct bus *subBus;         // bus whose status is pushed
+  uint32_t subId;             // request id of the subscribe command
+  int subInterval;            // min ms between pushes
+  unsigned long pushedVer;    // last status version sent
+  long lastPushMs, stallMs;   // time of last push, time the subscriber stopped draining
+  struct timespec accepted;   // start of the tls handshake
+  int rxLen, txLen, txOff;
+  char rx[RX_BUF_LEN];
+  char tx[TX_BUF_LEN];
+};
+
+// what tells a config file changed: the ns mtime, and size and inode for an edit that kept it
+struct file_stamp {
+  struct timespec mtime;
+  off_t size;
+  ino_t ino;
+};
+
+// compiled access rules, see acl_reload()
+struct acl_net {
+  uint32_t net, mask; // host byte order
+};
+struct acl_rule {
+  int allow;          // grant or deny access on a match
+  int numIncl, numExcl;
+  struct acl_net incl[ACL_MAX_NETS]; // clients the rule applies to...
+  struct acl_net excl[ACL_MAX_NETS]; // ...EXCEPT these
+};
+struct acl {
+  int loaded, numRules;
+  struct file_stamp allow, deny; // of the files when loaded
+  struct acl_rule rules[ACL_MAX_RULES];
+};
+
+// compiled zone and prediction rules, see rules_reload()
+enum { RULE_PRED, RULE_OPEN, RULE_CLOSE };
+struct rule {
+  uint8_t event;          // RULE_
+  uint8_t arg;            // prediction or zone number
+  uint8_t minProb;        // min probability in % of a prediction
+  uint16_t from, to;      // time window in minutes since local midnight, all day if equal
+  uint32_t open, closed;  // zones that must be open and closed, bit n for zone n
+  uint16_t line;          // line in the rules file, for the trace
+  uint16_t cmd;           // action, offset in text
+};
+struct rules {
+  int loaded, numRules;
+  struct file_stamp stamp;      // of the file when loaded
+  int interior[NUMZONES];       // interior zones, for the occupancy estimate
+  int numInterior;
+  int exitZone;                 // main exit from the house, resets the estimate
+  int conLL, conUL;             // seconds between interior zone activations of two people
+  struct rule rule[RULES_MAX];
+  char text[RULES_TEXT];        // action commands, run by /bin/sh
+  pid_t running[RULES_RUNNING]; // actions not reaped yet, 0 if free
+};
+
+// client addresses queued for the host name logger
+struct hostlog_entry {
+  struct in_addr addr;
+  in_port_t port;
+  int denied;
+};
+struct hostlog {
+  sem_t sem;          // number of queued entries
+  volatile int read, write;
+  struct hostlog_entry q[HOSTLOG_LEN];
+};
+
+// connection to the local http listener, see http_service()
+struct http_conn {
+  int fd;                     // socket, -1 if the slot is free
+  time_t opened;              // CLOCK_MONOTONIC seconds
+  int inLen, outLen, outOff;
+  char in[HTTP_REQ_LEN];
+  char out[HTTP_HDR_LEN + HTTP_BUF_LEN]; // header and body
+};
+
+/*
+ * Counters served on /metrics.
+ * Every counter has a single writer thread, which updates it with metric_inc() or
+ *   metric_add(), so readers need no lock, just metric_get().
+ */
+enum { LOOP_PANEL_IO, LOOP_MSG_IO, LOOP_PREDICT, NUM_LOOPS };
+struct metrics {
+  unsigned long panelWords[MAX_BUSES]; // panel_io: words read from the panel, by bus
+  unsigned long shortWords[MAX_BUSES]; // panel_io: words dropped for having < 20 bits
+  unsigned long repeats[MAX_BUSES][256]; // panel_io: repeats not queued, by bus, command byte
+  unsigned long long spinNs;        // panel_io: total time spun before samples
+  unsigned long spinWaits, spinLate; // panel_io: spun waits, and waits woken past the sample
+  unsigned long decoded[MAX_BUSES][256]; // msg_io: words decoded, by bus, command byte
+  unsigned long predictions;        // predict: Rscript runs
+  unsigned long predictMs;          // predict: total time spent in Rscript
+  unsigned long overruns[NUM_LOOPS]; // each thread: wake ups a full period or more late
+  unsigned long dlOverruns[NUM_LOOPS]; // each thread: SCHED_DEADLINE runtime overruns
+  int deadline[NUM_LOOPS];          // each thread: 1 if it runs under SCHED_DEADLINE
+  unsigned long handshakes, handshakeFails; // panserv: tls handshakes
+  unsigned long long handshakeUs;   // panserv: total time spent in tls handshakes
+  unsigned long keyBusy;            // panserv: keypad commands refused by key_admit()
+  unsigned long firstWordMs;        // msg_io: ms from start to the first decoded word, 0 before
+  unsigned long lastWord[MAX_BUSES]; // msg_io: CLOCK_MONOTONIC s of the last decoded word
+  unsigned long long busNs[MAX_BUSES][2]; // panel_io and msg_io: time spent on each bus
+};
+
+/*
+ * Trace events, see trace().
+ * Each thread that traces owns one ring and is its only writer.
+ */
+enum { RING_PANEL_IO, RING_MSG_IO, RING_PREDICT, RING_SERVER, NUM_RINGS };
+enum {
+  EV_SHORT_WORD,  // panel_io: word dropped, a = bit count, b = bus
+  EV_FIFO_FULL,   // panel_io: panel fifo full, word and its keypad data dropped, a = 0, b = bus
+  EV_BAD_KEY_BIT, // panel_io: keypad word holds a bad element, a = bit, b = element
+  EV_KEY_SENT,    // panel_io: keypad word sent to panel, a = bits 0-31, b = bits 32-63
+  EV_WORD,        // msg_io: word decoded, a = bits 0-31, b = bits 32-63
+  EV_FIFO_READ,   // msg_io: short read from the panel fifo, a = elements read, b = bus
+  EV_STATUS,      // msg_io: new status version published, a = version, b = command byte
+  EV_PREDICT,     // predict: Rscript run, a = ms it took, b = last prediction
+  EV_KEY_ADMIT,   // panserv: keypad command queued, a = key presses, b = keypad fifo depth
+  EV_KEY_BUSY,    // panserv: keypad command refused, a = key presses, b = retry ms
+  EV_DL_REFUSED,  // panel_io, msg_io: SCHED_DEADLINE refused, a = errno
+  EV_FIRST_WORD,  // msg_io: first word decoded since start, a = ms since start
+  EV_RULE,        // predict: rule matched, a = its line in the rules file, b = action pid
+  EV_RULES,       // predict: rules file loaded, a = rules, b = errno if it can't be read
+  EV_RULE_BAD,    // predict: rule not understood and ignored, a = its line in the rules file
+  NUM_EVENTS
+};
+struct trace_event {
+  uint32_t sec, nsec; // CLOCK_MONOTONIC
+  uint32_t id, a, b;
+};
+struct trace_ring {
+  uint32_t head;      // events written, the next one goes to ev[head % TRACE_LEN]
+  uint32_t tail;      // events taken by the trace drainer
+  uint32_t lost;      // events overwritten before the drainer got to them
+  struct trace_event ev[TRACE_LEN];
+};
+
+// R log entries on their way from predict to the R log writer, see rlog_write()
+struct rlog {
+  sem_t sem;                  // posted when a batch is waiting
+  uint32_t head, tail;        // bytes written by predict, bytes taken by the writer
+  int posted;                 // a wake up is pending
+  unsigned long dropped;      // entries dropped because the buffer was full
+  char buf[RLOG_BUF_LEN];
+};
+
+// keypad admission token bucket, see key_admit()
+struct key_bucket {
+  uint32_t addr; // client address, host byte order
+  long tokens;   // thousandths of a key press
+  long lastMs;   // CLOCK_MONOTONIC ms of last refill
+};
+
+// pre-rendered status replies, see status_cache()
+struct render_cache {
+  unsigned long ver;     // status version rendered
+  unsigned long obsTime; // observation time in the JSON rendering, seconds
+  int jsonLen, textLen, binLen;
+  char json[REPLY_LEN];
+  char text[REPLY_LEN];
+  unsigned char bin[BIN_MAX];
+  struct {                        // recently served versions, for delta replies
+    unsigned long ver;
+    struct status s;
+  } hist[HISTORY_LEN];
+  int head, histLen;              // newest entry, number of entries in use
 };
 
+// server state handed to a new instance, see handoff_serve() and takeover()
+struct handoff_state {
+  uint32_t magic;             // HANDOFF_MAGIC
+  uint32_t size;              // sizeof(struct handoff_state), both binaries must agree on it
+  struct timespec parked;     // CLOCK_MONOTONIC when panel_io left the keybus
+  unsigned long long epoch;   // statusEpoch, the versions carry on so the epoch does too
+  int nbuses;                 // buses in use, both instances must have the same
+  struct {
+    int pins[3];              // clock in, data in and data out, must be the same too
+    int nwords;               // panel and keypad words read but not decoded yet
+    int nkeys;                // keypad words not sent to the panel yet
+    struct status status;
+    struct stats_block stats;
+    char words[MAX_DATA][MAX_BITS];
+    uint64_t stamps[MAX_DATA]; // capture ms of words, the same clock in both instances
+    char keys[MAX_DATA][MAX_BITS];
+  } bus[MAX_BUSES];
+};
+
+// server globals
+static struct client clients[MAX_CLIENTS];
+static struct render_cache rcache[MAX_BUSES] = {
+  [0 ... MAX_BUSES - 1] = { .ver = ~0UL, .head = HISTORY_LEN - 1 }
+};
+static int ktlsWarned;
+static struct timespec startTime; // CLOCK_MONOTONIC when main() started
+static unsigned long long statusEpoch; // CLOCK_REALTIME us when the status versions started over
+static struct handoff_state handoff;
+static int takenListenFd = -1, takenHttpFd = -1; // listening sockets handed over by takeover()
+
+// set by panserv to stop panel_io between words and msg_io, for a handoff
+static int handoffPark;
+static int pioParked, mioParked;     // set by each thread once it has stopped
+static struct timespec pioParkedAt;  // CLOCK_MONOTONIC when panel_io stopped
+
+/*
+ * Virtual clock of panel_io, msg_io and predict, with --replay.
+ * It stands still while any of the three threads runs, and jumps to the earliest of their
+ *   deadlines once all three wait for one, see clk_sleep() and clk_idle().
+ */
+static struct {
+  int on;                  // set once by main() before the threads start
+  pthread_mutex_t lock;
+  pthread_cond_t tick;     // broadcast when the clock jumps
+  uint64_t now;            // ns of CLOCK_MONOTONIC, written under lock, read without
+  uint64_t due[NUM_LOOPS]; // deadline each thread waits for
+  long period[NUM_LOOPS];  // period of each idle thread, 0 if it is not idle, see clk_idle()
+  int waiting;             // bit per LOOP_ thread waiting for its deadline
+  int woken;               // bit per LOOP_ thread given work since it last waited
+  time_t wall;             // CLOCK_REALTIME - CLOCK_MONOTONIC seconds when it started
+} vclock = { .lock = PTHREAD_MUTEX_INITIALIZER, .tick = PTHREAD_COND_INITIALIZER,
+             .woken = (1 << NUM_LOOPS) - 1 };
+
+// keybus interfaces, cfg.buses of them are in use
+static struct bus buses[MAX_BUSES];
+static struct acl acl;
+static struct rules rules; // only predict uses them
+static struct hostlog hostLog;
+static struct key_bucket keyBuckets[KEY_BUCKETS], keyGlobal[MAX_BUSES];
+static struct http_conn httpConns[HTTP_CLIENTS];
+static struct metrics metrics;
+static struct rlog rlog;
+static struct trace_ring traceRings[NUM_RINGS];
+static const char *traceRingNames[NUM_RINGS] = {"panel_io", "msg_io", "predict", "server"};
+static const int zstatWindow[ZSTAT_WINDOWS] = {300, 3600, 86400}; // seconds, see struct zone_stats
+static const char *zstatNames[ZSTAT_WINDOWS] = {"5m", "1h", "24h"};
+static sem_t traceWake;                  // posted to make the drainer run now
+static volatile sig_atomic_t traceDump;  // set by SIGUSR1, see trace_drainer()
+
 // global for direct gpio access
 volatile unsigned *gpio;
 
-// fifo globals
-volatile int m_Read1, m_Write1, m_Read2, m_Write2;
-volatile char m_Data1[FIFO_SIZE], m_Data2[FIFO_SIZE];
+// status published for local readers, NULL if it could not be set up, see shm_init()
+static struct kprw_shm *shm;
 
 #ifdef TESTRT
 // show_new_pagefault_count
@@ -230,7 +806,11 @@ static void prove_thread_stack_use_is_safe(int stacksize) {
 } // prove_thread_stack_use_is_safe
 #endif
 
-// reserve_process_memory
+/*
+ * reserve_process_memory
+ * The calling thread's malloc() arena keeps size bytes pre-faulted and locked from here on.
+ * main() reserves the heap panserv needs, the other threads that allocate reserve their own.
+ */
 static void reserve_process_memory(int size) {
   int i;
   char *buffer;
@@ -257,6 +837,35 @@ static void reserve_process_memory(int size) {
   return;
 } // reserve_process_memory
 
+// Heap panserv needs at the most, for openssl and the largest number of tls connections.
+static int heap_size(void) {
+  return HEAP_BASE + MAX_CLIENTS * TLS_CONN_HEAP;
+} // heap_size()
+
+// Fault in the stack main() will grow into, it only grows by page faults otherwise.
+static void __attribute__((noinline)) prefault_stack(void) {
+  volatile char buffer[MAIN_STACK];
+  int i;
+
+  for (i = 0; i < MAIN_STACK; i += sysconf(_SC_PAGESIZE))
+    buffer[i] = 0;
+  (void) buffer[0]; // read it back so it is used
+} // prefault_stack()
+
+// Resident and locked memory of the process in kB, -1 if unknown.
+static void mem_usage(long *rssKb, long *lckKb) {
+  char line[128];
+  FILE *fp;
+
+  *rssKb = *lckKb = -1;
+  if ((fp = fopen("/proc/self/status", "r")) == NULL) return;
+  while (fgets(line, sizeof(line), fp)) {
+    sscanf(line, "VmRSS: %ld", rssKb);
+    sscanf(line, "VmLck: %ld", lckKb);
+  }
+  fclose(fp);
+} // mem_usage()
+
 // Set up a memory regions to access GPIO
 static void setup_io(void) {
   int  mem_fd;
@@ -326,6 +935,147 @@ static inline long ts_diff(struct timespec *a, struct timespec *b)
   return (x - y);
 }
 
+/*
+ * Convert a CLOCK_MONOTONIC time to ms, the unit of the capture stamps and status times.
+ */
+static inline uint64_t ts_ms(const struct timespec *t)
+{
+  return (uint64_t) t->tv_sec * 1000 + t->tv_nsec / 1000000;
+}
+
+/*
+ * Clock of panel_io, msg_io and predict: CLOCK_MONOTONIC, or the virtual clock with --replay.
+ * Only the keybus threads and the trace go by it. panserv keeps to CLOCK_MONOTONIC, so
+ *   client timeouts stay in real time during a replay.
+ */
+static inline void clk_now(struct timespec *t)
+{
+  uint64_t ns;
+
+  if (!vclock.on) {
+    clock_gettime(CLOCK_MONOTONIC, t);
+    return;
+  }
+  ns = __atomic_load_n(&vclock.now, __ATOMIC_RELAXED);
+  t->tv_sec = ns / NSEC_PER_SEC;
+  t->tv_nsec = ns % NSEC_PER_SEC;
+}
+
+// Seconds since the epoch, on the same clock.
+static inline time_t clk_wall(void)
+{
+  if (!vclock.on) return time(NULL);
+
+  return vclock.wall + __atomic_load_n(&vclock.now, __ATOMIC_RELAXED) / NSEC_PER_SEC;
+}
+
+/*
+ * Wait for the virtual clock to reach the deadline of thread loop, with vclock.lock held.
+ * The last of the three threads to wait moves the clock on to the earliest deadline of
+ *   the threads that are not idle and wakes the threads due then. No time passes while any
+ *   thread runs, so the threads take the same decisions as in real time, however fast.
+ */
+static void clk_wait(int loop)
+{
+  uint64_t next;
+  int i, woken;
+
+  vclock.waiting |= 1 << loop;
+  while (vclock.period[loop] || vclock.now < vclock.due[loop]) {
+    for (i = 0, next = UINT64_MAX; i < NUM_LOOPS; i++)
+      if (!vclock.period[i] && vclock.due[i] < next) next = vclock.due[i];
+    if (vclock.waiting != (1 << NUM_LOOPS) - 1 || next == UINT64_MAX) {
+      pthread_cond_wait(&vclock.tick, &vclock.lock);
+      continue;
+    }
+    for (i = 0, woken = 0; i < NUM_LOOPS; i++)
+      if (!vclock.period[i] && vclock.due[i] <= next && i != loop) {
+        vclock.waiting &= ~(1 << i); // on their behalf, so the clock waits for them
+        woken = 1;
+      }
+    __atomic_store_n(&vclock.now, next, __ATOMIC_RELAXED);
+    if (woken) pthread_cond_broadcast(&vclock.tick);
+  }
+  vclock.waiting &= ~(1 << loop);
+} // clk_wait()
+
+// Sleep until t, for the thread loop.
+static void clk_sleep(int loop, const struct timespec *t)
+{
+  if (!vclock.on) {
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, t, NULL);
+    return;
+  }
+
+  pthread_mutex_lock(&vclock.lock);
+  vclock.woken &= ~(1 << loop);
+  vclock.due[loop] = (uint64_t) t->tv_sec * NSEC_PER_SEC + t->tv_nsec;
+  clk_wait(loop);
+  pthread_mutex_unlock(&vclock.lock);
+} // clk_sleep()
+
+/*
+ * Sleep until t, for the thread loop that runs every period and has nothing to do until
+ *   another thread calls clk_wake() for it.
+ * On the virtual clock the thread sleeps through the ticks on which it would find nothing
+ *   to do, and *t is moved on to the tick it wakes on: the first at or after the clk_wake(),
+ *   or t itself if that came before this call. In real time it is clk_sleep().
+ */
+static void clk_idle(int loop, struct timespec *t, long period)
+{
+  uint64_t due;
+
+  if (!vclock.on) {
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, t, NULL);
+    return;
+  }
+
+  pthread_mutex_lock(&vclock.lock);
+  vclock.due[loop] = (uint64_t) t->tv_sec * NSEC_PER_SEC + t->tv_nsec;
+  if (!(vclock.woken & (1 << loop))) vclock.period[loop] = period;
+  vclock.woken &= ~(1 << loop);
+  clk_wait(loop);
+  due = vclock.due[loop];
+  pthread_mutex_unlock(&vclock.lock);
+
+  t->tv_sec = due / NSEC_PER_SEC;
+  t->tv_nsec = due % NSEC_PER_SEC;
+} // clk_idle()
+
+/*
+ * Give thread loop work for its next tick, see clk_idle().
+ * Called by a running thread, so the clock stands still until the woken thread has run.
+ */
+static void clk_wake(int loop)
+{
+  uint64_t tick;
+  long period;
+
+  if (!vclock.on) return;
+
+  pthread_mutex_lock(&vclock.lock);
+  if ((period = vclock.period[loop])) {
+    tick = vclock.due[loop];
+    if (tick < vclock.now) tick += (vclock.now - tick + period - 1) / period * period;
+    vclock.due[loop] = tick;
+    vclock.period[loop] = 0;
+  } else {
+    vclock.woken |= 1 << loop;
+  }
+  pthread_mutex_unlock(&vclock.lock);
+} // clk_wake()
+
+// Run the keybus threads on the virtual clock from now on, starting at CLOCK_MONOTONIC.
+static void clk_virtual(void)
+{
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  vclock.now = (uint64_t) t.tv_sec * NSEC_PER_SEC + t.tv_nsec;
+  vclock.wall = time(NULL) - t.tv_sec;
+  vclock.on = 1;
+}
+
 /*
  * Convert straight binary (represented by a char array) into an integer.
  * Variable offset defines where in the array to begin the conversion.
@@ -343,6 +1093,19 @@ static inline unsigned int getBinaryData(char *st, int offset, int length)
   return buf;
 }
 
+/*
+ * Write the low length bits of value into a binary string, the reverse of getBinaryData().
+ */
+static inline void setBinaryData(char *st, int offset, int length, unsigned int value)
+{
+  int j;
+
+  for (j = length - 1; j >= 0; j--) {
+    *(st + offset + j) = (value & 1) ? '1' : '0';
+    value >>= 1;
+  }
+}
+
 /*
  * Fifos are thread safe without using any synchronization (e.g., mutext).
  * But each fifo must have exactly one producer and one consumer to be used safely.
@@ -350,1074 +1113,4130 @@ static inline unsigned int getBinaryData(char *st, int offset, int length)
  * http://blogs.msmvps.com/vandooren
  */
 
-// fifo1 - stores panel to keypad and keypad to panel data
-static inline int pushElement1(char *element, int num) {
+/*
+ * fifo1 - stores panel to keypad and keypad to panel data
+ * Each word carries the CLOCK_MONOTONIC ms at which panel_io captured it, so msg_io can
+ *   time zone transitions by when they happened on the bus, not when it got to them.
+ */
+static inline int pushElement1(struct bus *b, char *element, int num, uint64_t stamp) {
   int nextElement, i;
 
   // increment or reset pointer
-  nextElement = ((m_Write1 + num) >= FIFO_SIZE) ? 0 : (m_Write1 + num);
+  nextElement = ((b->m_Write1 + num) >= FIFO_SIZE) ? 0 : (b->m_Write1 + num);
 
-  if (nextElement != m_Read1) { // fifo not full
+  if (nextElement != b->m_Read1) { // fifo not full
     for (i = 0; i < num; i++) {
-      m_Data1[m_Write1 + i] = element[i];
+      b->m_Data1[b->m_Write1 + i] = element[i];
     }
+    b->m_Time1[b->m_Write1 / num] = stamp;
+  } else {
+    return 0; // fifo is full, data not overwritten
   }
 
-  // if fifo was full, data will be overwritten
-  m_Write1 = nextElement;
+  b->m_Write1 = nextElement;
 
   return i; // return number of elements pushed
 }
 
-static inline int popElement1(char *element, int num) {
+// number of num long elements fifo1 of bus b has room for, called by its producer only
+static inline int roomElement1(struct bus *b, int num) {
+  int used = b->m_Write1 - b->m_Read1;
+
+  if (used < 0) used += FIFO_SIZE;
+
+  return (FIFO_SIZE - used) / num - 1; // one slot always stays empty
+}
+
+static inline int popElement1(struct bus *b, char *element, int num, uint64_t *stamp) {
   int nextElement, i;
 
-  if (m_Read1 == m_Write1) {
+  if (b->m_Read1 == b->m_Write1) {
+    *stamp = 0;
     return 0; // fifo is empty
   }
 
   // increment or reset pointer
-  nextElement = ((m_Read1 + num) >= FIFO_SIZE) ? 0 : (m_Read1 + num);
+  nextElement = ((b->m_Read1 + num) >= FIFO_SIZE) ? 0 : (b->m_Read1 + num);
 
   for (i = 0; i < num; i++) {
-    element[i] = m_Data1[m_Read1 + i];
+    element[i] = b->m_Data1[b->m_Read1 + i];
   }
+  *stamp = b->m_Time1[b->m_Read1 / num];
 
-  m_Read1 = nextElement;
+  b->m_Read1 = nextElement;
 
   return i;
 }
 
 // fifo2 - stores keypad data to be sent to panel
-static inline int pushElement2(char *element, int num) {
+static inline int pushElement2(struct bus *b, char *element, int num) {
   int nextElement, i;
 
   // increment or reset pointer
-  nextElement = ((m_Write2 + num) >= FIFO_SIZE) ? 0 : (m_Write2 + num);
+  nextElement = ((b->m_Write2 + num) >= FIFO_SIZE) ? 0 : (b->m_Write2 + num);
 
-  if (nextElement != m_Read2) {
+  if (nextElement != b->m_Read2) {
     for (i = 0; i < num; i++) {
-      m_Data2[m_Write2 + i] = element[i];
+      b->m_Data2[b->m_Write2 + i] = element[i];
     }
   } else {
     return 0; // fifo is full, data not overwritten
   }
 
-  m_Write2 = nextElement;
+  b->m_Write2 = nextElement;
 
   return i;
 }
 
-static inline int popElement2(char *element, int num) {
+static inline int popElement2(struct bus *b, char *element, int num) {
   int nextElement, i;
 
-  if (m_Read2 == m_Write2) {
+  if (b->m_Read2 == b->m_Write2) {
     return 0; // fifo is empty
   }
 
   // increment or reset pointer
-  nextElement = ((m_Read2 + num) >= FIFO_SIZE) ? 0 : (m_Read2 + num);
+  nextElement = ((b->m_Read2 + num) >= FIFO_SIZE) ? 0 : (b->m_Read2 + num);
 
   for (i = 0; i < num; i++) {
-    element[i] = m_Data2[m_Read2 + i];
+    element[i] = b->m_Data2[b->m_Read2 + i];
   }
 
-  m_Read2 = nextElement;
+  b->m_Read2 = nextElement;
 
   return i;
 }
 
-// Decode bits from panel into commands and messages.
-static int decode(char * word, char * msg, int * allZones) {
-  int cmd = 0, zones = 0, button = 0;
-  unsigned short i = 0;
-  char year3[2],year4[2],month[2],day[2],hour[2],minute[2];
-  char str[4];
-
-  cmd = getBinaryData(word,0,8);
-  strcpy(msg, "");
-
-  if (cmd == 0x05) {
-    strcpy(msg, "LED Status ");
-    if (getBinaryData(word,16,1))
-      strcat(msg, "Ready, ");
-    else
-      strcat(msg, "Not Ready, ");
-    if (getBinaryData(word,12,1)) strcat(msg, "Error, ");
-    if (getBinaryData(word,13,1)) strcat(msg, "Bypass, ");
-    if (getBinaryData(word,14,1)) strcat(msg, "Memory, ");
-    if (getBinaryData(word,15,1)) strcat(msg, "Armed, ");
-    if (getBinaryData(word,17,1)) strcat(msg, "Program, ");
-  }
-  else if (cmd == 0xa5) {
-    sprintf(year3, "%d", getBinaryData(word,9,4));
-    sprintf(year4, "%d", getBinaryData(word,13,4));
-    sprintf(month, "%d", getBinaryData(word,19,4));
-    sprintf(day, "%d", getBinaryData(word,23,5));
-    sprintf(hour, "%d", getBinaryData(word,28,5));
-    sprintf(minute, "%d", getBinaryData(word,33,6));
-    strcpy(msg, "Date: 20");
-    strcat(msg, year3);
-    strcat(msg, year4);
-    strcat(msg, "-");
-    strcat(msg, month);
-    strcat(msg, "-");
-    strcat(msg, day);
-    strcat(msg, " ");
-    strcat(msg, hour);
-    strcat(msg, ":");
-    strcat(msg, minute);
-  }
-  else if (cmd == 0x27) {
-    strcpy(msg, "Zone1 ");
-    zones = getBinaryData(word,41,8);
-    for (i = 0; i < 8; i++) {
-      sprintf(str, "%d, ", i + 1);
-      if (zones & (1 << i)) {
-        *(allZones + i) = 1;
-        strcat(msg, str);
-      } else {
-        *(allZones + i) = 0;
-      }
-    }
-    if (!zones) strcat(msg, "Ready ");
-  }
-  else if (cmd == 0x2d) {
-    strcpy(msg, "Zone2 ");
-    zones = getBinaryData(word,41,8);
-    for (i = 0; i < 8; i++) {
-      sprintf(str, "%d, ", i + 1);
-      if (zones & (1 << i)) {
-        *(allZones + i + 8) = 1;
-        strcat(msg, str);
-      } else {
-        *(allZones + i + 8) = 0;
-      }
-    }
-    if (!zones) strcat(msg, "Ready ");
-  }
-  else if (cmd == 0x34) {
-    strcpy(msg, "Zone3 ");
-    zones = getBinaryData(word,41,8);
-    for (i = 0; i < 8; i++) {
-      sprintf(str, "%d, ", i + 1);
-      if (zones & (1 << i)) {
-        *(allZones + i + 16) = 1;
-        strcat(msg, str);
-      } else {
-        *(allZones + i + 16) = 0;
-      }
-    }
-    if (!zones) strcat(msg, "Ready ");
-  }
-  else if (cmd == 0x3e) {
-    strcpy(msg, "Zone4 ");
-    zones = getBinaryData(word,41,8);
-    for (i = 0; i < 8; i++) {
-      sprintf(str, "%d, ", i + 1);
-      if (zones & (1 << i)) {
-        *(allZones + i + 24) = 1;
-        strcat(msg, str);
-      } else {
-        *(allZones + i + 24) = 0;
-      }
-    }
-    if (!zones) strcat(msg, "Ready ");
-  }
-  else if (cmd == 0x0a)
-    strcpy(msg, "Panel Program Mode");
-  else if (cmd == 0x63)
-    strcpy(msg, "Undefined command from panel");
-  else if (cmd == 0x64)
-    strcpy(msg, "Undefined command from panel");
-  else if (cmd == 0x69)
-    strcpy(msg, "Undefined command from panel");
-  else if (cmd == 0x5d)
-    strcpy(msg, "Undefined command from panel");
-  else if (cmd == 0x39)
-    strcpy(msg, "Undefined command from panel");
-  else if (cmd == 0xb1)
-    strcpy(msg, "Undefined command from panel");
-  else if (cmd == 0x11)
-    strcpy(msg, "Keypad query");
-  else if (cmd == 0xff) { // keypad to panel data
-    strcpy(msg, "From Keypad ");
-    if (getBinaryData(word,8,32) == 0xffffffff)
-      strcat(msg, "idle");
-    else { //bits 11~14 data; 15~16 CRC (not used)
-      button = getBinaryData(word,8,20);
-      if (button == 0x947ff)
-        strcat(msg, "button * pressed");
-      else if (button == 0x96fff)
-        strcat(msg, "button # pressed");
-      else if (button == 0x807ff)
-        strcat(msg, "button 0 pressed");
-      else if (button == 0x82fff)
-        strcat(msg, "button 1 pressed");
-      else if (button == 0x857ff)
-        strcat(msg, "button 2 pressed");
-      else if (button == 0x87fff)
-        strcat(msg, "button 3 pressed");
-      else if (button == 0x88fff)
-        strcat(msg, "button 4 pressed");
-      else if (button == 0x8b7ff)
-        strcat(msg, "button 5 pressed");
-      else if (button == 0x8dfff)
-        strcat(msg, "button 6 pressed");
-      else if (button == 0x8e7ff)
-        strcat(msg, "button 7 pressed");
-      else if (button == 0x917ff)
-        strcat(msg, "button 8 pressed");
-      else if (button == 0x93fff)
-        strcat(msg, "button 9 pressed");
-      else if (button == 0xd7fff)
-        strcat(msg, "stay button pressed");
-      else if (button == 0xd8fff)
-        strcat(msg, "away button pressed");
-      else
-        strcat(msg, "unknown keypad msg");
-    }
-  }
-  else
-    strcpy(msg, "Unknown command from panel");
+// metrics updates, only ever called by the counter's one writer thread
+static inline void metric_add(unsigned long *m, unsigned long v) {
+  __atomic_store_n(m, *m + v, __ATOMIC_RELAXED);
+}
 
-  return cmd; // return command associated with the message
+static inline void metric_inc(unsigned long *m) {
+  metric_add(m, 1);
+}
 
-} // decode
+static inline unsigned long metric_get(const unsigned long *m) {
+  return __atomic_load_n(m, __ATOMIC_RELAXED);
+}
 
-/*
- * panel io thread
- * Every INTERVAL seconds, this thread reads and writes bits to the panel's keybus interface.
- * The read bits are assembled into messages that get decoded by the message i/o thread.
- *
- */
-static void * panel_io(void *arg) {
-  char word[MAX_BITS] = "", wordkw[MAX_BITS] = "", wordkr[MAX_BITS] = "", wordkr_temp = '0';
-  int flag = 0, bit_cnt = 0, res;
-  struct timespec t, tmark;
+// Count a periodic thread's wake up that came a full period or more after its deadline t.
+static inline void metric_overrun(int loop, struct timespec *t, long period) {
+  struct timespec now;
 
-  // detach the thread since we don't care about its return status
-  res = pthread_detach(pthread_self());
-  if (res) {
-    perror("panel i/o thread detach failed\n");
-    exit(EXIT_FAILURE);
-  }
+  clk_now(&now);
+  if (now.tv_sec - t->tv_sec > 1 || ts_diff(&now, t) >= period) // ts_diff() is good for ~2 s
+    metric_inc(&metrics.overruns[loop]);
+}
 
-  memcpy(wordkw, IDLE, MAX_BITS);
-  clock_gettime(CLOCK_MONOTONIC, &t);
-  tmark = t;
-  while (1) {
-    t.tv_nsec += INTERVAL;
-    tnorm(&t);
-    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL);
+/*
+ * Record an event in the calling thread's trace ring.
+ * The ring is a flight recorder: it never blocks or fails, the oldest event is overwritten
+ *   when it is full. The cost is a vDSO clock read and a few stores.
+ */
+static inline void trace(int ring, uint32_t id, uint32_t a, uint32_t b) {
+  struct trace_ring *r = &traceRings[ring];
+  struct trace_event *e = &r->ev[r->head & (TRACE_LEN - 1)];
+  struct timespec t;
 
-    if ((GET_GPIO(PI_CLOCK_IN) == PI_CLOCK_HI) && !flag) { // write/read keypad data
-      if (ts_diff(&t, &tmark) > NEW_WORD_VALID) { // check for new word
-        /*
-         * Check to see if last word was less than 20 bits.
-         * Consider words with fewer than 20 bits to be invalid.
-         * If invalid, repeat last keypad write by not fetching new data from fifo.
-         * Also, do not store either panel or keypad data.
-         *
-         * Invalid words may be due to a real-time task with higher priority
-         *   than this thread preempting it, or latencies caused by page faults.
-         * Despite best efforts to make ensure robust real-time performance
-         *   these error checks are still required to be 100% safe.
-         *
-         * Panel also outputs short words (usually 9-bits) which are ignored as invalid
-         *   because thread needs at least 20 bits to send a valid data word to the panel
-         *   and to mitigate data corruption on the keybus since these short words are
-         *   usually associated with the simultaneous transfer of keypad data to the panel
-         *   (the keybus is bidirectional and bits are transferred on the rising and
-         *   falling edge of the clock). This keypad data is sent in response to a panel
-         *   keypad query command that was sent previously. These commands include those
-         *   messages starting with 0x051, 0x0593, 0x11 and possibly others. Note that
-         *   this means keypad to panel writes will not be logged since reads are skipped
-         *   when this condition is detected.
-         */
-        if (bit_cnt < 20) {
-          #ifdef VERBOSE
-          fprintf(stdout, "panel_io: bit count < 20 (%i)! Repeating panel writes and ignoring reads.\n", bit_cnt);
-          #endif
-        } else {
-          res = pushElement1(word, MAX_BITS); // store panel-> keypad data
-          if (res != MAX_BITS) {
-            fprintf(stderr, "panel_io: fifo write error\n"); // record error and continue
-          }
+  clk_now(&t);
+  e->sec = t.tv_sec;
+  e->nsec = t.tv_nsec;
+  e->id = id;
+  e->a = a;
+  e->b = b;
+  __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
 
-          res = pushElement1(wordkr, MAX_BITS); // store keypad-> panel data
-          if (res != MAX_BITS) {
-            fprintf(stderr, "panel_io: fifo write error\n");
-          }
+/*
+ * Copy the events of a ring from sequence number *from on, up to max of them.
+ * Events the writer overwrote before or during the copy are skipped and *from is moved
+ *   past the last event copied. Any number of readers may copy a ring at the same time.
+ * Returns the number of events copied.
+ */
+static int trace_copy(int ring, uint32_t *from, struct trace_event *out, int max) {
+  const struct trace_ring *r = &traceRings[ring];
+  uint32_t head, seq;
+  int n = 0, i;
+
+  head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+  if (head - *from >= TRACE_LEN) *from = head - TRACE_LEN + 1; // ev[head] may be in use
+  for (seq = *from; seq != head && n < max; seq++)
+    out[n++] = r->ev[seq & (TRACE_LEN - 1)];
+
+  // drop copies of slots that were reused while we read them
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+  for (i = 0; i < n && head - (*from + i) >= TRACE_LEN; i++);
+  memmove(out, out + i, (n - i) * sizeof(*out));
+  *from = seq;
+
+  return n - i;
+}
 
-          res = popElement2(wordkw, MAX_BITS); // get a keypad command to send to panel
-          if (res != MAX_BITS) { // fifo is empty so output idle instead of repeating previous
-            memcpy(wordkw, IDLE, MAX_BITS);
-          }
-        }
+// Append the decimal form of v, without stdio so it can be used from a signal handler.
+static char * trace_utoa(char *p, uint32_t v, int width) {
+  char tmp[10];
+  int n = 0;
 
-        // reset bit counter and arrays
-        bit_cnt = 0;
-        memset(&word, 0, MAX_BITS);
-        memset(&wordkr, 0, MAX_BITS);
-      }
+  do {
+    tmp[n++] = '0' + v % 10;
+    v /= 10;
+  } while (v);
+  while (width-- > n) *p++ = '0';
+  while (n) *p++ = tmp[--n];
 
-      tmark = t; // mark new word time
-      flag = 1; // set flag to indicate clock was high
-
-      // write keypad data bit to panel once every time clock is high
-      if (wordkw[bit_cnt] == '0') // invert
-        GPIO_SET = 1<<PI_DATA_OUT; // set GPIO
-      else if (wordkw[bit_cnt] == '1') // invert
-        GPIO_CLR = 1<<PI_DATA_OUT; // clear GPIO
-      else {
-        GPIO_CLR = 1<<PI_DATA_OUT; // clear GPIO
-        fprintf(stderr, "panel_io: bad element in keypad data array wordk\n");
-        //exit(EXIT_FAILURE);
-      }
+  return p;
+}
 
-      // read keypad data, including that just written
-      t.tv_nsec += KSAMPLE_OFFSET;
-      tnorm(&t);
-      clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL); // wait KSAMPLE_OFFSET for valid data
-      wordkr_temp = (GET_GPIO(PI_DATA_IN) == PI_DATA_HI) ? '0' : '1'; // invert
+// Format an event as a line of text. Returns its length, at most TRACE_LINE.
+static int trace_line(char *buf, int ring, const struct trace_event *e) {
+  static const char *events[NUM_EVENTS] = {
+    "short_word", "fifo_full", "bad_key_bit", "key_sent", "word", "fifo_read",
+    "status", "predict", "key_admit", "key_busy", "dl_refused",
+    "first_word", "rule", "rules", "rule_bad"
+  };
+  const char *name = (e->id < NUM_EVENTS) ? events[e->id] : "unknown";
+  char *p = buf;
+
+  p = trace_utoa(p, e->sec, 1);
+  *p++ = '.';
+  p = trace_utoa(p, e->nsec, 9);
+  *p++ = ' ';
+  p = stpcpy(p, traceRingNames[ring]);
+  *p++ = ' ';
+  p = stpcpy(p, name);
+  *p++ = ' ';
+  p = trace_utoa(p, e->a, 1);
+  *p++ = ' ';
+  p = trace_utoa(p, e->b, 1);
+  *p++ = '\n';
+
+  return p - buf;
+}
 
-      t.tv_nsec += HOLD_DATA;
-      tnorm(&t);
-      clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL); // wait HOLD_DATA time
-      GPIO_CLR = 1<<PI_DATA_OUT; // leave with GPIO cleared
+/*
+ * Write the last events of every ring to fd, ring by ring.
+ * Only uses async-signal-safe calls so it can run from the fault handler.
+ */
+static void trace_dump(int fd) {
+  struct trace_event e;
+  char line[TRACE_LINE];
+  uint32_t head, seq;
+  int ring;
+
+  for (ring = 0; ring < NUM_RINGS; ring++) {
+    head = __atomic_load_n(&traceRings[ring].head, __ATOMIC_ACQUIRE);
+    seq = (head >= TRACE_LEN) ? head - TRACE_LEN + 1 : 0;
+    for (; seq != head; seq++) {
+      e = traceRings[ring].ev[seq & (TRACE_LEN - 1)];
+      if (write(fd, line, trace_line(line, ring, &e)) == -1) return;
     }
-    else if ((GET_GPIO(PI_CLOCK_IN) == PI_CLOCK_LO) && flag) { // read panel data
-      flag = 0;
+  }
+}
 
-      t.tv_nsec += SAMPLE_OFFSET;
-      tnorm(&t);
-      clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL); // wait SAMPLE_OFFSET for valid data
-      wordkr[bit_cnt] = wordkr_temp;
-      word[bit_cnt++] = (GET_GPIO(PI_DATA_IN) == PI_DATA_HI) ? '0' : '1'; // invert
+// SIGUSR1 asks the trace drainer for a dump of the flight recorder.
+static void trace_sigusr1(int sig) {
+  traceDump = 1;
+  sem_post(&traceWake);
+}
 
-      if (bit_cnt >= MAX_BITS) bit_cnt = (MAX_BITS - 1); // never let bit_cnt exceed MAX_BITS
-    }
-  }
-} // panel_io thread
+// On a crash, dump the flight recorder to stderr and die from the same signal.
+static void trace_fault(int sig) {
+  static const char msg[] = "kprw-server: fatal signal, last trace events follow\n";
+
+  if (write(STDERR_FILENO, msg, sizeof(msg) - 1) > 0)
+    trace_dump(STDERR_FILENO);
+  signal(sig, SIG_DFL);
+  raise(sig);
+}
 
 /*
- * message i/o thread
- * This thread runs every MSG_IO_UPDATE seconds and decodes the messages created by the panel i/o thread.
- * It also prints the panel and keypad traffic to stdout.
- *
+ * Every block of the status snapshot is guarded by a sequence lock of its own.
+ * A block has exactly one writer (msg_io for the zone and LED blocks, predict for the
+ *   prediction block), so writers take no lock. A writer makes the sequence number of the
+ *   blocks it updates odd for the duration of the update. Readers never block a writer,
+ *   they copy and retry if a sequence number moved while they did.
+ * The status version is the sum of the block versions, so every completed block update
+ *   is a new status version.
  */
-static void * msg_io(void * arg) {
-  int cmd, res, zone, allZones[NUMZONES];
-  char msg[50] = "";
-  char word[MAX_BITS] = "", wordk[MAX_BITS] = "";
-  struct timespec t;
-  struct status * sptr = (struct status *) arg;
+static inline unsigned long * block_seq(struct status *s, int blk) {
+  return (blk == BLK_ZONE) ? &s->zone.seq : (blk == BLK_LED) ? &s->led.seq : &s->pred.seq;
+}
 
-  #ifdef VERBOSE
-  long unsigned int index = 0;
-  int data0, data1, data2, data3;
-  int data4, data5, data6, data7;
-  char buf[4*128] = "";
-  #endif
+static void shm_publish(const struct status *s, int blocks);
 
-  // detach the thread since we don't care about its return status
-  res = pthread_detach(pthread_self());
-  if (res) {
-    perror("message i/o thread detach failed\n");
-    exit(EXIT_FAILURE);
-  }
+static void status_write_begin(struct status *s, int blocks) {
+  int blk;
 
-  // clear zone activity marker arrays
-  memset(&allZones, 0, sizeof(allZones));
+  for (blk = BLK_ZONE; blk < BLK_ALL; blk <<= 1)
+    if (blocks & blk)
+      __atomic_store_n(block_seq(s, blk), *block_seq(s, blk) + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
 
-  memcpy(wordk, IDLE, MAX_BITS);
-  clock_gettime(CLOCK_MONOTONIC, &t);
-  while (1) {
-    t.tv_nsec += MSG_IO_UPDATE; // thread runs every MSG_IO_UPDATE seconds
-    tnorm(&t);
-    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL);
+static void status_write_end(struct status *s, int blocks) {
+  int blk;
 
-    // Get raw data from fifo. Panel and keypad data are interleaved in the fifo.
-    res = popElement1(word, MAX_BITS);
-    if (!res) { // fifo is empty (res == 0)
-      continue;
-    } else if (res != MAX_BITS) { // fifo read error
-      fprintf(stderr, "msg_io: fifo read error\n"); // record error and continue
-      continue;
-    } else if (res == MAX_BITS) { // fifo has valid data
-      // todo : add CRC check of raw data
-      cmd = decode(word, msg, allZones); // decode word from panel into a message
-      // update LED and zone status information
-      if (cmd == 0x05) strcpy(sptr->ledStatus, msg);
-      if (cmd == 0x27) strcpy(sptr->zone1Status, msg);
-      if (cmd == 0x2d) strcpy(sptr->zone2Status, msg);
-      if (cmd == 0x34) strcpy(sptr->zone3Status, msg);
-      if (cmd == 0x3e) strcpy(sptr->zone4Status, msg);
-
-      // update zone sensor activity and deactivity markers
-      for (zone = 0; zone < NUMZONES; zone++) {
-        if (allZones[zone]) { // zone is currently active
-          if (sptr->zoneAct[zone] <= sptr->zoneDeAct[zone]) { // zone was marked inactive
-            sptr->zoneAct[zone] = t.tv_sec; // zone is now active, so record time
-          }
-        } else { // zone is currently not active
-          if (sptr->zoneDeAct[zone] < sptr->zoneAct[zone]) { // zone was marked active
-            sptr->zoneDeAct[zone] = t.tv_sec; // zone is now not active, so record time
-          }
-        }
-      }
+  if (shm && s == &buses[0].status) shm_publish(s, blocks); // the segment holds bus 0
+  for (blk = BLK_ZONE; blk < BLK_ALL; blk <<= 1)
+    if (blocks & blk)
+      __atomic_store_n(block_seq(s, blk), *block_seq(s, blk) + 1, __ATOMIC_RELEASE);
+}
 
-      // update zone sensor observation time
-      sptr->obsTime = t.tv_sec;
+// Current status version.
+static inline unsigned long status_version(const struct status *s) {
+  return (__atomic_load_n(&s->zone.seq, __ATOMIC_ACQUIRE) +
+          __atomic_load_n(&s->led.seq, __ATOMIC_ACQUIRE) +
+          __atomic_load_n(&s->pred.seq, __ATOMIC_ACQUIRE)) >> 1;
+}
+
+/*
+ * Take a consistent copy of the zone block only, for readers that need nothing else.
+ * Writes to the LED and prediction blocks do not make it retry.
+ */
+static void zone_read(const struct status *s, struct zone_block *copy) {
+  const struct timespec backoff = {0, 10000}; // 10 us
+  unsigned long seq;
+  int tries = 0;
 
-      #ifdef VERBOSE
-      // get raw data bytes
-      data0 = getBinaryData(word,0,8);  data1 = getBinaryData(word,8,8);
-      data2 = getBinaryData(word,16,8); data3 = getBinaryData(word,24,8);
-      data4 = getBinaryData(word,32,8); data5 = getBinaryData(word,40,8);
-      data6 = getBinaryData(word,48,8); data7 = getBinaryData(word,56,8);
-      snprintf(buf, sizeof(buf),
-               "index:%lu,%-50s, data: 0x%02x 0x%02x 0x%02x 0x%02x 0x%02x 0x%02x 0x%02x 0x%02x\n",
-               index++, msg, data0, data1, data2, data3, data4, data5, data6, data7);
-      fputs(buf, stdout); // display message output of panel and keypad data
-      fflush(stdout);
-      #endif
+  for (;;) {
+    seq = __atomic_load_n(&s->zone.seq, __ATOMIC_ACQUIRE);
+    if (!(seq & 1)) {
+      memcpy(copy, &s->zone, sizeof(*copy));
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (seq == __atomic_load_n(&s->zone.seq, __ATOMIC_RELAXED)) break;
     }
+    if (++tries > 100) nanosleep(&backoff, NULL);
+  }
+} // zone_read()
 
-  } // while
+/*
+ * Take a consistent copy of the whole status snapshot and return its version.
+ * All blocks are copied as of one moment, so the version identifies the copy.
+ * A reader may be spinning on the core of a preempted lower priority writer (predict),
+ *   so after a few tries it sleeps to let the writer finish.
+ */
+static unsigned long status_read(const struct status *s, struct status *copy) {
+  const struct timespec backoff = {0, 10000}; // 10 us
+  unsigned long z, l, p;
+  int tries = 0;
 
-} // msg_io
+  for (;;) {
+    z = __atomic_load_n(&s->zone.seq, __ATOMIC_ACQUIRE);
+    l = __atomic_load_n(&s->led.seq, __ATOMIC_ACQUIRE);
+    p = __atomic_load_n(&s->pred.seq, __ATOMIC_ACQUIRE);
+    if (!((z | l | p) & 1)) {
+      memcpy(copy, s, offsetof(struct status, obsTime)); // all three blocks
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (z == __atomic_load_n(&s->zone.seq, __ATOMIC_RELAXED) &&
+          l == __atomic_load_n(&s->led.seq, __ATOMIC_RELAXED) &&
+          p == __atomic_load_n(&s->pred.seq, __ATOMIC_RELAXED)) break;
+    }
+    if (++tries > 100) nanosleep(&backoff, NULL);
+  }
+  copy->obsTime = __atomic_load_n(&s->obsTime, __ATOMIC_RELAXED);
+
+  return (z + l + p) >> 1;
+} // status_read()
 
 /*
- * predict thread
- * This thread runs every PREDICT_UPDATE seconds and sends sensor data to R to make a prediction.
- * It also reads the prediction from R and does something if true.
- *
+ * Copy the blocks of the status being updated into shared memory, each under its own
+ *   sequence number in the segment, which ends up equal to that of the block in struct status.
+ * Called by the blocks' one writer from status_write_end().
  */
-static void * predict(void * arg) {
-  int res;
-  int i, j, occ = 0, val, lastDoorCloseTime = 0, maxOcc = 0;
-  int intZone[] = INTZONES;
-  int size = sizeof(intZone) / sizeof *(intZone);
-  long int rPredProb[4], pop = 0, predNoClk = 0, probNoClk = 0;
-  long int predClk = 0, probClk = 0, pred = 0, prob = 0;
-  char *p;
-  char rout[ROUT_MAX];
-  char tsBuf[TS_BUF_SIZE];
-  char sysCmd[SCMD_BUF_SIZE];
-  char popenCmd[PCMD_BUF_SIZE];
-  char obsTimeBuf[RARG_SIZE] = "", zoneBuf[RARG_SIZE] = "", oldZoneBuf[RARG_SIZE] = "";
-  const char * format = " %lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,"
-                        "%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,"
-                        "%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,"
-                        "%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu";
-  struct timespec t;
-  struct status * sptr = (struct status *) arg;
-  struct tm *tmp;
-  time_t tstamp;
-  FILE * fp;
+static void shm_publish(const struct status *s, int blocks) {
+  struct kprw_status *d = &shm->status;
+  int i;
 
-  // detach the thread since we don't care about its return status
-  res = pthread_detach(pthread_self());
-  if (res) {
-    perror("predict thread detach failed\n");
-    exit(EXIT_FAILURE);
+  if (blocks & BLK_ZONE) {
+    __atomic_store_n(&shm->seq[KPRW_BLK_ZONE], s->zone.seq, __ATOMIC_RELAXED); // odd
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    for (i = 0; i < KPRW_SHM_ZONES; i++) {
+      d->zoneAct[i] = s->zone.zoneAct[i] / 1000; // seconds, like the JSON status
+      d->zoneDeAct[i] = s->zone.zoneDeAct[i] / 1000;
+    }
+    __atomic_store_n(&shm->seq[KPRW_BLK_ZONE], s->zone.seq + 1, __ATOMIC_RELEASE);
+  }
+  if (blocks & BLK_LED) {
+    __atomic_store_n(&shm->seq[KPRW_BLK_LED], s->led.seq, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    d->ledBits = s->led.ledBits;
+    strncpy(d->ledStatus, s->led.ledStatus, KPRW_SHM_STR - 1);
+    for (i = 0; i < 4; i++)
+      strncpy(d->zoneStatus[i], s->led.zoneStatus[i], KPRW_SHM_STR - 1);
+    __atomic_store_n(&shm->seq[KPRW_BLK_LED], s->led.seq + 1, __ATOMIC_RELEASE);
+  }
+  if (blocks & BLK_PRED) {
+    __atomic_store_n(&shm->seq[KPRW_BLK_PRED], s->pred.seq, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    d->numOcc = s->pred.numOcc;
+    for (i = 0; i < KPRW_SHM_PRED; i++) {
+      d->lastTruePredTime[i] = s->pred.lastTruePredTime[i];
+      strncpy(d->lastTruePred[i], s->pred.lastTruePred[i], KPRW_SHM_TS - 1);
+    }
+    __atomic_store_n(&shm->seq[KPRW_BLK_PRED], s->pred.seq + 1, __ATOMIC_RELEASE);
   }
+} // shm_publish()
 
-  // init prediction / probability array
-  memset(&rPredProb, 0, sizeof(rPredProb));
+// Update the observation time, which like in struct status is not covered by the sequence locks.
+static inline void status_set_obs_time(struct status *s, uint64_t obsTime) {
+  __atomic_store_n(&s->obsTime, obsTime, __ATOMIC_RELAXED);
+  if (shm && s == &buses[0].status)
+    __atomic_store_n(&shm->obsTime, obsTime / 1000, __ATOMIC_RELAXED);
+} // status_set_obs_time()
 
-  clock_gettime(CLOCK_MONOTONIC, &t);
-  while (1) {
-    t.tv_nsec += PREDICT_UPDATE; // thread runs every PREDICT_UPDATE seconds
-    tnorm(&t);
-    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL);
+/*
+ * Create the shared memory segment described in kprw-shm.h and publish the initial status.
+ * Local readers are a convenience, so the server carries on without them if this fails.
+ */
+static void shm_init(struct status *s) {
+  struct kprw_shm *m;
+  int fd;
+
+  fd = shm_open(KPRW_SHM_NAME, O_CREAT | O_RDWR, 0644);
+  if (fd == -1) {
+    perror("server: shm_open failed, status not published in shared memory\n");
+    return;
+  }
+  fchmod(fd, 0644); // readable by local non-root readers whatever the umask
+  if (ftruncate(fd, sizeof(*m)) == -1) {
+    perror("server: ftruncate failed, status not published in shared memory\n");
+    close(fd);
+    return;
+  }
+  m = mmap(NULL, sizeof(*m), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (m == MAP_FAILED) {
+    perror("server: mmap failed, status not published in shared memory\n");
+    return;
+  }
 
-    // Time and date stamp observation, rounded to nearest second
-    tstamp = time(NULL);
-    tmp = gmtime(&tstamp); // Coordinated Universal Time (UTC) aka GMT timezone
-    if (tmp == NULL) {
-      perror("gmtime failed\n");
-      exit(EXIT_FAILURE);
-    }
-    if (!strftime(tsBuf, sizeof(tsBuf), "%FT%TZ", tmp)) {
-      fprintf(stderr, "strftime returned 0\n");
-      exit(EXIT_FAILURE);
+  // the status writers have not started yet, magic is set last to mark the segment valid
+  // a valid segment left by an earlier server is not cleared under its readers, all of it
+  //   is republished below
+  if (m->magic != KPRW_SHM_MAGIC || m->layout != KPRW_SHM_LAYOUT || m->size != sizeof(*m))
+    memset(m, 0, sizeof(*m));
+  m->layout = KPRW_SHM_LAYOUT;
+  m->size = sizeof(*m);
+  m->obsTime = s->obsTime / 1000;
+  shm = m;
+  status_write_begin(s, BLK_ALL); // publish the initial status as an update of every block
+  status_write_end(s, BLK_ALL);
+  __atomic_store_n(&m->magic, KPRW_SHM_MAGIC, __ATOMIC_RELEASE);
+} // shm_init()
+
+// Panel LED status lights of a 0x05 word as LED_ flags.
+static inline unsigned char led_bits(char *word) {
+  unsigned char bits = 0;
+
+  #define X(flag, field, text) if (FIELD(word, field)) bits |= (flag);
+  KEYBUS_LEDS(X)
+  #undef X
+
+  return bits;
+}
+
+/*
+ * Checksum of a key code, the sum of its 2-bit groups modulo 4.
+ * Key words from a keypad that do not carry it are reported as unknown.
+ */
+static inline int key_sum(int code) {
+  return ((code >> 4) + (code >> 2) + code) & 3;
+}
+
+// Text of a key code, NULL if the code is not in KEYPAD_KEYS.
+static const char * key_text(int code) {
+  switch (code) {
+    #define X(name, code, text) case name: return text;
+    KEYPAD_KEYS(X)
+    #undef X
+    default: return NULL;
+  }
+}
+
+// Build the keypad word that sends the key with code to the panel.
+static void key_encode(int code, char *word) {
+  memcpy(word, IDLE, MAX_BITS);
+  setBinaryData(word, F_KEY_CODE_OFF, F_KEY_CODE_LEN, code);
+  setBinaryData(word, F_KEY_SUM_OFF, F_KEY_SUM_LEN, key_sum(code));
+}
+
+// Message decoders, see KEYBUS_MSGS. Each appends to msg at p and returns the new end.
+
+static char * decode_text(char *word, char *p, int arg, int *allZones) {
+  return p;
+}
+
+static char * decode_led(char *word, char *p, int arg, int *allZones) {
+  unsigned char bits = led_bits(word);
+
+  if (!(bits & LED_READY)) p = stpcpy(p, "Not Ready, "); // the one light listed when off
+  #define X(flag, field, text) if (bits & (flag)) p = stpcpy(p, text);
+  KEYBUS_LEDS(X)
+  #undef X
+
+  return p;
+}
+
+static char * decode_date(char *word, char *p, int arg, int *allZones) {
+  p = trace_utoa(p, FIELD(word, F_YEAR3), 1);
+  p = trace_utoa(p, FIELD(word, F_YEAR4), 1);
+  *p++ = '-';
+  p = trace_utoa(p, FIELD(word, F_MONTH), 1);
+  *p++ = '-';
+  p = trace_utoa(p, FIELD(word, F_DAY), 1);
+  *p++ = ' ';
+  p = trace_utoa(p, FIELD(word, F_HOUR), 1);
+  *p++ = ':';
+  p = trace_utoa(p, FIELD(word, F_MINUTE), 1);
+
+  return p;
+}
+
+static char * decode_zones(char *word, char *p, int arg, int *allZones) {
+  int i, zones = FIELD(word, F_ZONES);
+
+  for (i = 0; i < 8; i++) {
+    allZones[arg + i] = (zones >> i) & 1;
+    if (allZones[arg + i]) {
+      *p++ = '1' + i;
+      p = stpcpy(p, ", ");
     }
+  }
+  if (!zones) p = stpcpy(p, "Ready ");
 
-    // Build strings from observation data for Rscript arguments
-    snprintf(obsTimeBuf, sizeof(obsTimeBuf), " %lu", sptr->obsTime);
-    snprintf(zoneBuf, sizeof(zoneBuf), format,
-             sptr->zoneAct[0],  sptr->zoneAct[1],  sptr->zoneAct[2],  sptr->zoneAct[3],
-             sptr->zoneAct[4],  sptr->zoneAct[5],  sptr->zoneAct[6],  sptr->zoneAct[7],
-             sptr->zoneAct[8],  sptr->zoneAct[9],  sptr->zoneAct[10], sptr->zoneAct[11],
-             sptr->zoneAct[12], sptr->zoneAct[13], sptr->zoneAct[14], sptr->zoneAct[15],
-             sptr->zoneAct[16], sptr->zoneAct[17], sptr->zoneAct[18], sptr->zoneAct[19],
-             sptr->zoneAct[20], sptr->zoneAct[21], sptr->zoneAct[22], sptr->zoneAct[23],
-             sptr->zoneAct[24], sptr->zoneAct[25], sptr->zoneAct[26], sptr->zoneAct[27],
-             sptr->zoneAct[28], sptr->zoneAct[29], sptr->zoneAct[30], sptr->zoneAct[31],
-             sptr->zoneDeAct[0],  sptr->zoneDeAct[1],  sptr->zoneDeAct[2],  sptr->zoneDeAct[3],
-             sptr->zoneDeAct[4],  sptr->zoneDeAct[5],  sptr->zoneDeAct[6],  sptr->zoneDeAct[7],
-             sptr->zoneDeAct[8],  sptr->zoneDeAct[9],  sptr->zoneDeAct[10], sptr->zoneDeAct[11],
-             sptr->zoneDeAct[12], sptr->zoneDeAct[13], sptr->zoneDeAct[14], sptr->zoneDeAct[15],
-             sptr->zoneDeAct[16], sptr->zoneDeAct[17], sptr->zoneDeAct[18], sptr->zoneDeAct[19],
-             sptr->zoneDeAct[20], sptr->zoneDeAct[21], sptr->zoneDeAct[22], sptr->zoneDeAct[23],
-             sptr->zoneDeAct[24], sptr->zoneDeAct[25], sptr->zoneDeAct[26], sptr->zoneDeAct[27],
-             sptr->zoneDeAct[28], sptr->zoneDeAct[29], sptr->zoneDeAct[30], sptr->zoneDeAct[31]);
+  return p;
+}
 
-    if (strcmp(zoneBuf, oldZoneBuf)) { // only run on zone changes
-      // try to predict number of occupants based on sensor activity
-      if (sptr->zoneDeAct[EXITZONE] > lastDoorCloseTime) { // exterior zone triggered
-        maxOcc = 0; // reset occupant counter since at least one person probably exited the house
-        lastDoorCloseTime = sptr->zoneDeAct[EXITZONE];
-      } else {
-        for (j = 0; j < size; j++) { // scan through zones looking for activity
-          if (!(sptr->obsTime - sptr->zoneAct[intZone[j]])) occ = 1; // single person detect
-          for (i = j; i < size; i++) { // multiple person detect
-            val = abs(sptr->zoneAct[intZone[j]] - sptr->zoneAct[intZone[i]]);
-            if ((val > CONZONELL) && (val < CONZONEUL)) { // find zones activated within limits
-              occ++;
-            }
-          }
-        }
-      }
-      if (occ > maxOcc) maxOcc = occ; // max hold
-      sptr->numOcc = maxOcc;
-      occ = 0;
+static char * decode_keypad(char *word, char *p, int arg, int *allZones) {
+  const char *text;
+  int code;
 
-      #ifdef RLOG
-      int rLogFp;
-      /* Open the R log file for writing. If it exists, append to it;
-         otherwise, create a new file.  */
-      rLogFp = open(RLOG, O_WRONLY | O_CREAT | O_APPEND, 0666);
-      if (rLogFp == -1) {
-        perror ("R log open() failed\n");
-        continue;
-      }
-      #endif
+  if (FIELD(word, F_KEYPAD) == 0xffffffff)
+    return stpcpy(p, "idle");
 
-      // Build and execute command to run Rscript
-      snprintf(popenCmd, PCMD_BUF_SIZE, POPEN_FMT, tsBuf, obsTimeBuf, zoneBuf);
-      fp = popen(popenCmd, "r");
-      if (fp == NULL) {
-        fprintf(stderr, "popen() failed\n");
-        continue;
-      }
+  code = FIELD(word, F_KEY_CODE);
+  text = key_text(code);
+  if (!text || !FIELD(word, F_KEY_START) || FIELD(word, F_KEY_SUM) != key_sum(code) ||
+      FIELD(word, F_KEY_STOP) != (1U << F_KEY_STOP_LEN) - 1)
+    text = "unknown keypad msg";
 
-      // Read output of Rscript until EOF, log and act on R's predictions
-      while (fgets(rout, ROUT_MAX, fp) != NULL) {
-        #ifdef RLOG
-        res = write(rLogFp, rout, strlen(rout));
-        if (res != strlen(rout)) {
-          perror("R log write() failed\n");
-          continue;
-        }
-        #endif
+  return stpcpy(p, text);
+}
 
-        #ifdef VERBOSE
-        fprintf(stdout, "%s", rout);
-        #endif
+/*
+ * Decode bits from panel into commands and messages.
+ * msg must hold 50 chars. Zone messages also mark their 8 zones open or closed in allZones.
+ */
+static int decode(char * word, char * msg, int * allZones) {
+  int cmd = FIELD(word, F_CMD);
+  char *p = msg;
+
+  switch (cmd) {
+    #define X(code, decoder, text, arg) \
+      case code: p = decode_##decoder(word, stpcpy(msg, text), arg, allZones); break;
+    KEYBUS_MSGS(X)
+    #undef X
+    default:
+      p = stpcpy(msg, "Unknown command from panel");
+  }
+  *p = '\0';
 
-        /*
-         * Parse prediction number and its probability from R's output.
-         * Assumes output is in the form "pred: n prob: .pp"
-         * where n is the prediction number and pp is its probability.
-         *
-         */
-        if (strstr(rout, "pred:") != NULL) { // found a prediction in R's output...
+  return cmd; // return command associated with the message
 
-          // Extract predictions and probabilities.
-          p = rout;
-          i = 0;
-          while (*p) { // While there are more characters to process...
-            if (isdigit(*p)) { // Upon finding a digit, ...
-              pop = strtol(p, &p, 10); // Read pred or prob
-              rPredProb[i++] = pop; // pred is 1st element, prob is 2nd
-            } else { // Otherwise, move on to the next character.
-              p++;
-            }
-          }
+} // decode
 
-          predNoClk = rPredProb[0]; // prediction w/o clock as predictor
-          probNoClk = rPredProb[1]; // probability w/o clock as predictor
-          predClk   = rPredProb[2]; // prediction w/clock as predictor
-          probClk   = rPredProb[3]; // probability w/o clock as predictor
+/*
+ * Wait for the sample instant t.
+ * With a spin guard the thread sleeps until cfg.spinGuard before t and spins on the clock
+ *   from there, so the wake up latency is absorbed by the guard band instead of moving the
+ *   sample. The spin never lasts longer than the guard. A wake up that comes after t
+ *   is counted as late and the sample is taken at once, as without a guard.
+ */
+static inline void sample_wait(struct timespec *t) {
+  struct timespec w, now, start;
 
-          /*
-           * Apply rules to the predictions from both models.
-           * If both models predict the same pattern, choose the higher probability prediction.
-           * (In the case of both models making the same non-null prediction, a higher probability
-           * pattern from the model using clock as a predictor is likely a timed pattern.)
-           * If one model hasn't identified any pattern and the other has, pick the non-null case.
-           *
-           */
-          if (predNoClk == predClk) {
-            pred = (probClk > probNoClk) ? predClk : predNoClk;
-            prob = (probClk > probNoClk) ? probClk : probNoClk;
-          } else if (predClk && !predNoClk) {
-            pred = predClk;
-            prob = probClk;
-          } else if (!predClk && predNoClk) {
-            pred = predNoClk;
-            prob = probNoClk;
-          }
+  if (!cfg.spinGuard) {
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, t, NULL);
+    return;
+  }
+
+  w = *t;
+  w.tv_nsec -= cfg.spinGuard;
+  if (w.tv_nsec < 0) {
+    w.tv_nsec += NSEC_PER_SEC;
+    w.tv_sec--;
+  }
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &w, NULL) == EINTR);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (ts_diff(t, &start) <= 0) {
+    metric_inc(&metrics.spinLate);
+    return;
+  }
+  do
+    clock_gettime(CLOCK_MONOTONIC, &now);
+  while (ts_diff(t, &now) > 0);
+
+  metric_inc(&metrics.spinWaits);
+  __atomic_store_n(&metrics.spinNs, metrics.spinNs + ts_diff(&now, &start), __ATOMIC_RELAXED);
+} // sample_wait()
+
+/*
+ * SCHED_DEADLINE, not in every libc's headers yet.
+ * The kernel only admits a deadline thread whose cpu affinity spans its whole root domain,
+ *   and only while the deadline threads together stay within the rt bandwidth limit
+ *   (/proc/sys/kernel/sched_rt_runtime_us).
+ */
+#ifndef SCHED_DEADLINE
+#define SCHED_DEADLINE 6
+#endif
+#define SCHED_FLAG_DL_OVERRUN 0x04 // send SIGXCPU when the thread overruns its runtime
+
+struct dl_attr { // struct sched_attr of sched_setattr(2)
+  uint32_t size;
+  uint32_t sched_policy;
+  uint64_t sched_flags;
+  int32_t sched_nice;
+  uint32_t sched_priority;
+  uint64_t sched_runtime, sched_deadline, sched_period; // nanoseconds
+};
+
+static __thread int dlLoop = -1; // loop of the calling thread while it is a deadline thread
+
+// SIGXCPU handler, the kernel signals a deadline thread that used up its runtime.
+// The signal is sent to the process but taken by the overrunning thread when it can.
+static void dl_overrun(int sig) {
+  if (dlLoop >= 0) metric_inc(&metrics.dlOverruns[dlLoop]);
+}
+
+/*
+ * Move the calling periodic thread to SCHED_DEADLINE, with runtime ns of cpu time
+ *   guaranteed in every period ns and a deadline at the end of the period.
+ * If its pinned cpus are refused, the thread is let run on any cpu instead.
+ * Returns 0, or -1 with errno set and the thread left as it was, SCHED_FIFO on its cpus.
+ */
+static int sched_deadline(int loop, uint64_t runtime, uint64_t period) {
+  struct dl_attr attr = {
+    .size = sizeof(attr),
+    .sched_policy = SCHED_DEADLINE,
+    .sched_flags = SCHED_FLAG_DL_OVERRUN,
+    .sched_runtime = runtime,
+    .sched_deadline = period,
+    .sched_period = period,
+  };
+  cpu_set_t pinned, all;
+  int i, err;
+
+  if (!syscall(SYS_sched_setattr, 0, &attr, 0)) goto admitted;
+  if (errno != EPERM) return -1; // EBUSY: no bandwidth left, EINVAL: no SCHED_DEADLINE
+
+  // EPERM: the affinity does not span a root domain
+  pthread_getaffinity_np(pthread_self(), sizeof(pinned), &pinned);
+  CPU_ZERO(&all);
+  for (i = 0; i < sysconf(_SC_NPROCESSORS_ONLN); i++) CPU_SET(i, &all);
+  if (!pthread_setaffinity_np(pthread_self(), sizeof(all), &all) &&
+      !syscall(SYS_sched_setattr, 0, &attr, 0)) goto admitted;
+  err = errno;
+  pthread_setaffinity_np(pthread_self(), sizeof(pinned), &pinned);
+  errno = err;
+  return -1;
+
+admitted:
+  dlLoop = loop;
+  __atomic_store_n(&metrics.deadline[loop], 1, __ATOMIC_RELAXED);
+  return 0;
+} // sched_deadline()
+
+/*
+ * Store the word bus b has finished reading at time t, and the keypad data read alongside
+ *   it, both stamped with the ms of the word's last clock edge, when it was actually captured.
+ * The panel repeats its light, zone and keypad query words over and over. A word that is
+ *   the same as the last one with its command byte, keypad data included, is only counted,
+ *   unless nothing was queued for WORD_KEEPALIVE: msg_io gets a word at least that often,
+ *   so a quiet fifo means a dead bus.
+ * The two words go in together or not at all, msg_io takes them as a pair, and only a
+ *   word that was queued counts as the last one.
+ * Returns 1, or 0 if the word had fewer than 20 bits and was dropped, see bus_step().
+ */
+static inline int word_end(struct bus *b, struct timespec *t) {
+  unsigned int cmd;
+
+  if (b->bitCnt < 20) {
+    if (b->bitCnt) { // none after panel_io resumed from a handoff that did not happen
+      metric_inc(&metrics.shortWords[b->id]);
+      trace(RING_PANEL_IO, EV_SHORT_WORD, b->bitCnt, b->id);
+    }
+    return 0;
+  }
+
+  metric_inc(&metrics.panelWords[b->id]);
+  cmd = getBinaryData(b->word, 0, 8);
+  if (!memcmp(b->word, b->lastWords[cmd].word, MAX_BITS) &&
+      !memcmp(b->wordkr, b->lastWords[cmd].wordkr, MAX_BITS) &&
+      t->tv_sec - b->lastQueued.tv_sec <= 1 && // ts_diff() is good for ~2 s
+      ts_diff(t, &b->lastQueued) < WORD_KEEPALIVE) {
+    metric_inc(&metrics.repeats[b->id][cmd]);
+    return 1;
+  }
+
+  if (roomElement1(b, MAX_BITS) < 2) {
+    trace(RING_PANEL_IO, EV_FIFO_FULL, 0, b->id); // record error and continue
+    return 1;
+  }
+  pushElement1(b, b->word, MAX_BITS, ts_ms(&b->tmark));   // store panel-> keypad data
+  pushElement1(b, b->wordkr, MAX_BITS, ts_ms(&b->tmark)); // store keypad-> panel data
+  memcpy(b->lastWords[cmd].word, b->word, MAX_BITS);
+  memcpy(b->lastWords[cmd].wordkr, b->wordkr, MAX_BITS);
+  b->lastQueued = *t;
+
+  return 1;
+} // word_end()
+
+// Start reading bus b from time t, at the start of a word.
+static void bus_start(struct bus *b, struct timespec *t) {
+  b->step = PIO_POLL;
+  b->due = *t;
+  b->tmark = *t;
+  b->flag = 0;
+  b->bitCnt = 0;
+  b->parked = 0;
+  memset(b->word, 0, MAX_BITS);
+  memset(b->wordkr, 0, MAX_BITS);
+} // bus_start()
 
+/*
+ * Take the step of bus b that is due at b->due and schedule its next one.
+ * Every INTERVAL the clock is polled. A clock edge is followed by the steps that write and
+ *   read the data, each at its own offset from the edge, which panel_io may interleave with
+ *   the steps of other buses.
+ */
+static inline void bus_step(struct bus *b) {
+  long next = INTERVAL;
+
+  switch (b->step) {
+    case PIO_POLL:
+      // leave the keybus between two words to a new instance taking over, see handoff_serve()
+      if (__atomic_load_n(&handoffPark, __ATOMIC_ACQUIRE) && !b->flag &&
+          ts_diff(&b->due, &b->tmark) > NEW_WORD_VALID) {
+        if (word_end(b, &b->due))
+          memcpy(b->wordkw, IDLE, MAX_BITS); // sent, else it is sent again with the next word
+        memcpy(b->heldKey, b->wordkw, MAX_BITS);
+        b->parked = 1;
+        return;
+      }
+
+      if ((GET_GPIO(b->clockIn) == PI_CLOCK_HI(b)) && !b->flag) { // write/read keypad data
+        if (ts_diff(&b->due, &b->tmark) > NEW_WORD_VALID) { // check for new word
           /*
-           * Do something with the prediction.
-           * For now, just call a script to turn on / off the Wemo switches in the house.
-           * A more flexible mapping of predictions to actions will be needed at some point.
+           * Check to see if last word was less than 20 bits.
+           * Consider words with fewer than 20 bits to be invalid.
+           * If invalid, repeat last keypad write by not fetching new data from fifo.
+           * Also, do not store either panel or keypad data.
            *
+           * Invalid words may be due to a real-time task with higher priority
+           *   than this thread preempting it, or latencies caused by page faults.
+           * Despite best efforts to make ensure robust real-time performance
+           *   these error checks are still required to be 100% safe.
+           *
+           * Panel also outputs short words (usually 9-bits) which are ignored as invalid
+           *   because thread needs at least 20 bits to send a valid data word to the panel
+           *   and to mitigate data corruption on the keybus since these short words are
+           *   usually associated with the simultaneous transfer of keypad data to the panel
+           *   (the keybus is bidirectional and bits are transferred on the rising and
+           *   falling edge of the clock). This keypad data is sent in response to a panel
+           *   keypad query command that was sent previously. These commands include those
+           *   messages starting with 0x051, 0x0593, 0x11 and possibly others. Note that
+           *   this means keypad to panel writes will not be logged since reads are skipped
+           *   when this condition is detected.
            */
-          if (prob >= MINPROB) { // only if probability is high enough...
-
-            if(pred) {
-             strcpy(sptr->lastTruePred[pred], tsBuf); // record timestamp of last true prediction
+          if (word_end(b, &b->due)) {
+            // get a keypad command to send to panel
+            if (popElement2(b, b->wordkw, MAX_BITS) != MAX_BITS) { // fifo is empty so output idle instead of repeating previous
+              memcpy(b->wordkw, IDLE, MAX_BITS);
+            } else {
+              trace(RING_PANEL_IO, EV_KEY_SENT, getBinaryData(b->wordkw,0,32), getBinaryData(b->wordkw,32,32));
             }
-
-            /* disable toggling lights for now
-            switch(pred) {
-              case 0: // null case - no predictions were true
-                //
-                break;
-              case 1: // act on prediction 1
-                snprintf(sysCmd, SCMD_BUF_SIZE, SCMD_FMT, PRLIGHTIP, "ON");
-                system(sysCmd);
-                break;
-              case 2: // act on prediction 2
-                snprintf(sysCmd, SCMD_BUF_SIZE, SCMD_FMT, PRLIGHTIP, "ON");
-                system(sysCmd);
-                break;
-              case 3:
-                snprintf(sysCmd, SCMD_BUF_SIZE, SCMD_FMT, PRLIGHTIP, "ON");
-                system(sysCmd);
-                break;
-              case 4:
-                snprintf(sysCmd, SCMD_BUF_SIZE, SCMD_FMT, PRLIGHTIP, "ON");
-                system(sysCmd);
-                break;
-              case 5:
-                snprintf(sysCmd, SCMD_BUF_SIZE, SCMD_FMT, PRLIGHTIP, "ON");
-                system(sysCmd);
-                break;
-              case 6:
-                snprintf(sysCmd, SCMD_BUF_SIZE, SCMD_FMT, BPLIGHTIP, "ON");
-                system(sysCmd);
-                break;
-              case 7:
-                //;
-              break;
-              case 8:
-                //;
-              break;
-              case 9: // act on prediction 9
-                //;
-              break;
-              case 10: // act on prediction 10
-                //;
-              break;
-              default:
-                //;
-              break;
-            }*/
           }
+
+          // reset bit counter and arrays
+          b->bitCnt = 0;
+          memset(b->word, 0, MAX_BITS);
+          memset(b->wordkr, 0, MAX_BITS);
         }
-      }
 
-      #ifdef RLOG
-      res = close(rLogFp);
-      if (res == -1) {
-        perror ("R log close() failed\n");
-        exit(EXIT_FAILURE);
-      }
-      #endif
+        b->tmark = b->due; // mark new word time
+        b->flag = 1; // set flag to indicate clock was high
+
+        // write keypad data bit to panel once every time clock is high
+        if (b->wordkw[b->bitCnt] == '0') // invert
+          GPIO_SET = 1<<b->dataOut; // set GPIO
+        else if (b->wordkw[b->bitCnt] == '1') // invert
+          GPIO_CLR = 1<<b->dataOut; // clear GPIO
+        else {
+          GPIO_CLR = 1<<b->dataOut; // clear GPIO
+          trace(RING_PANEL_IO, EV_BAD_KEY_BIT, b->bitCnt, (unsigned char) b->wordkw[b->bitCnt]);
+        }
 
-      res = pclose(fp);
-      if (res == -1) {
-        perror("pclose() failed\n");
-        exit(EXIT_FAILURE);
+        // read keypad data, including that just written, KSAMPLE_OFFSET later for valid data
+        b->step = PIO_KSAMPLE;
+        next = KSAMPLE_OFFSET;
+      }
+      else if ((GET_GPIO(b->clockIn) == PI_CLOCK_LO(b)) && b->flag) { // read panel data
+        b->flag = 0;
+        b->step = PIO_SAMPLE;
+        next = SAMPLE_OFFSET; // wait SAMPLE_OFFSET for valid data
       }
+      break;
+
+    case PIO_KSAMPLE:
+      b->wordkrTemp = (GET_GPIO(b->dataIn) == PI_DATA_HI(b)) ? '0' : '1'; // invert
+      b->step = PIO_HOLD;
+      next = HOLD_DATA; // wait HOLD_DATA time
+      break;
+
+    case PIO_HOLD:
+      GPIO_CLR = 1<<b->dataOut; // leave with GPIO cleared
+      b->step = PIO_POLL;
+      break;
+
+    case PIO_SAMPLE:
+      b->wordkr[b->bitCnt] = b->wordkrTemp;
+      b->word[b->bitCnt++] = (GET_GPIO(b->dataIn) == PI_DATA_HI(b)) ? '0' : '1'; // invert
+      if (b->bitCnt >= MAX_BITS) b->bitCnt = (MAX_BITS - 1); // never let bitCnt exceed MAX_BITS
+      b->step = PIO_POLL;
+      break;
+  }
+
+  b->due.tv_nsec += next;
+  tnorm(&b->due);
+} // bus_step()
+
+/*
+ * panel io thread
+ * Every INTERVAL seconds, this thread reads and writes bits to the keybus interface of each
+ *   bus. The read bits are assembled into messages that get decoded by the message i/o thread.
+ * The steps of all buses are taken in time order from one loop, so one thread on one core
+ *   serves every bus. Steps of two buses due at the same time are taken one after the
+ *   other, a GPIO access apart. The time spent on each bus is counted for /metrics.
+ */
+static void * panel_io(void *arg) {
+  const struct timespec parkPoll = {0, 1000000}; // 1 ms
+  struct timespec start, end;
+  struct bus *b;
+  int res, i;
+
+  // detach the thread since we don't care about its return status
+  res = pthread_detach(pthread_self());
+  if (res) {
+    perror("panel i/o thread detach failed\n");
+    exit(EXIT_FAILURE);
+  }
 
+  if (cfg.deadline &&
+      sched_deadline(LOOP_PANEL_IO, PIO_DL_RUNTIME * cfg.buses, INTERVAL))
+    trace(RING_PANEL_IO, EV_DL_REFUSED, errno, 0);
+
+  // spread the polls of the buses over the INTERVAL
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < cfg.buses; i++) {
+    memcpy(buses[i].wordkw, IDLE, MAX_BITS);
+    bus_start(&buses[i], &start);
+    start.tv_nsec += INTERVAL / cfg.buses;
+    tnorm(&start);
+  }
+  while (1) {
+    // the bus whose step is due first, that is not parked for a handoff
+    // a bus parks in its gap between two words and stays parked until the others have too
+    for (i = 0, b = NULL; i < cfg.buses; i++)
+      if (!buses[i].parked && (!b || ts_diff(&buses[i].due, &b->due) < 0))
+        b = &buses[i];
+
+    if (!b) { // every bus is between two words, see handoff_serve()
+      clock_gettime(CLOCK_MONOTONIC, &pioParkedAt);
+      __atomic_store_n(&pioParked, 1, __ATOMIC_RELEASE);
+      while (__atomic_load_n(&handoffPark, __ATOMIC_ACQUIRE))
+        clock_nanosleep(CLOCK_MONOTONIC, 0, &parkPoll, NULL);
+      clock_gettime(CLOCK_MONOTONIC, &start); // the handoff did not happen, carry on
+      for (i = 0; i < cfg.buses; i++) bus_start(&buses[i], &start);
+      continue;
     }
 
-    strcpy(oldZoneBuf, zoneBuf);
+    if (b->step == PIO_POLL) {
+      clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &b->due, NULL);
+      metric_overrun(LOOP_PANEL_IO, &b->due, INTERVAL);
+    } else {
+      sample_wait(&b->due);
+    }
 
-  } // while
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    bus_step(b);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    __atomic_store_n(&metrics.busNs[b->id][0], metrics.busNs[b->id][0] + ts_diff(&end, &start),
+                     __ATOMIC_RELAXED);
+  }
+} // panel_io thread
 
-} // predict
+/*
+ * Read a keybus word and the time it was seen from a line of a replay file, either a trace
+ *   line of a word msg_io decoded ("<s>.<ns> msg_io word <a> <b>", as written by --trace)
+ *   or a scripted one, "<s>[.<fraction>] <64 binary digits>".
+ * Returns 1, or 0 if the line has no word.
+ */
+static int replay_line(const char *line, uint64_t *ns, char *word) {
+  char bits[MAX_BITS + 1], *p;
+  unsigned int a, b;
+  unsigned long scale = NSEC_PER_SEC;
+
+  *ns = strtoull(line, &p, 10) * NSEC_PER_SEC;
+  if (p == line) return 0;
+  if (*p == '.')
+    for (p++; isdigit((unsigned char) *p); p++)
+      if ((scale /= 10)) *ns += (*p - '0') * scale;
+
+  if (sscanf(p, " msg_io word %u %u", &a, &b) == 2) {
+    setBinaryData(word, 0, 32, a);
+    setBinaryData(word, 32, 32, b);
+    return 1;
+  }
+  if (sscanf(p, " %64[01]", bits) == 1 && strlen(bits) == MAX_BITS) {
+    memcpy(word, bits, MAX_BITS);
+    return 1;
+  }
 
-// server
-static int create_socket(int port)
-{
-  int listenfd = 0, res;
-  struct sockaddr_in server_addr;
+  return 0;
+} // replay_line()
+
+/*
+ * replay thread, in place of panel_io with --replay
+ * Queues the words of cfg.replayFile for msg_io on the first bus, each on the virtual clock
+ *   at the time it was seen, relative to the first. Lines out of time order are queued at
+ *   once. At the end of the file it waits for msg_io to empty the fifo and predict to see
+ *   the last status, then reports and ends the server.
+ * Words are queued as they were recorded, panel and keypad words alike, without the
+ *   repeat counting of word_end(): a trace only has words that were queued anyway.
+ */
+static void * replay_io(void *arg) {
+  struct bus *b = &buses[0];
+  struct timespec t, now, drain = {0, 0};
+  char line[256], word[MAX_BITS];
+  uint64_t rec, first = 0, start, due = 0;
+  unsigned long words = 0;
+  FILE *fp;
+
+  pthread_detach(pthread_self());
+
+  if ((fp = fopen(cfg.replayFile, "r")) == NULL) {
+    perror("replay: can't open replay file");
+    exit(EXIT_FAILURE);
+  }
+
+  clk_now(&t);
+  start = (uint64_t) t.tv_sec * NSEC_PER_SEC + t.tv_nsec;
+  while (fgets(line, sizeof(line), fp)) {
+    if (!replay_line(line, &rec, word)) continue;
+    if (!words++) first = rec;
+    if (rec >= first && start + (rec - first) > due) due = start + (rec - first);
+    t.tv_sec = due / NSEC_PER_SEC;
+    t.tv_nsec = due % NSEC_PER_SEC;
+    clk_sleep(LOOP_PANEL_IO, &t);
+
+    metric_inc(&metrics.panelWords[b->id]);
+    if (pushElement1(b, word, MAX_BITS, ts_ms(&t)) != MAX_BITS)
+      trace(RING_PANEL_IO, EV_FIFO_FULL, 0, b->id);
+    clk_wake(LOOP_MSG_IO);
+  }
+  fclose(fp);
+
+  do { // msg_io takes a word each MSG_IO_UPDATE
+    t.tv_nsec += MSG_IO_UPDATE;
+    tnorm(&t);
+    clk_sleep(LOOP_PANEL_IO, &t);
+  } while (b->m_Read1 != b->m_Write1);
+  t.tv_nsec += 2 * PREDICT_UPDATE;
+  tnorm(&t);
+  clk_sleep(LOOP_PANEL_IO, &t);
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  fprintf(stdout, "replay: %lu words over %llu s of keybus time in %ld ms, %lu predictions, "
+          "%d occupants\n", words, (unsigned long long) ((due - start) / NSEC_PER_SEC),
+          (long) ((now.tv_sec - startTime.tv_sec) * 1000 +
+                  (now.tv_nsec - startTime.tv_nsec) / 1000000),
+          metric_get(&metrics.predictions), b->status.pred.numOcc);
+  sem_post(&traceWake); // let the drainer write the last events out
+  drain.tv_nsec = TRACE_DRAIN;
+  nanosleep(&drain, NULL);
+  exit(EXIT_SUCCESS);
+} // replay_io thread
+
+/*
+ * e^-x for x >= 0 to about 1e-4, without libm: a series for e^-(x / 2^k), squared k times.
+ */
+static double decay(double x) {
+  double y;
+  int k;
+
+  if (x > 30) return 0;
+  for (k = 0; x > 0.125; k++) x *= 0.5;
+  y = 1 - x * (1 - x / 2 * (1 - x / 3 * (1 - x / 4)));
+  while (k--) y *= y;
+
+  return y;
+} // decay()
+
+// Activations of zone z in about the last zstatWindow[w] seconds, as of capture ms now.
+static float zstat_count(const struct zone_stats *z, int w, uint64_t now) {
+  if (now <= z->lastAct) return z->count[w];
+  return z->count[w] * decay((now - z->lastAct) / (1000.0 * zstatWindow[w]));
+} // zstat_count()
+
+// Count an activation of zone z at capture ms stamp.
+static void zstat_act(struct zone_stats *z, uint64_t stamp) {
+  int w;
+
+  for (w = 0; w < ZSTAT_WINDOWS; w++)
+    z->count[w] = zstat_count(z, w, stamp) + 1;
+  z->lastAct = stamp;
+  z->acts++;
+} // zstat_act()
+
+/*
+ * Add a dwell of ms to the dwell time mean and variance of zone z.
+ * Each dwell is weighted 1 / n, n the dwells so far up to ZSTAT_DWELLS, so the first
+ *   ZSTAT_DWELLS give the plain mean and variance and later ones decay exponentially.
+ */
+static void zstat_dwell(struct zone_stats *z, uint64_t ms) {
+  float a, d;
+
+  z->dwells++;
+  a = 1.0f / ((z->dwells < ZSTAT_DWELLS) ? z->dwells : ZSTAT_DWELLS);
+  d = ms / 1000.0f - z->dwellMean;
+  z->dwellMean += a * d;
+  z->dwellVar = (1 - a) * (z->dwellVar + a * d * d);
+} // zstat_dwell()
+
+/*
+ * Take a consistent copy of the zone statistics of bus b.
+ * msg_io writes them under their own sequence number, bumped with the zone block's.
+ */
+static void stats_read(const struct bus *b, struct stats_block *copy) {
+  const struct timespec backoff = {0, 10000}; // 10 us
+  unsigned long seq;
+  int tries = 0;
+
+  for (;;) {
+    seq = __atomic_load_n(&b->stats.seq, __ATOMIC_ACQUIRE);
+    if (!(seq & 1)) {
+      memcpy(copy, &b->stats, sizeof(*copy));
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (seq == __atomic_load_n(&b->stats.seq, __ATOMIC_RELAXED)) break;
+    }
+    if (++tries > 100) nanosleep(&backoff, NULL);
+  }
+} // stats_read()
+
+/*
+ * Decode the next word waiting in the fifo of bus b and update its status.
+ * Returns 1 if a word was decoded, 0 if the fifo was empty or the read failed.
+ */
+static int bus_decode(struct bus *b, time_t now) {
+  int cmd, res, zone, changed, zonesChanged;
+  char msg[50] = "", *dst;
+  char word[MAX_BITS] = "";
+  struct timespec t;
+  uint64_t stamp; // capture ms of the word, see word_end()
+  struct status * sptr = &b->status;
+
+  // Get raw data from fifo. Panel and keypad data are interleaved in the fifo.
+  res = popElement1(b, word, MAX_BITS, &stamp);
+  if (!res) { // fifo is empty (res == 0)
+    return 0;
+  } else if (res != MAX_BITS) { // fifo read error
+    trace(RING_MSG_IO, EV_FIFO_READ, res, b->id); // record error and continue
+    return 0;
+  }
+
+  // todo : add CRC check of raw data
+  cmd = decode(word, msg, b->allZones); // decode word from panel into a message
+  metric_inc(&metrics.decoded[b->id][cmd & 0xff]);
+  if (!metrics.firstWordMs) {
+    clk_now(&t);
+    metric_add(&metrics.firstWordMs, ts_ms(&t) - ts_ms(&startTime) + 1);
+    trace(RING_MSG_IO, EV_FIRST_WORD, metrics.firstWordMs, 0);
+  }
+  trace(RING_MSG_IO, EV_WORD, getBinaryData(word,0,32), getBinaryData(word,32,32));
+  __atomic_store_n(&metrics.lastWord[b->id], now, __ATOMIC_RELAXED);
+  // find the LED or zone status string this message updates, if it changed
+  switch (cmd) {
+    case 0x05: dst = sptr->led.ledStatus;     break;
+    case 0x27: dst = sptr->led.zoneStatus[0]; break;
+    case 0x2d: dst = sptr->led.zoneStatus[1]; break;
+    case 0x34: dst = sptr->led.zoneStatus[2]; break;
+    case 0x3e: dst = sptr->led.zoneStatus[3]; break;
+    default:   dst = NULL;
+  }
+  changed = (dst && strcmp(dst, msg)) ? BLK_LED : 0;
+
+  // check for zone transitions
+  for (zone = 0, zonesChanged = 0; zone < NUMZONES && !zonesChanged; zone++) {
+    if (b->allZones[zone]) // zone is active but marked inactive
+      zonesChanged = (sptr->zone.zoneAct[zone] <= sptr->zone.zoneDeAct[zone]);
+    else // zone is not active but marked active
+      zonesChanged = (sptr->zone.zoneDeAct[zone] < sptr->zone.zoneAct[zone]);
+  }
+  if (zonesChanged) changed |= BLK_ZONE;
+
+  // publish a new version of only the blocks with something a client can see changed
+  if (changed) {
+    status_write_begin(sptr, changed);
+
+    // update LED and zone status information
+    if (changed & BLK_LED) {
+      strcpy(dst, msg);
+      if (cmd == 0x05) // same lights as the LED text, packed for the binary status
+        sptr->led.ledBits = led_bits(word);
+    }
+
+    // update zone sensor activity and deactivity markers, and the zone statistics with them
+    if (changed & BLK_ZONE) {
+      __atomic_store_n(&b->stats.seq, b->stats.seq + 1, __ATOMIC_RELAXED);
+      __atomic_thread_fence(__ATOMIC_RELEASE);
+    }
+    for (zone = 0; zone < NUMZONES && (changed & BLK_ZONE); zone++) {
+      if (b->allZones[zone]) { // zone is currently active
+        if (sptr->zone.zoneAct[zone] <= sptr->zone.zoneDeAct[zone]) { // zone was marked inactive
+          sptr->zone.zoneAct[zone] = stamp; // zone is now active, so record capture time
+          zstat_act(&b->stats.zone[zone], stamp);
+        }
+      } else { // zone is currently not active
+        if (sptr->zone.zoneDeAct[zone] < sptr->zone.zoneAct[zone]) { // zone was marked active
+          sptr->zone.zoneDeAct[zone] = stamp; // zone is now not active, so record capture time
+          zstat_dwell(&b->stats.zone[zone], (stamp > sptr->zone.zoneAct[zone]) ?
+                      stamp - sptr->zone.zoneAct[zone] : 0);
+        }
+      }
+    }
+    if (changed & BLK_ZONE)
+      __atomic_store_n(&b->stats.seq, b->stats.seq + 1, __ATOMIC_RELEASE);
+
+    status_write_end(sptr, changed);
+    trace(RING_MSG_IO, EV_STATUS, status_version(sptr), cmd);
+  }
+
+  // update zone sensor observation time, this alone does not make a new status version
+  status_set_obs_time(sptr, stamp);
+
+  return 1;
+} // bus_decode()
+
+/*
+ * message i/o thread
+ * This thread runs every MSG_IO_UPDATE seconds and decodes the messages created by the panel
+ *   i/o thread, one word of each bus per run.
+ * It traces the panel and keypad traffic, which trace_drainer() prints to stdout in VERBOSE builds.
+ *
+ */
+static void * msg_io(void * arg) {
+  struct timespec t, start, end;
+  int res, i, idle = 0;
+
+  // detach the thread since we don't care about its return status
+  res = pthread_detach(pthread_self());
+  if (res) {
+    perror("message i/o thread detach failed\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if (cfg.deadline &&
+      sched_deadline(LOOP_MSG_IO, MIO_DL_RUNTIME * cfg.buses, MSG_IO_UPDATE))
+    trace(RING_MSG_IO, EV_DL_REFUSED, errno, 0);
+
+  clk_now(&t);
+  while (1) {
+    t.tv_nsec += MSG_IO_UPDATE; // thread runs every MSG_IO_UPDATE seconds
+    tnorm(&t);
+    if (idle) // every fifo is empty, until panel_io queues a word
+      clk_idle(LOOP_MSG_IO, &t, MSG_IO_UPDATE);
+    else
+      clk_sleep(LOOP_MSG_IO, &t);
+    metric_overrun(LOOP_MSG_IO, &t, MSG_IO_UPDATE);
+
+    if (__atomic_load_n(&handoffPark, __ATOMIC_ACQUIRE)) { // see handoff_serve()
+      __atomic_store_n(&mioParked, 1, __ATOMIC_RELEASE);
+      continue;
+    }
+
+    for (i = 0, idle = 1; i < cfg.buses; i++) {
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      if (!bus_decode(&buses[i], t.tv_sec)) continue;
+      clock_gettime(CLOCK_MONOTONIC, &end);
+      __atomic_store_n(&metrics.busNs[i][1], metrics.busNs[i][1] + ts_diff(&end, &start),
+                       __ATOMIC_RELAXED);
+      idle = 0;
+    }
+    if (!idle) clk_wake(LOOP_PREDICT); // the zones may have changed
+
+  } // while
+
+} // msg_io
+
+/*
+ * Format the zone activation and deactivation times as the Rscript argument,
+ *   in seconds to the ms, on the same clock as the observation time.
+ */
+static int zone_args(const struct zone_block *z, char *out, int outsz) {
+  const uint64_t *v;
+  int i, len = 0;
+
+  for (i = 0; i < 2 * NUMZONES; i++) {
+    v = (i < NUMZONES) ? &z->zoneAct[i] : &z->zoneDeAct[i - NUMZONES];
+    len += snprintf(out + len, outsz - len, i ? ",%llu.%03u" : " %llu.%03u",
+                    (unsigned long long) (*v / 1000), (unsigned) (*v % 1000));
+    if (len >= outsz) return outsz - 1;
+  }
+
+  return len;
+} // zone_args()
+
+/*
+ * Format the zone statistics as the Rscript argument, as of capture ms now: the decaying
+ *   activation counts of every zone for each window in turn, then the mean dwell times in s.
+ */
+static int stats_args(const struct stats_block *st, uint64_t now, char *out, int outsz) {
+  int i, w, len = 0;
+
+  for (i = 0; i < (ZSTAT_WINDOWS + 1) * NUMZONES; i++) {
+    w = i / NUMZONES;
+    len += snprintf(out + len, outsz - len, i ? ",%.2f" : " %.2f", (w < ZSTAT_WINDOWS) ?
+                    zstat_count(&st->zone[i % NUMZONES], w, now) : st->zone[i % NUMZONES].dwellMean);
+    if (len >= outsz) return outsz - 1;
+  }
+
+  return len;
+} // stats_args()
+
+/*
+ * Queue an R log entry for rlog_writer(), without blocking the predict thread.
+ * Entries that do not fit are dropped whole and counted.
+ */
+static void rlog_write(const char *buf, int len) {
+  uint32_t head = rlog.head, i;
+
+  if (len > RLOG_BUF_LEN - (head - __atomic_load_n(&rlog.tail, __ATOMIC_ACQUIRE))) {
+    __atomic_store_n(&rlog.dropped, rlog.dropped + 1, __ATOMIC_RELAXED);
+    return;
+  }
+  for (i = 0; i < len; i++)
+    rlog.buf[(head + i) & (RLOG_BUF_LEN - 1)] = buf[i];
+  __atomic_store_n(&rlog.head, head + len, __ATOMIC_RELEASE);
+
+  if (head + len - rlog.tail >= RLOG_BATCH && !__atomic_exchange_n(&rlog.posted, 1, __ATOMIC_ACQ_REL))
+    sem_post(&rlog.sem);
+} // rlog_write()
+
+// Stamp of a config file, all 0 if it does not exist.
+static void file_stamp(const char *path, struct file_stamp *s) {
+  struct stat st;
+
+  memset(s, 0, sizeof(*s));
+  if (path == NULL || stat(path, &st)) return;
+  s->mtime = st.st_mtim;
+  s->size = st.st_size;
+  s->ino = st.st_ino;
+} // file_stamp()
+
+static int file_stamp_same(const struct file_stamp *a, const struct file_stamp *b) {
+  return a->mtime.tv_sec == b->mtime.tv_sec && a->mtime.tv_nsec == b->mtime.tv_nsec &&
+         a->size == b->size && a->ino == b->ino;
+} // file_stamp_same()
+
+/*
+ * Zone and prediction rules.
+ * The rules file tells predict which zones are interior and which is the exit for the
+ *   occupancy estimate, and what to do on a zone event or a prediction. It is compiled into
+ *   a table when predict starts and again whenever the file changes, so an event is matched
+ *   without touching the file. Without a file, the built-in INTZONES, EXITZONE and CONZONE
+ *   limits apply and nothing is run. '#' starts a comment. Lines are:
+ *     interior Z ...             interior zones, numbered from 0
+ *     exit Z                     exit zone
+ *     concurrent LL UL           seconds between activations counted as two people
+ *     on EVENT [COND ...] do CMD run CMD with /bin/sh on EVENT if every COND holds
+ *   EVENT is "pred N" (R predicted pattern N, below NUMPRED), "open Z" or "close Z"
+ *   (zone Z changed).
+ *   COND is "prob>=P" (a prediction's probability in %, default MINPROB), "HH:MM-HH:MM"
+ *   (local time window, may wrap midnight), "open Z" or "closed Z" (zone state).
+ * A line in error is reported and ignored, the rest of the file still applies. predict
+ *   runs SCHED_FIFO, so errors go through its trace ring.
+ */
+static void rules_default(struct rules *r) {
+  int intZone[] = INTZONES;
+
+  memset(r->rule, 0, sizeof(r->rule));
+  r->numRules = 0;
+  r->numInterior = sizeof(intZone) / sizeof(intZone[0]);
+  memcpy(r->interior, intZone, sizeof(intZone));
+  r->exitZone = EXITZONE;
+  r->conLL = CONZONELL;
+  r->conUL = CONZONEUL;
+} // rules_default()
+
+// Read a zone number. Returns it, or -1 if tok is not one.
+static int rules_zone(const char *tok) {
+  char *end;
+  long z;
+
+  if (!tok) return -1;
+  z = strtol(tok, &end, 10);
+
+  return (end != tok && !*end && z >= 0 && z < NUMZONES) ? z : -1;
+} // rules_zone()
+
+// Compile the conditions of a rule, from tok on. Returns 0, or -1 if one is not understood.
+static int rules_cond(struct rule *u, char *tok, char **save) {
+  int h1, m1, h2, m2, z, n, end = 0;
+
+  for (; tok; tok = strtok_r(NULL, " \t\n", save), end = 0) {
+    if (!strcmp(tok, "if")) continue;
+    if (sscanf(tok, "prob>=%d%n", &n, &end) == 1 && !tok[end] && n >= 0 && n <= 100) {
+      u->minProb = n;
+    } else if (sscanf(tok, "%d:%d-%d:%d%n", &h1, &m1, &h2, &m2, &end) == 4 && !tok[end] &&
+               h1 >= 0 && h1 < 24 && h2 >= 0 && h2 < 24 && m1 >= 0 && m1 < 60 &&
+               m2 >= 0 && m2 < 60) {
+      u->from = h1 * 60 + m1;
+      u->to = h2 * 60 + m2;
+    } else if (!strcmp(tok, "open") || !strcmp(tok, "closed")) {
+      if ((z = rules_zone(strtok_r(NULL, " \t\n", save))) < 0) return -1;
+      if (tok[0] == 'o')
+        u->open |= 1U << z;
+      else
+        u->closed |= 1U << z;
+    } else {
+      return -1;
+    }
+  }
+
+  return 0;
+} // rules_cond()
+
+// Compile one line of the rules file. Returns 0, or -1 if it is in error.
+static int rules_line(struct rules *r, char *line, int num, int *textLen) {
+  char *tok, *save, *cmd;
+  struct rule *u;
+  int zones[NUMZONES], z, n, len;
+
+  if ((cmd = strstr(line, " do ")) != NULL) { // the action is the rest of the line as is
+    *cmd = '\0';
+    cmd += 4;
+    cmd[strcspn(cmd, "\n")] = '\0';
+  }
+  if ((tok = strtok_r(line, " \t\n", &save)) == NULL) return cmd ? -1 : 0;
+
+  if (!strcmp(tok, "interior")) {
+    for (n = 0; (tok = strtok_r(NULL, " \t,\n", &save)); n++)
+      if (n == NUMZONES || (zones[n] = rules_zone(tok)) < 0) return -1;
+    memcpy(r->interior, zones, n * sizeof(zones[0]));
+    r->numInterior = n;
+    return 0;
+  }
+  if (!strcmp(tok, "exit")) {
+    if ((z = rules_zone(strtok_r(NULL, " \t\n", &save))) < 0) return -1;
+    r->exitZone = z;
+    return 0;
+  }
+  if (!strcmp(tok, "concurrent")) {
+    tok = strtok_r(NULL, " \t\n", &save);
+    if (!tok || sscanf(tok, "%d", &z) != 1) return -1;
+    tok = strtok_r(NULL, " \t\n", &save);
+    if (!tok || sscanf(tok, "%d", &n) != 1 || z < 0 || n < z) return -1;
+    r->conLL = z;
+    r->conUL = n;
+    return 0;
+  }
+  if (strcmp(tok, "on") || !cmd || !*cmd || r->numRules == RULES_MAX) return -1;
+
+  u = &r->rule[r->numRules];
+  memset(u, 0, sizeof(*u));
+  u->minProb = MINPROB;
+  u->line = num;
+  tok = strtok_r(NULL, " \t\n", &save);
+  if (tok && !strcmp(tok, "pred")) {
+    u->event = RULE_PRED;
+    tok = strtok_r(NULL, " \t\n", &save);
+    if (!tok || (z = atoi(tok)) < 0 || z >= NUMPRED || !isdigit((unsigned char) *tok)) return -1;
+  } else if (tok && (!strcmp(tok, "open") || !strcmp(tok, "close"))) {
+    u->event = (tok[0] == 'o') ? RULE_OPEN : RULE_CLOSE;
+    if ((z = rules_zone(strtok_r(NULL, " \t\n", &save))) < 0) return -1;
+  } else {
+    return -1;
+  }
+  u->arg = z;
+  if (rules_cond(u, strtok_r(NULL, " \t\n", &save), &save)) return -1;
+
+  len = strlen(cmd) + 1;
+  if (*textLen + len > RULES_TEXT) return -1;
+  memcpy(r->text + *textLen, cmd, len);
+  u->cmd = *textLen;
+  *textLen += len;
+  r->numRules++;
+
+  return 0;
+} // rules_line()
+
+/*
+ * (Re)compile the rules if cfg.rulesFile changed since they were last loaded.
+ * Returns 1 if they were, 0 if they are as they were.
+ */
+static int rules_reload(struct rules *r) {
+  char line[1024], *p;
+  int num = 0, textLen = 0;
+  struct file_stamp stamp;
+  FILE *fp;
+
+  file_stamp(cfg.rulesFile, &stamp);
+  if (r->loaded && file_stamp_same(&stamp, &r->stamp)) return 0;
+
+  rules_default(r);
+  r->stamp = stamp;
+  r->loaded = 1;
+  if (!cfg.rulesFile) return 1;
+  if ((fp = fopen(cfg.rulesFile, "r")) == NULL) {
+    trace(RING_PREDICT, EV_RULES, 0, errno);
+    return 1;
+  }
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    num++;
+    if ((p = strchr(line, '#')) != NULL) *p = '\0';
+    if (rules_line(r, line, num, &textLen))
+      trace(RING_PREDICT, EV_RULE_BAD, num, 0);
+  }
+  fclose(fp);
+  trace(RING_PREDICT, EV_RULES, r->numRules, 0);
+
+  return 1;
+} // rules_reload()
+
+// Reap the actions that have finished.
+static void rules_reap(struct rules *r) {
+  int i, st;
+
+  for (i = 0; i < RULES_RUNNING; i++)
+    if (r->running[i] && waitpid(r->running[i], &st, WNOHANG) != 0) r->running[i] = 0;
+} // rules_reap()
+
+/*
+ * Start the action of rule u, without waiting for it.
+ * Actions run under SCHED_OTHER, so a slow one never holds up the keybus threads.
+ * In a replay they are only printed.
+ */
+static void rules_run(struct rules *r, const struct rule *u) {
+  static const struct sched_param other = { .sched_priority = 0 };
+  extern char **environ;
+  const char *cmd = r->text + u->cmd;
+  char *argv[] = { "sh", "-c", (char *) cmd, NULL };
+  posix_spawnattr_t attr;
+  pid_t pid = 0;
+  int i;
+
+  if (cfg.replayFile) {
+    fprintf(stdout, "predict: rule on line %d: %s\n", u->line, cmd);
+  } else {
+    for (i = 0; i < RULES_RUNNING && r->running[i]; i++);
+    if (i == RULES_RUNNING) {
+      fprintf(stderr, "predict: too many actions running, rule on line %d skipped\n", u->line);
+      return;
+    }
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSCHEDULER);
+    posix_spawnattr_setschedpolicy(&attr, SCHED_OTHER);
+    posix_spawnattr_setschedparam(&attr, &other);
+    if (posix_spawn(&pid, "/bin/sh", NULL, &attr, argv, environ) == 0)
+      r->running[i] = pid;
+    else
+      perror("predict: can't run rule action");
+    posix_spawnattr_destroy(&attr);
+  }
+  trace(RING_PREDICT, EV_RULE, u->line, pid);
+} // rules_run()
+
+/*
+ * Run the actions of the rules for an event: a prediction with probability prob, or a
+ *   zone opening or closing, at local time minute with the zones in open open.
+ * Matching a rule is a few compares, the table is scanned in file order.
+ */
+static void rules_fire(struct rules *r, int event, int arg, int prob, int minute, uint32_t open) {
+  const struct rule *u;
+  int i;
+
+  for (i = 0; i < r->numRules; i++) {
+    u = &r->rule[i];
+    if (u->event != event || u->arg != arg) continue;
+    if (event == RULE_PRED && prob < u->minProb) continue;
+    if ((open & u->open) != u->open || (open & u->closed)) continue;
+    if (u->from < u->to && (minute < u->from || minute >= u->to)) continue;
+    if (u->from > u->to && minute < u->from && minute >= u->to) continue; // wraps midnight
+    rules_run(r, u);
+  }
+} // rules_fire()
+
+// Zones open in z, bit n for zone n.
+static uint32_t rules_open(const struct zone_block *z) {
+  uint32_t open = 0;
+  int i;
+
+  for (i = 0; i < NUMZONES; i++)
+    if (z->zoneAct[i] > z->zoneDeAct[i]) open |= 1U << i;
+
+  return open;
+} // rules_open()
+
+/*
+ * predict thread
+ * This thread runs every PREDICT_UPDATE seconds and sends sensor data to R to make a prediction.
+ * It also reads the prediction from R and acts on it, and on zone events, as the rules say.
+ * The model is trained on one house, so it only follows the first bus.
+ *
+ */
+static void * predict(void * arg) {
+  int res, len, rStatus, predicted = 0, chosen;
+  int i, j, occ = 0, maxOcc = 0, minute = 0;
+  long int rPredProb[4], pop = 0, predNoClk = 0, probNoClk = 0;
+  long int predClk = 0, probClk = 0, pred = 0, prob = 0;
+  char *p;
+  char rout[ROUT_MAX];
+  char tsBuf[TS_BUF_SIZE];
+  char popenCmd[PCMD_BUF_SIZE];
+  char rec[RLOG_REC_LEN];
+  char obsTimeBuf[RARG_SIZE] = "", zoneBuf[RARG_SIZE] = "", oldZoneBuf[RARG_SIZE] = "";
+  char statBuf[2 * RARG_SIZE] = "";
+  struct timespec t, rStart, rEnd;
+  struct bus *b = (struct bus *) arg;
+  struct status * sptr = &b->status;
+  struct zone_block zones;
+  struct stats_block stats;
+  uint64_t obsTime, lastDoorCloseTime;
+  uint32_t open, lastOpen;
+  long long val;
+  struct tm *tmp, local;
+  time_t tstamp, rulesCheck;
+  FILE * fp;
+
+  // detach the thread since we don't care about its return status
+  res = pthread_detach(pthread_self());
+  if (res) {
+    perror("predict thread detach failed\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // pre-fault the heap popen() and the R output stream use
+  reserve_process_memory(PREDICT_HEAP);
+
+  // init prediction / probability array
+  memset(&rPredProb, 0, sizeof(rPredProb));
+
+  // carry on from the status a previous instance handed over, if any, see takeover()
+  rules_reload(&rules);
+  rulesCheck = clk_wall();
+  zone_read(sptr, &zones);
+  maxOcc = sptr->pred.numOcc;
+  lastDoorCloseTime = zones.zoneDeAct[rules.exitZone];
+  open = lastOpen = rules_open(&zones);
+
+  clk_now(&t);
+  while (1) {
+    t.tv_nsec += PREDICT_UPDATE; // thread runs every PREDICT_UPDATE seconds
+    tnorm(&t);
+    clk_idle(LOOP_PREDICT, &t, PREDICT_UPDATE); // only msg_io changes what it looks at
+    metric_overrun(LOOP_PREDICT, &t, PREDICT_UPDATE);
+
+    // Time and date stamp observation, rounded to nearest second. This one stays on the wall
+    //   clock, unlike obsTime and the zone times: R reads the time of day from it and the
+    //   last true prediction times made from it are shown as dates. Nothing compares the two.
+    tstamp = clk_wall();
+    tmp = gmtime(&tstamp); // Coordinated Universal Time (UTC) aka GMT timezone
+    if (tmp == NULL) {
+      perror("gmtime failed\n");
+      exit(EXIT_FAILURE);
+    }
+    if (!strftime(tsBuf, sizeof(tsBuf), "%FT%TZ", tmp)) {
+      fprintf(stderr, "strftime returned 0\n");
+      exit(EXIT_FAILURE);
+    }
+
+    // Build strings from observation data for Rscript arguments
+    zone_read(sptr, &zones); // only the zone block, light changes do not disturb predict
+    // zone and observation times are capture times, so a fifo backlog does not skew them
+    obsTime = __atomic_load_n(&sptr->obsTime, __ATOMIC_RELAXED);
+    snprintf(obsTimeBuf, sizeof(obsTimeBuf), " %llu.%03u",
+             (unsigned long long) (obsTime / 1000), (unsigned) (obsTime % 1000));
+    zone_args(&zones, zoneBuf, sizeof(zoneBuf));
+
+    // pick up edits to the rules, at most once a second, and reap the actions they ran
+    if (tstamp != rulesCheck) {
+      if (rules_reload(&rules)) lastDoorCloseTime = zones.zoneDeAct[rules.exitZone];
+      rulesCheck = tstamp;
+    }
+    rules_reap(&rules);
+
+    if (strcmp(zoneBuf, oldZoneBuf)) { // only run on zone changes
+      // act on the zones that opened or closed
+      open = rules_open(&zones);
+      localtime_r(&tstamp, &local);
+      minute = local.tm_hour * 60 + local.tm_min;
+      for (i = 0; i < NUMZONES; i++)
+        if ((open ^ lastOpen) & (1U << i))
+          rules_fire(&rules, (open & (1U << i)) ? RULE_OPEN : RULE_CLOSE, i, 0, minute, open);
+      lastOpen = open;
+
+      // try to predict number of occupants based on sensor activity
+      if (zones.zoneDeAct[rules.exitZone] > lastDoorCloseTime) { // exterior zone triggered
+        maxOcc = 0; // reset occupant counter since at least one person probably exited the house
+        lastDoorCloseTime = zones.zoneDeAct[rules.exitZone];
+      } else {
+        for (j = 0; j < rules.numInterior; j++) { // scan through zones looking for activity
+          if (obsTime / 1000 == zones.zoneAct[rules.interior[j]] / 1000) occ = 1; // single person detect
+          for (i = j; i < rules.numInterior; i++) { // multiple person detect
+            val = llabs((long long) (zones.zoneAct[rules.interior[j]] / 1000) -
+                        (long long) (zones.zoneAct[rules.interior[i]] / 1000)); // in seconds as before
+            if ((val > rules.conLL) && (val < rules.conUL)) { // find zones activated within limits
+              occ++;
+            }
+          }
+        }
+      }
+      if (occ > maxOcc) maxOcc = occ; // max hold
+      if (sptr->pred.numOcc != maxOcc) {
+        status_write_begin(sptr, BLK_PRED);
+        sptr->pred.numOcc = maxOcc;
+        status_write_end(sptr, BLK_PRED);
+      }
+      occ = 0;
+
+      // Build and execute command to run Rscript, the zone statistics are extra features
+      stats_read(b, &stats);
+      stats_args(&stats, obsTime, statBuf, sizeof(statBuf));
+      snprintf(popenCmd, PCMD_BUF_SIZE, POPEN_FMT, tsBuf, obsTimeBuf, zoneBuf, statBuf);
+      clock_gettime(CLOCK_MONOTONIC, &rStart);
+      fp = popen(popenCmd, "r");
+      if (fp == NULL) {
+        fprintf(stderr, "popen() failed\n");
+        continue;
+      }
+
+      // Read output of Rscript until EOF, log and act on R's predictions
+      predicted = 0;
+      while (fgets(rout, ROUT_MAX, fp) != NULL) {
+        if (cfg.rlogFile && !cfg.rlogJson) rlog_write(rout, strlen(rout));
+
+        #ifdef VERBOSE
+        fprintf(stdout, "%s", rout);
+        #endif
+
+        /*
+         * Parse prediction number and its probability from R's output.
+         * Assumes output is in the form "pred: n prob: .pp"
+         * where n is the prediction number and pp is its probability.
+         *
+         */
+        if (strstr(rout, "pred:") != NULL) { // found a prediction in R's output...
+
+          // Extract predictions and probabilities.
+          p = rout;
+          i = 0;
+          while (*p) { // While there are more characters to process...
+            if (isdigit(*p)) { // Upon finding a digit, ...
+              pop = strtol(p, &p, 10); // Read pred or prob
+              rPredProb[i++] = pop; // pred is 1st element, prob is 2nd
+            } else { // Otherwise, move on to the next character.
+              p++;
+            }
+          }
+
+          predNoClk = rPredProb[0]; // prediction w/o clock as predictor
+          probNoClk = rPredProb[1]; // probability w/o clock as predictor
+          predClk   = rPredProb[2]; // prediction w/clock as predictor
+          probClk   = rPredProb[3]; // probability w/o clock as predictor
+          predicted = 1;
+
+          /*
+           * Apply rules to the predictions from both models.
+           * If both models predict the same pattern, choose the higher probability prediction.
+           * (In the case of both models making the same non-null prediction, a higher probability
+           * pattern from the model using clock as a predictor is likely a timed pattern.)
+           * If one model hasn't identified any pattern and the other has, pick the non-null case.
+           * If they identified different patterns, there is no prediction.
+           *
+           */
+          pred = prob = 0;
+          chosen = 1;
+          if (predNoClk == predClk) {
+            pred = (probClk > probNoClk) ? predClk : predNoClk;
+            prob = (probClk > probNoClk) ? probClk : probNoClk;
+          } else if (predClk && !predNoClk) {
+            pred = predClk;
+            prob = probClk;
+          } else if (!predClk && predNoClk) {
+            pred = predNoClk;
+            prob = probNoClk;
+          } else {
+            chosen = 0;
+          }
+
+          if (prob >= MINPROB && pred) { // only if probability is high enough...
+            status_write_begin(sptr, BLK_PRED);
+            strcpy(sptr->pred.lastTruePred[pred], tsBuf); // record timestamp of last true prediction
+            sptr->pred.lastTruePredTime[pred] = tstamp;
+            status_write_end(sptr, BLK_PRED);
+          }
+
+          // do something with the prediction, as the rules say
+          if (chosen) rules_fire(&rules, RULE_PRED, pred, prob, minute, open);
+        }
+      }
+
+      res = pclose(fp);
+      if (res == -1) {
+        perror("pclose() failed\n");
+        exit(EXIT_FAILURE);
+      }
+      rStatus = res;
+
+      clock_gettime(CLOCK_MONOTONIC, &rEnd);
+      metric_inc(&metrics.predictions);
+      res = (rEnd.tv_sec - rStart.tv_sec) * 1000L + (rEnd.tv_nsec - rStart.tv_nsec) / 1000000L;
+      metric_add(&metrics.predictMs, res);
+      trace(RING_PREDICT, EV_PREDICT, res, pred);
+
+      if (cfg.rlogFile && cfg.rlogJson) { // one record of what went in, what came out and how long it took
+        len = snprintf(rec, sizeof(rec),
+                       "{\"time\":\"%s\",\"obsTime\":%s,\"zones\":[%s],\"stats\":[%s],\"ms\":%d,"
+                       "\"exit\":%d", tsBuf, obsTimeBuf + 1, zoneBuf + 1, statBuf + 1, res,
+                       WEXITSTATUS(rStatus));
+        if (predicted)
+          len += snprintf(rec + len, sizeof(rec) - len,
+                          ",\"predNoClk\":%ld,\"probNoClk\":%ld,\"predClk\":%ld,\"probClk\":%ld,"
+                          "\"pred\":%ld,\"prob\":%ld}\n",
+                          predNoClk, probNoClk, predClk, probClk, pred, prob);
+        else
+          len += snprintf(rec + len, sizeof(rec) - len, "}\n");
+        if (len < (int) sizeof(rec)) rlog_write(rec, len);
+      }
+
+    }
+
+    strcpy(oldZoneBuf, zoneBuf);
+
+  } // while
+
+} // predict
+
+// Write a trace event out: to the trace file, and as log messages for errors and in VERBOSE builds.
+static void trace_emit(FILE *fp, int ring, const struct trace_event *e) {
+  char line[TRACE_LINE];
+  #ifdef VERBOSE
+  static unsigned long index;
+  char word[MAX_BITS], msg[50];
+  int i, allZones[NUMZONES];
+  #endif
+
+  if (fp) fwrite(line, 1, trace_line(line, ring, e), fp);
+
+  switch (e->id) {
+    case EV_FIFO_FULL:
+      fprintf(stderr, "panel_io: bus %u fifo write error\n", e->b);
+      break;
+    case EV_BAD_KEY_BIT:
+      fprintf(stderr, "panel_io: bad element in keypad data array wordk\n");
+      break;
+    case EV_FIFO_READ:
+      fprintf(stderr, "msg_io: bus %u fifo read error\n", e->b);
+      break;
+    case EV_DL_REFUSED:
+      fprintf(stderr, "%s: SCHED_DEADLINE refused (%s), staying SCHED_FIFO\n",
+              traceRingNames[ring], strerror(e->a));
+      break;
+    case EV_FIRST_WORD:
+      fprintf(stdout, "msg_io: first word decoded %u ms after start\n", e->a);
+      break;
+    case EV_RULES:
+      if (e->b)
+        fprintf(stderr, "predict: can't open %s (%s), using the built-in rules\n",
+                cfg.rulesFile, strerror(e->b));
+      else
+        fprintf(stdout, "predict: loaded %u rules from %s\n", e->a, cfg.rulesFile);
+      break;
+    case EV_RULE_BAD:
+      fprintf(stderr, "predict: %s:%u: rule not understood, ignored\n", cfg.rulesFile, e->a);
+      break;
+    #ifdef VERBOSE
+    case EV_SHORT_WORD:
+      fprintf(stdout, "panel_io: bus %u bit count < 20 (%u)! Repeating panel writes and ignoring reads.\n",
+              e->b, e->a);
+      break;
+    case EV_WORD: // decode again here rather than format text in msg_io
+      for (i = 0; i < MAX_BITS; i++)
+        word[i] = (((i < 32) ? e->a >> (31 - i) : e->b >> (63 - i)) & 1) ? '1' : '0';
+      decode(word, msg, allZones);
+      fprintf(stdout,
+              "index:%lu,%-50s, data: 0x%02x 0x%02x 0x%02x 0x%02x 0x%02x 0x%02x 0x%02x 0x%02x\n",
+              index++, msg, e->a >> 24, (e->a >> 16) & 0xff, (e->a >> 8) & 0xff, e->a & 0xff,
+              e->b >> 24, (e->b >> 16) & 0xff, (e->b >> 8) & 0xff, e->b & 0xff);
+      break;
+    #endif
+  }
+} // trace_emit()
+
+/*
+ * trace drainer thread
+ * Runs at normal priority every TRACE_DRAIN nanoseconds. It takes the new events from every
+ *   thread's trace ring, merges them in time order and writes them out with trace_emit().
+ * On SIGUSR1 it also dumps what the rings still hold to stderr.
+ */
+static void * trace_drainer(void * arg) {
+  static struct trace_event ev[NUM_RINGS][TRACE_LEN];
+  struct trace_event *e;
+  struct timespec t;
+  uint32_t before;
+  int ring, min, n[NUM_RINGS], next[NUM_RINGS];
+  FILE *fp = NULL;
+
+  if (cfg.traceFile && (fp = fopen(cfg.traceFile, "a")) == NULL)
+    perror("trace file open failed\n");
+
+  for (;;) {
+    clock_gettime(CLOCK_REALTIME, &t);
+    t.tv_nsec += TRACE_DRAIN;
+    tnorm(&t);
+    while (sem_timedwait(&traceWake, &t) == -1 && errno == EINTR);
+
+    if (traceDump) {
+      traceDump = 0;
+      fprintf(stderr, "kprw-server: trace dump follows\n");
+      trace_dump(STDERR_FILENO);
+    }
+
+    for (ring = 0; ring < NUM_RINGS; ring++) {
+      before = traceRings[ring].tail;
+      n[ring] = trace_copy(ring, &traceRings[ring].tail, ev[ring], TRACE_LEN);
+      __atomic_store_n(&traceRings[ring].lost,
+                       traceRings[ring].lost + traceRings[ring].tail - before - n[ring],
+                       __ATOMIC_RELAXED);
+      next[ring] = 0;
+    }
+
+    for (;;) { // oldest event first
+      for (ring = 0, min = -1; ring < NUM_RINGS; ring++) {
+        if (next[ring] == n[ring]) continue;
+        e = &ev[ring][next[ring]];
+        if (min < 0 || e->sec < ev[min][next[min]].sec ||
+            (e->sec == ev[min][next[min]].sec && e->nsec < ev[min][next[min]].nsec))
+          min = ring;
+      }
+      if (min < 0) break;
+      trace_emit(fp, min, &ev[min][next[min]++]);
+    }
+
+    if (fp) fflush(fp);
+    fflush(stdout);
+  }
+
+  return NULL;
+} // trace_drainer()
+
+// Compress a file into path.gz. Returns 0 on success or -1 on error.
+static int rlog_compress(const char *path, const char *gzPath) {
+  char buf[8*1024];
+  gzFile gz;
+  int fd, n, res = 0;
+
+  if ((fd = open(path, O_RDONLY)) == -1) return -1;
+  if ((gz = gzopen(gzPath, "wb")) == NULL) {
+    close(fd);
+    return -1;
+  }
+  while ((n = read(fd, buf, sizeof(buf))) > 0)
+    if (gzwrite(gz, buf, n) != n) {
+      res = -1;
+      break;
+    }
+  if (n < 0) res = -1;
+  if (gzclose(gz) != Z_OK) res = -1;
+  close(fd);
+
+  return res;
+} // rlog_compress()
+
+/*
+ * Rotate the R log: file.1.gz becomes file.2.gz and so on up to --rlog-keep segments,
+ *   and the current log is compressed into file.1.gz and started afresh.
+ */
+static void rlog_rotate(void) {
+  char from[PATH_MAX], to[PATH_MAX];
+  int i;
+
+  for (i = cfg.rlogKeep - 1; i > 0; i--) {
+    snprintf(from, sizeof(from), "%s.%d.gz", cfg.rlogFile, i);
+    snprintf(to, sizeof(to), "%s.%d.gz", cfg.rlogFile, i + 1);
+    rename(from, to);
+  }
+  snprintf(to, sizeof(to), "%s.1.gz", cfg.rlogFile);
+  if (rlog_compress(cfg.rlogFile, to) == -1) {
+    fprintf(stderr, "R log rotation failed, %s kept uncompressed\n", to);
+    snprintf(from, sizeof(from), "%s.1", cfg.rlogFile);
+    unlink(to);
+    rename(cfg.rlogFile, from);
+    return;
+  }
+  unlink(cfg.rlogFile);
+} // rlog_rotate()
+
+/*
+ * R log writer thread
+ * Runs at normal priority. Entries queued by rlog_write() are written in batches, once
+ *   RLOG_BATCH bytes are waiting or RLOG_FLUSH seconds after the last write, whichever
+ *   comes first, and the log is rotated when it reaches --rlog-max bytes.
+ */
+static void * rlog_writer(void * arg) {
+  struct timespec t;
+  struct stat st;
+  uint32_t head, tail, n;
+  unsigned long dropped = 0;
+  long size = 0;
+  int fd = -1, res;
+
+  for (;;) {
+    clock_gettime(CLOCK_REALTIME, &t);
+    t.tv_sec += RLOG_FLUSH;
+    while (sem_timedwait(&rlog.sem, &t) == -1 && errno == EINTR);
+    __atomic_store_n(&rlog.posted, 0, __ATOMIC_RELEASE);
+
+    head = __atomic_load_n(&rlog.head, __ATOMIC_ACQUIRE);
+    tail = rlog.tail;
+    if (head == tail) continue;
+
+    if (fd == -1) {
+      fd = open(cfg.rlogFile, O_WRONLY | O_CREAT | O_APPEND, 0666);
+      if (fd == -1) {
+        perror("R log open() failed\n");
+        __atomic_store_n(&rlog.tail, head, __ATOMIC_RELEASE); // drop rather than stall predict
+        continue;
+      }
+      size = (fstat(fd, &st) == -1) ? 0 : st.st_size;
+    }
+
+    while (tail != head) { // the buffer wraps at most once
+      n = RLOG_BUF_LEN - (tail & (RLOG_BUF_LEN - 1));
+      if (n > head - tail) n = head - tail;
+      res = write(fd, rlog.buf + (tail & (RLOG_BUF_LEN - 1)), n);
+      if (res == -1) {
+        if (errno == EINTR) continue;
+        perror("R log write() failed\n");
+        tail = head;
+        break;
+      }
+      tail += res;
+      size += res;
+    }
+    __atomic_store_n(&rlog.tail, tail, __ATOMIC_RELEASE);
+
+    if ((n = __atomic_load_n(&rlog.dropped, __ATOMIC_RELAXED)) != dropped) {
+      fprintf(stderr, "R log buffer full, %lu entries dropped\n", n - dropped);
+      dropped = n;
+    }
+
+    if (size >= cfg.rlogMax) {
+      close(fd);
+      fd = -1;
+      rlog_rotate();
+    }
+  }
+
+  return NULL;
+} // rlog_writer()
+
+// server
+static int create_socket(in_addr_t addr, int port)
+{
+  int listenfd = 0, res;
+  struct sockaddr_in server_addr;
+
+  listenfd = socket(AF_INET, SOCK_STREAM, 0);
+  if (listenfd == -1) {
+    perror("server: could not open socket\n");
+    exit(EXIT_FAILURE);;
+  }
+
+  memset(&server_addr, 0, sizeof(server_addr));
+  server_addr.sin_family = AF_INET;
+  server_addr.sin_addr.s_addr = htonl(addr);
+  server_addr.sin_port = htons(port);
+  res = bind(listenfd, (struct sockaddr *) &server_addr, sizeof(server_addr));
+  if (res) {
+    perror("server: bind() failed\n");
+    exit(EXIT_FAILURE);;
+  }
+
+  res = listen(listenfd, BACKLOG);
+  if (res == -1) {
+    perror("server: listen() failed\n");
+    exit(EXIT_FAILURE);;
+  }
+
+  return listenfd;
+} // create_socket()
+
+// openssl - reference: https://wiki.openssl.org/index.php/Simple_TLS_Server
+
+static void init_openssl() {
+  SSL_library_init();
+  OpenSSL_add_all_algorithms();
+  SSL_load_error_strings();
+} // openssl()
+
+static void cleanup_openssl() {
+  EVP_cleanup();
+} // cleanup_openssl()
+
+#ifdef HAVE_KTLS
+/*
+ * Check that the kernel can take over the tls record layer.
+ * The "tls" upper layer protocol is listed once the tls module is loaded.
+ */
+static int ktls_available(void) {
+  char ulp[128] = "";
+  FILE *fp;
+
+  if ((fp = fopen("/proc/sys/net/ipv4/tcp_available_ulp", "r")) == NULL)
+    return 0;
+  if (fgets(ulp, sizeof(ulp), fp) == NULL)
+    ulp[0] = '\0';
+  fclose(fp);
+
+  return (strstr(ulp, "tls") != NULL);
+} // ktls_available()
+#endif
+
+/*
+ * Report whether the kernel owns the tls record layer of a connection.
+ * Bit 0 is set for transmit offload, bit 1 for receive offload.
+ */
+static int ktls_state(SSL *ssl) {
+  int state = 0;
+
+  #ifdef HAVE_KTLS
+  if (BIO_get_ktls_send(SSL_get_wbio(ssl))) state |= 1;
+  if (BIO_get_ktls_recv(SSL_get_rbio(ssl))) state |= 2;
+  #endif
+
+  return state;
+} // ktls_state()
+
+static SSL_CTX *create_context() {
+  const SSL_METHOD *method;
+  SSL_CTX *ctx;
+
+  method = SSLv23_server_method();
+
+  ctx = SSL_CTX_new(method);
+  if (!ctx) {
+    perror("Unable to create SSL context");
+    ERR_print_errors_fp(stderr);
+    exit(EXIT_FAILURE);
+  }
+
+  // replies are written from a non-blocking transmit buffer that may move between retries
+  SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+  #ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+  // persistent clients may simply close the socket, treat that like close_notify
+  SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+  #endif
+
+  if (cfg.ktls) { // ask openssl to push negotiated keys into the kernel after each handshake
+    #ifdef HAVE_KTLS
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+    if (!ktls_available())
+      fprintf(stderr, "server: kernel has no tls module loaded, kTLS will fall back to user space\n");
+    #else
+    fprintf(stderr, "server: openssl was built without kTLS, using user space TLS\n");
+    cfg.ktls = 0;
+    #endif
+  }
+
+  return ctx;
+} // *create_context()
+
+static void configure_context(SSL_CTX *ctx) {
+  //SSL_CTX_set_ecdh_auto(ctx, 1); // supported from openssl 1.0.2, using 1.0.1e
+
+  /*
+   * certs and key pairs generated by the steps below
+   *
+   * Step 1. Generate ca private key
+   * $ openssl genrsa -out /home/pi/certs/ca/ca.key 4096
+   * Step 2. Create self-signed ca cert, COMMON_NAME="My CA"
+   * $ openssl req -new -x509 -days 365 -key /home/pi/certs/ca/ca.key \
+   *           -out /home/pi/certs/ca/ca.crt -sha256
+   *
+   * Step 3. Create client private key
+   * $ openssl genrsa -out /home/pi/certs/client/client.key 2048
+   * Step 4. Create client cert signing request, COMMON_NAME="Client 1"
+   * $ openssl req -new -key /home/pi/certs/client/client.key \
+   *           -out /home/pi/certs/client/client.csr -sha256
+   * Step 5. Create signed client cert
+   * $ openssl x509 -req -days 365 -in /home/pi/certs/client/client.csr -CA /home/pi/certs/ca/ca.crt \
+   *           -CAkey /home/pi/certs/ca/ca.key -set_serial 01 \
+   *           -out /home/pi/certs/client/client.crt -sha256
+   *
+   * Step 6. Create server private key
+   * $ openssl genrsa -out /home/pi/certs/server/server.key 2048
+   * Step 7. Create server cert signing request, COMMON_NAME="localhost"
+   * $ openssl req -new -key /home/pi/certs/server/server.key \
+   *           -out /home/pi/certs/server/server.csr -sha256
+   * Step 8. Create signed server cert, where "key.ext" contains "subjectAltName = IP:xxx.xxx.xxx.xxx"
+   * $ openssl x509 -req -days 365 -in /home/pi/certs/server/server.csr -CA /home/pi/certs/ca/ca.crt \
+   *           -CAkey /home/pi/certs/ca/ca.key -set_serial 02 \
+   *           -out /home/pi/certs/server/server.crt -sha256 -extfile /home/pi/certs/server/key.ext
+   *
+   * Step 9. Copy client key pair and CA certificate to Lambda
+   * $ cp /home/pi/certs/client/client.crt /home/pi/all/lambda
+   * $ cp /home/pi/certs/client/client.key /home/pi/all/lambda
+   * $ cp /home/pi/certs/ca/ca.crt /home/pi/all/lambda
+   */
+
+  if (SSL_CTX_use_certificate_file(ctx, "/home/pi/certs/server/server.crt", SSL_FILETYPE_PEM) < 0) {
+    ERR_print_errors_fp(stderr);
+    exit(EXIT_FAILURE);
+  }
+
+  if (SSL_CTX_use_PrivateKey_file(ctx, "/home/pi/certs/server/server.key", SSL_FILETYPE_PEM) < 0 ) {
+    ERR_print_errors_fp(stderr);
+    exit(EXIT_FAILURE);
+  }
+
+  // check if the certificate and private key match
+  if (SSL_CTX_check_private_key(ctx) != 1) {
+    fprintf(stderr, "Private key does not match the certificate public key\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // SSL_VERIFY_PEER is set so server sends a client certificate request.
+  SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+
+  // set the list of trusted CAs
+  if (SSL_CTX_load_verify_locations(ctx, "/home/pi/certs/ca/ca.crt", "/home/pi/certs/ca") < 1) {
+    fprintf(stderr, "Error setting the verify locations.\n");
+    exit(EXIT_FAILURE);
+  }
+} // configure_context()
+
+// Render a status snapshot as JSON.
+static int status_json(const struct status *s, unsigned long ver, char *out, int outsz) {
+  const struct pred_block *pr = &s->pred;
+  unsigned long act[NUMZONES], deact[NUMZONES];
+  const char *jsonFmt = "{\"version\":%lu,"
+                        "\"epoch\":%llu,"
+                        "\"obsTime\":%lu,"
+                        "\"zoneAct\":["
+                        "%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,"
+                        "%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu],"
+                        "\"zoneDeAct\":["
+                        "%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,"
+                        "%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu],"
+                        "\"numOcc\":%i,"
+                        "\"lastTruePred\":["
+                        "\"%s\",\"%s\",\"%s\",\"%s\",\"%s\",\"%s\",\"%s\",\"%s\",\"%s\",\"%s\"],"
+                        "\"ledStatus\":\"%s\","
+                        "\"zoneStatus\":[\"%s\",\"%s\",\"%s\",\"%s\"]}\n";
+  int i, len;
+
+  for (i = 0; i < NUMZONES; i++) { // whole seconds, as clients have always been sent
+    act[i] = s->zone.zoneAct[i] / 1000;
+    deact[i] = s->zone.zoneDeAct[i] / 1000;
+  }
+
+  len = snprintf(out, outsz, jsonFmt,
+                 ver, statusEpoch, (unsigned long) (s->obsTime / 1000),
+                 act[0],  act[1],  act[2],  act[3],
+                 act[4],  act[5],  act[6],  act[7],
+                 act[8],  act[9],  act[10], act[11],
+                 act[12], act[13], act[14], act[15],
+                 act[16], act[17], act[18], act[19],
+                 act[20], act[21], act[22], act[23],
+                 act[24], act[25], act[26], act[27],
+                 act[28], act[29], act[30], act[31],
+                 deact[0],  deact[1],  deact[2],  deact[3],
+                 deact[4],  deact[5],  deact[6],  deact[7],
+                 deact[8],  deact[9],  deact[10], deact[11],
+                 deact[12], deact[13], deact[14], deact[15],
+                 deact[16], deact[17], deact[18], deact[19],
+                 deact[20], deact[21], deact[22], deact[23],
+                 deact[24], deact[25], deact[26], deact[27],
+                 deact[28], deact[29], deact[30], deact[31],
+                 pr->numOcc,
+                 pr->lastTruePred[0], pr->lastTruePred[1], pr->lastTruePred[2],
+                 pr->lastTruePred[3], pr->lastTruePred[4], pr->lastTruePred[5],
+                 pr->lastTruePred[6], pr->lastTruePred[7], pr->lastTruePred[8],
+                 pr->lastTruePred[9],
+                 s->led.ledStatus, s->led.zoneStatus[0], s->led.zoneStatus[1],
+                 s->led.zoneStatus[2], s->led.zoneStatus[3]);
+
+  return (len < outsz) ? len : outsz - 1;
+} // status_json()
+
+// Render a status snapshot as text, the legacy reply format.
+static int status_text(const struct status *s, char *out, int outsz) {
+  int len;
+
+  len = snprintf(out, outsz, "%s, %s, %s, %s, %s,",
+                 s->led.ledStatus, s->led.zoneStatus[0], s->led.zoneStatus[1],
+                 s->led.zoneStatus[2], s->led.zoneStatus[3]);
+
+  return (len < outsz) ? len : outsz - 1;
+} // status_text()
+
+// Append an unsigned LEB128 varint.
+static inline unsigned char * put_varint(unsigned char *p, unsigned long v) {
+  while (v >= 0x80) {
+    *p++ = (v & 0x7f) | 0x80;
+    v >>= 7;
+  }
+  *p++ = v;
+
+  return p;
+} // put_varint()
+
+// Append a little-endian 32-bit value.
+static inline unsigned char * put_u32(unsigned char *p, uint32_t v) {
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+
+  return p + 4;
+} // put_u32()
+
+/*
+ * Render a status snapshot in the compact binary form, requested with "sendBIN".
+ * All fixed width fields are little-endian, varints are unsigned LEB128.
+ *
+ *   offset size
+ *    0      2   magic "KS"
+ *    2      1   format version, BIN_VERSION
+ *    3      1   LED flags: ready 0x01, error 0x02, bypass 0x04, memory 0x08,
+ *               armed 0x10, program 0x20
+ *    4      4   status version
+ *    8      4   obsTime, CLOCK_MONOTONIC seconds
+ *   12      4   active zone bitmask, bit n set if zone n+1 is active
+ *   16      1   numOcc
+ *   17      1   number of zones (NUMZONES)
+ *   18      1   number of predictions (NUMPRED)
+ *   19          zoneAct[NUMZONES] and then zoneDeAct[NUMZONES] as varints, CLOCK_MONOTONIC
+ *               seconds like obsTime
+ *               lastTruePred[NUMPRED] as varints, seconds since the epoch, 0 if never true
+ *
+ * The whole snapshot fits in BIN_MAX bytes.
+ */
+static int status_bin(const struct status *s, unsigned long ver, unsigned char *out) {
+  const struct zone_block *z = &s->zone;
+  const struct pred_block *pr = &s->pred;
+  unsigned char *p = out;
+  uint32_t active = 0;
+  int i;
+
+  for (i = 0; i < NUMZONES; i++)
+    if (z->zoneAct[i] > z->zoneDeAct[i]) active |= 1U << i;
+
+  *p++ = 'K';
+  *p++ = 'S';
+  *p++ = BIN_VERSION;
+  *p++ = s->led.ledBits;
+  p = put_u32(p, ver);
+  p = put_u32(p, s->obsTime / 1000);
+  p = put_u32(p, active);
+  *p++ = pr->numOcc;
+  *p++ = NUMZONES;
+  *p++ = NUMPRED;
+  for (i = 0; i < NUMZONES; i++) p = put_varint(p, z->zoneAct[i] / 1000);
+  for (i = 0; i < NUMZONES; i++) p = put_varint(p, z->zoneDeAct[i] / 1000);
+  for (i = 0; i < NUMPRED; i++) p = put_varint(p, pr->lastTruePredTime[i]);
+
+  return p - out;
+} // status_bin()
+
+/*
+ * Return the cached renderings of the current status of bus b.
+ * They are rebuilt only after msg_io or predict published a new status version
+ *   (and for JSON, when the observation time moved); otherwise replies are served by
+ *   copying the bytes rendered for an earlier request. Only panserv() uses the cache.
+ */
+static const struct render_cache * status_cache(struct bus *b) {
+  struct render_cache *rc = &rcache[b->id];
+  struct status *pstat = &b->status;
+  struct status snap;
+  unsigned long ver;
+
+  ver = status_version(pstat);
+  if (ver == rc->ver &&
+      __atomic_load_n(&pstat->obsTime, __ATOMIC_RELAXED) / 1000 == rc->obsTime)
+    return rc;
+
+  ver = status_read(pstat, &snap);
+  rc->jsonLen = status_json(&snap, ver, rc->json, sizeof(rc->json));
+  rc->binLen = status_bin(&snap, ver, rc->bin);
+  if (ver != rc->ver) {
+    rc->textLen = status_text(&snap, rc->text, sizeof(rc->text));
+    // remember this version so later requests can be answered with a delta against it
+    rc->head = (rc->head + 1) % HISTORY_LEN;
+    rc->hist[rc->head].ver = ver;
+    rc->hist[rc->head].s = snap;
+    if (rc->histLen < HISTORY_LEN) rc->histLen++;
+  }
+  rc->ver = ver;
+  rc->obsTime = snap.obsTime / 1000;
+
+  return rc;
+} // status_cache()
+
+// snprintf() into a reply buffer that may already be full.
+static int append(char *out, int outsz, int len, const char *fmt, ...) {
+  va_list ap;
+  int n;
+
+  if (len >= outsz - 1) return len;
+  va_start(ap, fmt);
+  n = vsnprintf(out + len, outsz - len, fmt, ap);
+  va_end(ap);
+
+  return (n < outsz - len) ? len + n : outsz - 1;
+} // append()
+
+/*
+ * Render the zone statistics of bus b as JSON, as of its observation time, one array per
+ *   statistic indexed by zone like the zone times in the status. sinceAct is -1 for a zone
+ *   not activated yet, times are in seconds.
+ * No number takes over 20 characters, so STATS_LEN holds any of them. Returns the length,
+ *   or -1 if out is too short for the whole document.
+ */
+static int stats_json(const struct bus *b, char *out, int outsz) {
+  struct stats_block st;
+  const struct zone_stats *z;
+  uint64_t now;
+  int i, w, len;
+
+  stats_read(b, &st);
+  now = __atomic_load_n(&b->status.obsTime, __ATOMIC_RELAXED);
+
+  len = append(out, outsz, 0, "{\"obsTime\":%lu,\"acts\":[", (unsigned long) (now / 1000));
+  for (i = 0; i < NUMZONES; i++)
+    len = append(out, outsz, len, i ? ",%lu" : "%lu", (unsigned long) st.zone[i].acts);
+  for (w = 0; w < ZSTAT_WINDOWS; w++) {
+    len = append(out, outsz, len, "],\"count%s\":[", zstatNames[w]);
+    for (i = 0; i < NUMZONES; i++)
+      len = append(out, outsz, len, i ? ",%.1f" : "%.1f", zstat_count(&st.zone[i], w, now));
+  }
+  len = append(out, outsz, len, "],\"sinceAct\":[");
+  for (i = 0, z = st.zone; i < NUMZONES; i++, z++)
+    len = append(out, outsz, len, i ? ",%ld" : "%ld", !z->lastAct ? -1L :
+                 (now > z->lastAct) ? (long) ((now - z->lastAct) / 1000) : 0L);
+  len = append(out, outsz, len, "],\"dwells\":[");
+  for (i = 0; i < NUMZONES; i++)
+    len = append(out, outsz, len, i ? ",%lu" : "%lu", (unsigned long) st.zone[i].dwells);
+  len = append(out, outsz, len, "],\"dwellMean\":[");
+  for (i = 0; i < NUMZONES; i++)
+    len = append(out, outsz, len, i ? ",%.1f" : "%.1f", st.zone[i].dwellMean);
+  len = append(out, outsz, len, "],\"dwellVar\":[");
+  for (i = 0; i < NUMZONES; i++)
+    len = append(out, outsz, len, i ? ",%.3g" : "%.3g", st.zone[i].dwellVar);
+
+  len = append(out, outsz, len, "]}\n");
+
+  return (len < outsz - 1) ? len : -1;
+} // stats_json()
+
+// Append an object holding the elements of a timestamp array that differ, keyed by index.
+static int delta_times(char *out, int outsz, int len, const char *name,
+                       const uint64_t *old, const uint64_t *cur, int num) {
+  int i, n = 0;
+
+  for (i = 0; i < num; i++) { // in whole seconds like the full status, see status_json()
+    if (old[i] / 1000 == cur[i] / 1000) continue;
+    len = append(out, outsz, len, n++ ? "," : ",\"%s\":{", name);
+    len = append(out, outsz, len, "\"%d\":%lu", i, (unsigned long) (cur[i] / 1000));
+  }
+  if (n) len = append(out, outsz, len, "}");
+
+  return len;
+} // delta_times()
+
+/*
+ * Render only what changed between the status at version since and the current status.
+ * Returns -1 if version since is no longer in the history, or is of another epoch (from
+ *   before a restart, or not given), the caller then sends a full snapshot. A delta reply
+ *   is told apart from a full one by its "since" field.
+ */
+static int status_delta(struct bus *b, unsigned long since, unsigned long long epoch,
+                        char *out, int outsz) {
+  const struct render_cache *rc = status_cache(b);
+  const struct status *old = NULL, *cur = &rc->hist[rc->head].s;
+  int i, n, len;
+
+  if (epoch != statusEpoch) return -1;
+  for (i = 0; i < rc->histLen; i++) {
+    if (rc->hist[i].ver == since) {
+      old = &rc->hist[i].s;
+      break;
+    }
+  }
+  if (!old) return -1;
+
+  len = append(out, outsz, 0, "{\"version\":%lu,\"epoch\":%llu,\"since\":%lu,\"obsTime\":%lu",
+               rc->ver, statusEpoch, since, rc->obsTime);
+  len = delta_times(out, outsz, len, "zoneAct", old->zone.zoneAct, cur->zone.zoneAct, NUMZONES);
+  len = delta_times(out, outsz, len, "zoneDeAct", old->zone.zoneDeAct, cur->zone.zoneDeAct, NUMZONES);
+  if (old->pred.numOcc != cur->pred.numOcc)
+    len = append(out, outsz, len, ",\"numOcc\":%i", cur->pred.numOcc);
+  for (i = 0, n = 0; i < NUMPRED; i++) {
+    if (!strcmp(old->pred.lastTruePred[i], cur->pred.lastTruePred[i])) continue;
+    len = append(out, outsz, len, n++ ? "," : ",\"lastTruePred\":{");
+    len = append(out, outsz, len, "\"%d\":\"%s\"", i, cur->pred.lastTruePred[i]);
+  }
+  if (n) len = append(out, outsz, len, "}");
+  if (strcmp(old->led.ledStatus, cur->led.ledStatus))
+    len = append(out, outsz, len, ",\"ledStatus\":\"%s\"", cur->led.ledStatus);
+  for (i = 0, n = 0; i < 4; i++) { // keyed by index into the full zoneStatus array
+    if (!strcmp(old->led.zoneStatus[i], cur->led.zoneStatus[i])) continue;
+    len = append(out, outsz, len, n++ ? "," : ",\"zoneStatus\":{");
+    len = append(out, outsz, len, "\"%d\":\"%s\"", i, cur->led.zoneStatus[i]);
+  }
+  if (n) len = append(out, outsz, len, "}");
+
+  return append(out, outsz, len, "}\n");
+} // status_delta()
+
+static time_t mono_sec(void) {
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+
+  return t.tv_sec;
+} // mono_sec()
+
+static long mono_ms(void) {
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+
+  return t.tv_sec * 1000L + t.tv_nsec / 1000000L;
+} // mono_ms()
+
+// number of keypad words of bus b waiting in fifo2 for the panel i/o thread
+static int key_queue_depth(struct bus *b) {
+  int used = b->m_Write2 - b->m_Read2;
+
+  if (used < 0) used += FIFO_SIZE;
+
+  return used / MAX_BITS;
+} // key_queue_depth()
+
+/*
+ * Refill a token bucket for the time since it was last used.
+ * Returns 0 if it holds enough tokens for keys presses, otherwise the ms until it will.
+ */
+static long key_wait(struct key_bucket *b, int rate, int burst, int keys, long now) {
+  long elapsed = now - b->lastMs;
+
+  if (elapsed > burst * 1000L / rate) // full again, also keeps the product below in range
+    b->tokens = burst * 1000L;
+  else if ((b->tokens += elapsed * rate) > burst * 1000L)
+    b->tokens = burst * 1000L;
+  b->lastMs = now;
+
+  if (b->tokens >= keys * 1000L) return 0;
+
+  return (keys * 1000L - b->tokens + rate - 1) / rate;
+} // key_wait()
+
+// Find the bucket of a client address, reusing the least recently used one if it has none.
+static struct key_bucket * key_bucket(uint32_t addr, long now) {
+  struct key_bucket *b = &keyBuckets[0];
+  int i;
+
+  for (i = 0; i < KEY_BUCKETS; i++) {
+    if (keyBuckets[i].addr == addr && keyBuckets[i].lastMs) return &keyBuckets[i];
+    if (keyBuckets[i].lastMs < b->lastMs) b = &keyBuckets[i];
+  }
+
+  b->addr = addr;
+  b->tokens = cfg.keyBurst * 1000L;
+  b->lastMs = now;
+
+  return b;
+} // key_bucket()
+
+/*
+ * Admission control for key presses sent to the panel of bus bus.
+ * A command is admitted only if its client address and all clients of the panel together
+ *   are within their key press rates and the keypad fifo stays within --key-queue words,
+ *   which the panel drains at about one word every KEY_WORD_MS. Admitting a command takes
+ *   its tokens. A client address has one bucket for all panels.
+ * Returns 0 if the keys may be queued, otherwise the ms after which a retry should succeed.
+ */
+static long key_admit(uint32_t addr, int keys, struct bus *bus) {
+  long now = mono_ms(), wait = 0, w;
+  struct key_bucket *b = key_bucket(addr, now), *g = &keyGlobal[bus->id];
+  int depth = key_queue_depth(bus);
+
+  if (depth + keys > cfg.keyQueue)
+    wait = (depth + keys - cfg.keyQueue) * KEY_WORD_MS;
+  if ((w = key_wait(b, cfg.keyRate, cfg.keyBurst, keys, now)) > wait)
+    wait = w;
+  if ((w = key_wait(g, cfg.keyGlobalRate, cfg.keyQueue, keys, now)) > wait)
+    wait = w;
+  if (wait) return wait;
+
+  b->tokens -= keys * 1000L;
+  g->tokens -= keys * 1000L;
+
+  return 0;
+} // key_admit()
+
+// status reply formats
+enum { FMT_TEXT, FMT_JSON, FMT_JSON_ETAG, FMT_JSON_SINCE, FMT_BIN };
+
+/*
+ * Decode and process a command sent from a client.
+ * Check for bad commands.
+ * Map to keypad data and send to the panel of bus b.
+ * The reply, zone and system status of bus b either as JSON or text, is written to out.
+ * "sendJSON etag=<version> epoch=<epoch>" replies with just
+ *   {"version":<version>,"epoch":<epoch>,"unchanged":true} if the status is still at that
+ *   version, so pollers can skip unchanged payloads. Versions start over when the server
+ *   restarts (but not on a takeover), and so does the epoch, so a version from before a
+ *   restart, or one sent without its epoch, never matches.
+ * "sendJSON since=<version> epoch=<epoch>" replies with only what changed after that
+ *   version, or with the full snapshot if the version is too old to diff against or of
+ *   another epoch.
+ * "sendBIN" replies with the status in the binary form described at status_bin().
+ * Status requests and invalid commands send nothing to the panel. Key presses are charged
+ *   to the client address addr and must pass key_admit() before any of them is queued.
+ *
+ * Returns the length of the reply, -1 if the command is invalid or -2 if the keypad
+ *   is busy, out then holds a "busy, retry after N ms" reply.
+ */
+static int panel_command(const char *cmd, int len, uint32_t addr, struct bus *b,
+                         char *out, int outsz) {
+  char buffer[BUF_LEN]="", wordk[MAX_BITS] = "", *arg;
+  const struct render_cache *rc;
+  int res, i = 0, keys = 0, sendFmt = FMT_TEXT;
+  long chkbuf, wait;
+  unsigned long ifVer = 0;
+  unsigned long long ifEpoch = 0;
+
+  if (len > BUF_LEN - 1) len = BUF_LEN - 1; // longest command accepted
+  memcpy(buffer, cmd, len);
+  buffer[len] = '\0';
+
+  #ifdef VERBOSE
+  fprintf(stdout, "server: panel received command %s\n", buffer);
+  #endif
+
+  // process commands
+  if (!isdigit(buffer[i])) { // not a number, but a command
+    keys = 1;
+    if (!strncmp(buffer, "star", 4))
+      key_encode(KP_STAR, wordk);
+    else if (!strncmp(buffer, "pound", 5))
+      key_encode(KP_POUND, wordk);
+    else if (!strncmp(buffer, "stay", 4))
+      key_encode(KP_STAY, wordk);
+    else if (!strncmp(buffer, "away", 4))
+      key_encode(KP_AWAY, wordk);
+    else if (!strncmp(buffer, "idle", 4))
+      memcpy(wordk, IDLE, MAX_BITS);
+    else if (!strncmp(buffer, "sendBIN", 7)) {
+      keys = 0;
+      sendFmt = FMT_BIN;
+    }
+
+    else if (!strncmp(buffer, "sendJSON", 8)) {
+      keys = 0;
+      sendFmt = FMT_JSON;
+      if ((arg = strstr(buffer, "epoch=")) != NULL) // 0, never an epoch, if not given
+        ifEpoch = strtoull(arg + 6, NULL, 10);
+      if ((arg = strstr(buffer, "etag=")) != NULL) {
+        ifVer = strtoul(arg + 5, NULL, 10);
+        sendFmt = FMT_JSON_ETAG;
+      } else if ((arg = strstr(buffer, "since=")) != NULL) {
+        ifVer = strtoul(arg + 6, NULL, 10);
+        sendFmt = FMT_JSON_SINCE;
+      }
+    } else { // reply with the status, as before, but send nothing to the panel
+      fprintf(stderr, "server: invalid panel command\n");
+      keys = 0;
+    }
+  } else { // a number or number(s)
+    chkbuf = strtol(buffer, NULL, 10);
+    for (keys = 0; isdigit(buffer[keys]); keys++);
+    if (chkbuf < 0 || chkbuf > 9999 || keys > KEY_MAX ||
+        (buffer[keys] && buffer[keys] != '\n' && buffer[keys] != '\r')) {
+      fprintf(stderr, "server: invalid panel command\n");
+      return -1;
+    }
+  }
+
+  // admit all of the command's key presses or none of them
+  if (keys && (wait = key_admit(addr, keys, b))) {
+    metric_inc(&metrics.keyBusy);
+    trace(RING_SERVER, EV_KEY_BUSY, keys, wait);
+    #ifdef VERBOSE
+    fprintf(stdout, "server: keypad busy, %d key(s) refused\n", keys);
+    #endif
+    snprintf(out, outsz, "busy, retry after %ld ms\n", wait);
+    return -2;
+  }
+
+  if (keys) trace(RING_SERVER, EV_KEY_ADMIT, keys, key_queue_depth(b));
+
+  // send keypad data to panel, admission keeps the fifo from filling up
+  if (keys && !isdigit(buffer[0])) {
+    res = pushElement2(b, wordk, MAX_BITS);
+    if (res != MAX_BITS)
+      fprintf(stderr, "server: fifo write error\n");
+  } else {
+    for (i = 0; i < keys; i++) { // the digits were checked above
+      key_encode(KP_0 + buffer[i] - '0', wordk);
+      // send keypad data to panel
+      res = pushElement2(b, wordk, MAX_BITS);
+      if (res != MAX_BITS) {
+        fprintf(stderr, "server: fifo write error\n");
+        break;
+      }
+    }
+  }
+
+  // send back zone and system status, either as JSON or text
+  rc = status_cache(b);
+  if (sendFmt == FMT_JSON_ETAG && ifVer == rc->ver && ifEpoch == statusEpoch) // client has it
+    return snprintf(out, outsz, "{\"version\":%lu,\"epoch\":%llu,\"unchanged\":true}\n",
+                    rc->ver, statusEpoch);
+  if (sendFmt == FMT_JSON_SINCE && (res = status_delta(b, ifVer, ifEpoch, out, outsz)) >= 0)
+    return res;
+  if (sendFmt == FMT_BIN) { // send zone data in the compact binary form
+    memcpy(out, rc->bin, rc->binLen);
+    return rc->binLen;
+  }
+  if (sendFmt != FMT_TEXT) { // send zone data as JSON
+    memcpy(out, rc->json, rc->jsonLen);
+    return rc->jsonLen;
+  } else { // send zone data as text, this is the default format
+    memcpy(out, rc->text, rc->textLen);
+    return rc->textLen;
+  }
+} // panel_command()
+
+static void client_close(struct client *c) {
+  #ifdef VERBOSE
+  fprintf(stdout, "server: client %s disconnected\n", c->addr);
+  #endif
+
+  SSL_free(c->ssl);
+  if (close(c->fd) == -1)
+    perror("server: error closing connection");
+
+  c->fd = -1;
+  c->ssl = NULL;
+} // client_close()
+
+/*
+ * Queue a reply for the client. Framed connections get a frame header with the request id.
+ * Returns 0 on success or -1 if the client is not draining its transmit buffer.
+ */
+static int client_reply(struct client *c, int type, uint32_t id, const char *buf, int len) {
+  unsigned char *hdr;
+  int need = len + ((c->mode == CL_FRAMED) ? FRAME_HDR_LEN : 0);
+
+  if (c->txLen + need > TX_BUF_LEN && c->txOff) { // reclaim space already sent
+    memmove(c->tx, c->tx + c->txOff, c->txLen - c->txOff);
+    c->txLen -= c->txOff;
+    c->txOff = 0;
+  }
+  if (c->txLen + need > TX_BUF_LEN)
+    return -1;
+
+  if (c->mode == CL_FRAMED) {
+    hdr = (unsigned char *) c->tx + c->txLen;
+    hdr[0] = FRAME_MAGIC;
+    hdr[1] = type;
+    hdr[2] = len >> 8;
+    hdr[3] = len;
+    hdr[4] = id >> 24;
+    hdr[5] = id >> 16;
+    hdr[6] = id >> 8;
+    hdr[7] = id;
+    c->txLen += FRAME_HDR_LEN;
+  }
+  memcpy(c->tx + c->txLen, buf, len);
+  c->txLen += len;
+
+  return 0;
+} // client_reply()
+
+/*
+ * Send as much of the transmit buffer as the socket takes.
+ * Returns 1 when the buffer is empty, 0 if data is still pending or -1 on error.
+ */
+static int client_flush(struct client *c) {
+  int res, err;
+
+  while (c->txOff < c->txLen) {
+    if (c->ktls & 1) { // kernel owns the record layer
+      res = write(c->fd, c->tx + c->txOff, c->txLen - c->txOff);
+      if (res == -1) {
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          c->wantWrite = 1;
+          return 0;
+        }
+        perror("server: kTLS write failed");
+        return -1;
+      }
+    } else {
+      res = SSL_write(c->ssl, c->tx + c->txOff, c->txLen - c->txOff);
+      if (res <= 0) {
+        err = SSL_get_error(c->ssl, res);
+        if (err == SSL_ERROR_WANT_WRITE) {
+          c->wantWrite = 1;
+          return 0;
+        }
+        if (err == SSL_ERROR_WANT_READ) return 0;
+        ERR_print_errors_fp(stderr);
+        return -1;
+      }
+    }
+    c->txOff += res;
+    c->lastActive = mono_sec();
+  }
+
+  c->txOff = c->txLen = 0;
+
+  return 1;
+} // client_flush()
+
+/*
+ * Read whatever the client has sent into its receive buffer.
+ * Returns 0 if the connection is still open or -1 if the peer closed it or on error.
+ */
+static int client_read(struct client *c) {
+  int res, err;
+
+  while (c->rxLen < RX_BUF_LEN) {
+    res = SSL_read(c->ssl, c->rx + c->rxLen, RX_BUF_LEN - c->rxLen);
+    if (res > 0) {
+      c->rxLen += res;
+      c->lastActive = mono_sec();
+      continue;
+    }
+    err = SSL_get_error(c->ssl, res);
+    if (err == SSL_ERROR_WANT_READ) return 0;
+    if (err == SSL_ERROR_WANT_WRITE) {
+      c->wantWrite = 1;
+      return 0;
+    }
+    if (err == SSL_ERROR_SSL) ERR_print_errors_fp(stderr); // otherwise the peer went away
+    return -1;
+  }
+
+  return 0;
+} // client_read()
+
+/*
+ * A command for the panel of another bus than bus 0 starts with "bus <id> ".
+ * Strips that from cmd and returns the bus the command is for, or NULL if it has no such bus.
+ */
+static struct bus * bus_select(const char **cmd, int *len) {
+  int i, id = 0;
+
+  if (*len < 5 || strncmp(*cmd, "bus ", 4)) return &buses[0];
+  for (i = 4; i < *len && isdigit((unsigned char) (*cmd)[i]) && id < MAX_BUSES; i++)
+    id = id * 10 + (*cmd)[i] - '0';
+  if (i == 4 || id >= cfg.buses || (i < *len && (*cmd)[i] != ' ')) return NULL;
+  if (i < *len) i++;
+  *cmd += i;
+  *len -= i;
+
+  return &buses[id];
+} // bus_select()
+
+/*
+ * Handle commands that concern the connection rather than the panel.
+ *   "subscribe [ms]" replies with the current status of bus b and then keeps pushing it
+ *     whenever it changes, no more often than every ms (and never below --push-interval).
+ *   "unsubscribe" stops the pushes.
+ *   "sendStats" replies with the zone statistics of bus b as JSON, see stats_json(). It is
+ *     longer than a panel reply and changes with every observation time, so it is not cached.
+ * Returns 1 if the command was handled, 0 if it is a panel command or -1 on error.
+ */
+static int client_command(struct client *c, const char *cmd, int len, uint32_t id,
+                          struct bus *b) {
+  char buffer[BUF_LEN], stats[STATS_LEN];
+  const struct render_cache *rc;
+  int ms, on = 1;
+
+  if (len > BUF_LEN - 1) len = BUF_LEN - 1;
+  memcpy(buffer, cmd, len);
+  buffer[len] = '\0';
+
+  if (!strncmp(buffer, "subscribe", 9)) {
+    ms = atoi(buffer + 9);
+    c->subscribed = 1;
+    c->subBus = b;
+    c->subId = id;
+    c->subInterval = (ms > cfg.pushInterval) ? ms : cfg.pushInterval;
+    rc = status_cache(b);
+    c->pushedVer = rc->ver;
+    c->lastPushMs = mono_ms();
+    c->stallMs = 0;
+    // a subscriber may be quiet for hours, let tcp find out if it went away
+    setsockopt(c->fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+    return (client_reply(c, FRAME_REPLY, id, rc->json, rc->jsonLen) < 0) ? -1 : 1;
+  }
+
+  if (!strncmp(buffer, "unsubscribe", 11)) {
+    c->subscribed = 0;
+    return (client_reply(c, FRAME_REPLY, id, "ok\n", 3) < 0) ? -1 : 1;
+  }
+
+  if (!strncmp(buffer, "sendStats", 9)) {
+    if ((len = stats_json(b, stats, sizeof(stats))) < 0)
+      return (client_reply(c, FRAME_ERROR, id, "stats too long\n", 15) < 0) ? -1 : 1;
+    return (client_reply(c, FRAME_REPLY, id, stats, len) < 0) ? -1 : 1;
+  }
+
+  return 0;
+} // client_command()
+
+/*
+ * Process the commands waiting in the client's receive buffer.
+ * A connection whose first byte is FRAME_MAGIC speaks the framed protocol, anything else
+ *   is a legacy client that sends one text command and expects the reply and a close
+ *   (or a stream of status pushes if the command was "subscribe").
+ * Returns 0 to keep the connection, 1 to close it once the reply is sent or -1 to drop it now.
+ */
+static int client_process(struct client *c) {
+  char reply[REPLY_LEN];
+  const char *cmd;
+  unsigned char *p;
+  struct bus *b;
+  int res, off = 0, len, n;
+  uint32_t id;
+
+  if (!c->rxLen) return 0;
+
+  if (c->mode == CL_UNKNOWN)
+    c->mode = ((unsigned char) c->rx[0] == FRAME_MAGIC) ? CL_FRAMED : CL_LEGACY;
+
+  if (c->mode == CL_LEGACY) { // single shot text command
+    if (c->subscribed) { // nothing more is expected from a legacy subscriber
+      c->rxLen = 0;
+      return 0;
+    }
+    for (len = 0; len < c->rxLen && c->rx[len] != '\n'; len++);
+    if (len < c->rxLen) len++; // keep the '\n', the digit decoder stops on it
+    c->rxLen = 0;
+    cmd = c->rx;
+    if (!(b = bus_select(&cmd, &len))) {
+      res = snprintf(reply, sizeof(reply), "invalid bus\n");
+      return (client_reply(c, 0, 0, reply, res) < 0) ? -1 : 1;
+    }
+    res = client_command(c, cmd, len, 0, b);
+    if (res) return (res < 0) ? -1 : !c->subscribed;
+    res = panel_command(cmd, len, c->ip, b, reply, sizeof(reply));
+    if (res == -1)
+      res = snprintf(reply, sizeof(reply), "invalid panel command\n");
+    else if (res == -2) // the busy reply is in reply
+      res = strlen(reply);
+    return (client_reply(c, 0, 0, reply, res) < 0) ? -1 : 1;
+  }
+
+  while (c->rxLen - off >= FRAME_HDR_LEN) {
+    p = (unsigned char *) c->rx + off;
+    len = (p[2] << 8) | p[3];
+    id = ((uint32_t) p[4] << 24) | (p[5] << 16) | (p[6] << 8) | p[7];
+    if (p[0] != FRAME_MAGIC || len > FRAME_MAX) {
+      fprintf(stderr, "server: client %s sent a malformed frame\n", c->addr);
+      return -1;
+    }
+    if (c->rxLen - off < FRAME_HDR_LEN + len) break; // wait for the rest of the frame
+    if (TX_BUF_LEN - (c->txLen - c->txOff) < STATS_LEN + FRAME_HDR_LEN)
+      break; // client is not reading its replies, stop taking requests until it does
+
+    cmd = (char *) p + FRAME_HDR_LEN;
+    n = len;
+    if (p[1] != FRAME_REQ) {
+      res = client_reply(c, FRAME_ERROR, id, "bad frame type\n", 15);
+    } else if (!(b = bus_select(&cmd, &n))) {
+      res = client_reply(c, FRAME_ERROR, id, "invalid bus\n", 12);
+    } else if ((res = client_command(c, cmd, n, id, b))) {
+      ; // handled by the server
+    } else {
+      res = panel_command(cmd, n, c->ip, b, reply, sizeof(reply));
+      if (res == -1)
+        res = client_reply(c, FRAME_ERROR, id, "invalid panel command\n", 22);
+      else if (res == -2)
+        res = client_reply(c, FRAME_ERROR, id, reply, strlen(reply));
+      else
+        res = client_reply(c, FRAME_REPLY, id, reply, res);
+    }
+    if (res < 0) return -1;
+    off += FRAME_HDR_LEN + len;
+  }
+
+  memmove(c->rx, c->rx + off, c->rxLen - off);
+  c->rxLen -= off;
+
+  return 0;
+} // client_process()
+
+/*
+ * Push the status of the bus each subscriber subscribed to, if it has not seen the
+ *   current version yet.
+ * Changes within a subscriber's interval are coalesced into a single push.
+ * A subscriber that is not draining its transmit buffer is skipped, it gets the latest
+ *   status once it catches up, and is dropped if it stays stalled for SUB_STALL_TIMEOUT.
+ * Returns the number of subscribers.
+ */
+static int push_status(void) {
+  const struct render_cache *rc;
+  struct client *c;
+  unsigned long ver[MAX_BUSES];
+  long now = mono_ms();
+  int i, nsubs = 0;
+
+  for (i = 0; i < cfg.buses; i++) ver[i] = status_version(&buses[i].status);
+  for (i = 0; i < MAX_CLIENTS; i++) {
+    c = &clients[i];
+    if (c->fd == -1 || !c->subscribed || c->state != CL_OPEN) continue;
+    nsubs++;
+    if (c->pushedVer == ver[c->subBus->id] || now - c->lastPushMs < c->subInterval) continue;
+
+    if (c->txLen - c->txOff > SUB_BACKLOG) {
+      if (!c->stallMs) {
+        c->stallMs = now;
+      } else if (now - c->stallMs > SUB_STALL_TIMEOUT) {
+        fprintf(stderr, "server: subscriber %s stalled, disconnecting\n", c->addr);
+        client_close(c);
+        nsubs--;
+      }
+      continue;
+    }
+    c->stallMs = 0;
+
+    rc = status_cache(c->subBus);
+    if (client_reply(c, FRAME_PUSH, c->subId, rc->json, rc->jsonLen) < 0 ||
+        client_flush(c) < 0) {
+      client_close(c);
+      nsubs--;
+      continue;
+    }
+    c->pushedVer = rc->ver;
+    c->lastPushMs = now;
+  }
+
+  return nsubs;
+} // push_status()
+
+/*
+ * Access control.
+ * The TCP Wrapper rules in HOSTS_ALLOW and HOSTS_DENY are compiled into address/mask
+ *   pairs when the server starts and again whenever either file changes, so checking a
+ *   client never touches the files or DNS. Access is granted if a rule in HOSTS_ALLOW
+ *   matches, denied if a rule in HOSTS_DENY matches and granted otherwise.
+ * Supported client patterns are ALL, a.b.c.d, a.b.c. (prefix), a.b.c.d/m.m.m.m,
+ *   a.b.c.d/len and EXCEPT. Host name patterns would need DNS and never match.
+ * A trailing ": allow" or ": deny" option overrides the meaning of the file.
+ */
+static void acl_add_net(struct acl_rule *r, int except, uint32_t net, uint32_t mask) {
+  int *num = except ? &r->numExcl : &r->numIncl;
+  struct acl_net *n = except ? r->excl : r->incl;
+
+  if (*num == ACL_MAX_NETS) {
+    fprintf(stderr, "server: too many clients in one access rule, ignoring %s\n",
+            inet_ntoa((struct in_addr) { htonl(net) }));
+    return;
+  }
+  n[*num].net = net & mask;
+  n[*num].mask = mask;
+  (*num)++;
+} // acl_add_net()
+
+// Compile one client pattern. Returns 0 if the pattern can not be matched numerically.
+static int acl_pattern(struct acl_rule *r, int except, char *pat) {
+  struct in_addr a, m;
+  char *slash, *end, *p;
+  int dots, i, len;
+  long bits;
+  uint32_t net = 0;
+
+  if (!strcasecmp(pat, "ALL")) {
+    acl_add_net(r, except, 0, 0);
+    return 1;
+  }
+
+  len = strlen(pat);
+  for (i = 0, dots = 0; i < len; i++) {
+    if (pat[i] == '.') dots++;
+    else if (!isdigit((unsigned char) pat[i]) && pat[i] != '/') return 0; // a host name
+  }
+
+  if (pat[len - 1] == '.') { // a.b.c. prefix
+    if (dots > 3) return 0;
+    for (i = 0, p = pat; i < dots; i++) {
+      net = (net << 8) | (strtoul(p, &end, 10) & 0xff);
+      p = end + 1;
+    }
+    acl_add_net(r, except, net << (8 * (4 - dots)), ~0U << (8 * (4 - dots)));
+    return 1;
+  }
+
+  if ((slash = strchr(pat, '/')) != NULL) *slash++ = '\0';
+  if (!inet_aton(pat, &a)) return 0;
+  if (!slash) {
+    acl_add_net(r, except, ntohl(a.s_addr), ~0U);
+  } else if (strchr(slash, '.')) { // a.b.c.d/m.m.m.m
+    if (!inet_aton(slash, &m)) return 0;
+    acl_add_net(r, except, ntohl(a.s_addr), ntohl(m.s_addr));
+  } else { // a.b.c.d/len
+    bits = strtol(slash, &end, 10);
+    if (*end || bits < 0 || bits > 32) return 0;
+    acl_add_net(r, except, ntohl(a.s_addr), bits ? ~0U << (32 - bits) : 0);
+  }
+
+  return 1;
+} // acl_pattern()
+
+// Compile one hosts_access file into the rule table. A missing file has no rules.
+static void acl_load_file(struct acl *acl, const char *path, int allow) {
+  char line[1024], *p, *daemons, *clients, *opts, *tok, *save;
+  int len = 0, except, ours;
+  struct acl_rule *r;
+  FILE *fp;
+
+  if ((fp = fopen(path, "r")) == NULL) return;
+
+  while (fgets(line + len, sizeof(line) - len, fp) != NULL) {
+    len = strlen(line);
+    if (len >= 2 && line[len - 2] == '\\') { // continued on the next line
+      len -= 2;
+      continue;
+    }
+    len = 0;
+    if ((p = strchr(line, '#')) != NULL) *p = '\0';
+
+    daemons = line;
+    if ((clients = strchr(daemons, ':')) == NULL) continue;
+    *clients++ = '\0';
+    if ((opts = strchr(clients, ':')) != NULL) *opts++ = '\0';
+
+    // does the rule apply to this server?
+    ours = except = 0;
+    for (tok = strtok_r(daemons, " \t,\n", &save); tok; tok = strtok_r(NULL, " \t,\n", &save)) {
+      if (!strcasecmp(tok, "EXCEPT")) except = 1;
+      else if (!strcasecmp(tok, "ALL") || !strcmp(tok, "kprw-server")) ours = !except;
+    }
+    if (!ours) continue;
+
+    if (acl->numRules == ACL_MAX_RULES) {
+      fprintf(stderr, "server: too many access rules, ignoring the rest of %s\n", path);
+      break;
+    }
+    r = &acl->rules[acl->numRules];
+    memset(r, 0, sizeof(*r));
+    r->allow = allow;
+    if (opts) {
+      if (strstr(opts, "deny")) r->allow = 0;
+      else if (strstr(opts, "allow")) r->allow = 1;
+    }
+
+    except = 0;
+    for (tok = strtok_r(clients, " \t,\n", &save); tok; tok = strtok_r(NULL, " \t,\n", &save)) {
+      if (!strcasecmp(tok, "EXCEPT")) except = 1;
+      else if (!acl_pattern(r, except, tok))
+        fprintf(stderr, "server: %s: client pattern %s needs DNS, not supported\n", path, tok);
+    }
+    if (r->numIncl) acl->numRules++;
+  }
+
+  fclose(fp);
+} // acl_load_file()
+
+// (Re)compile the access rules if the files changed since they were last loaded.
+static void acl_reload(struct acl *acl) {
+  struct file_stamp allow, deny;
+
+  file_stamp(HOSTS_ALLOW, &allow);
+  file_stamp(HOSTS_DENY, &deny);
+  if (acl->loaded && file_stamp_same(&allow, &acl->allow) && file_stamp_same(&deny, &acl->deny))
+    return;
+
+  acl->numRules = 0;
+  acl_load_file(acl, HOSTS_ALLOW, 1);
+  acl_load_file(acl, HOSTS_DENY, 0);
+  acl->allow = allow;
+  acl->deny = deny;
+  acl->loaded = 1;
+
+  #ifdef VERBOSE
+  fprintf(stdout, "server: loaded %d access rules\n", acl->numRules);
+  #endif
+} // acl_reload()
+
+static int acl_match(const struct acl_net *n, int num, uint32_t addr) {
+  int i;
+
+  for (i = 0; i < num; i++)
+    if ((addr & n[i].mask) == n[i].net) return 1;
+
+  return 0;
+} // acl_match()
+
+// Check a client address (host byte order). Returns 1 if access is granted.
+static int acl_check(const struct acl *acl, uint32_t addr) {
+  const struct acl_rule *r;
+  int i;
+
+  for (i = 0; i < acl->numRules; i++) {
+    r = &acl->rules[i];
+    if (acl_match(r->incl, r->numIncl, addr) && !acl_match(r->excl, r->numExcl, addr))
+      return r->allow;
+  }
+
+  return 1;
+} // acl_check()
+
+/*
+ * Host name logger thread.
+ * Reverse DNS lookups can block for seconds, so panserv() only queues the addresses it
+ *   wants logged by name and this low priority thread resolves and prints them.
+ * The queue has one producer and one consumer, like the fifos.
+ */
+static void * host_logger(void *arg) {
+  char host[NI_MAXHOST], service[NI_MAXSERV];
+  struct sockaddr_in sa;
+  struct hostlog_entry *e;
+
+  for (;;) {
+    while (sem_wait(&hostLog.sem) == -1 && errno == EINTR);
+
+    e = &hostLog.q[hostLog.read];
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr = e->addr;
+    sa.sin_port = e->port;
+    if (getnameinfo((struct sockaddr *) &sa, sizeof(sa), host, NI_MAXHOST,
+                    service, NI_MAXSERV, 0)) {
+      snprintf(host, sizeof(host), "?UNKNOWN?");
+      snprintf(service, sizeof(service), "%u", ntohs(e->port));
+    }
+    fprintf(e->denied ? stderr : stdout, "server: %s %s (%s, %s)\n",
+            e->denied ? "connection disallowed for" : "connection requested from",
+            inet_ntoa(e->addr), host, service);
+    __atomic_store_n(&hostLog.read, (hostLog.read + 1) % HOSTLOG_LEN, __ATOMIC_RELEASE);
+  }
+
+  return NULL;
+} // host_logger()
+
+// Queue a client address to be logged by name. Drops it if the logger has fallen behind.
+static void host_log(const struct sockaddr_in *sa, int denied) {
+  int next = (hostLog.write + 1) % HOSTLOG_LEN;
+
+  if (next == __atomic_load_n(&hostLog.read, __ATOMIC_ACQUIRE)) return;
+  hostLog.q[hostLog.write].addr = sa->sin_addr;
+  hostLog.q[hostLog.write].port = sa->sin_port;
+  hostLog.q[hostLog.write].denied = denied;
+  hostLog.write = next;
+  sem_post(&hostLog.sem);
+} // host_log()
+
+// Accept all pending connections, check access rules and start their TLS handshakes.
+static void accept_clients(int listenfd, SSL_CTX *ctx) {
+  int connfd, i;
+  socklen_t addrlen;
+  struct sockaddr_in client_addr;
+  struct client *c;
+
+  for (;;) {
+    memset(&client_addr, 0, sizeof(client_addr));
+    addrlen = sizeof(client_addr);
+
+    connfd = accept(listenfd, (struct sockaddr *) &client_addr, &addrlen);
+    if (connfd == -1) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        perror("server: accept failed\n");
+      return;
+    }
+
+    #ifdef VERBOSE
+    host_log(&client_addr, 0);
+    #endif
+
+    if (!acl_check(&acl, ntohl(client_addr.sin_addr.s_addr))) {
+      fprintf(stderr, "Client %s connection disallowed\n", inet_ntoa(client_addr.sin_addr));
+      host_log(&client_addr, 1);
+      close(connfd);
+      continue;
+    }
+
+    for (i = 0; i < MAX_CLIENTS && clients[i].fd != -1; i++);
+    if (i == MAX_CLIENTS) {
+      fprintf(stderr, "server: too many clients, %s refused\n", inet_ntoa(client_addr.sin_addr));
+      close(connfd);
+      continue;
+    }
+
+    if (fcntl(connfd, F_SETFL, fcntl(connfd, F_GETFL) | O_NONBLOCK) == -1) {
+      perror("server: fcntl failed\n");
+      close(connfd);
+      continue;
+    }
+
+    c = &clients[i];
+    memset(c, 0, offsetof(struct client, rx)); // buffers are reset through their lengths
+    c->fd = connfd;
+    c->ssl = SSL_new(ctx);
+    SSL_set_fd(c->ssl, connfd);
+    c->state = CL_HANDSHAKE;
+    c->mode = CL_UNKNOWN;
+    c->lastActive = mono_sec();
+    clock_gettime(CLOCK_MONOTONIC, &c->accepted);
+    inet_ntop(AF_INET, &client_addr.sin_addr, c->addr, sizeof(c->addr));
+    c->ip = ntohl(client_addr.sin_addr.s_addr);
+  }
+} // accept_clients()
+
+// Advance the TLS handshake. Returns 1 when complete, 0 if still in progress or -1 on error.
+static int client_handshake(struct client *c) {
+  struct timespec now;
+  int res, err;
+
+  res = SSL_accept(c->ssl);
+  if (res <= 0) {
+    err = SSL_get_error(c->ssl, res);
+    if (err == SSL_ERROR_WANT_READ) return 0;
+    if (err == SSL_ERROR_WANT_WRITE) {
+      c->wantWrite = 1;
+      return 0;
+    }
+    ERR_print_errors_fp(stderr);
+    metric_inc(&metrics.handshakeFails);
+    return -1;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  metrics.handshakeUs += (now.tv_sec - c->accepted.tv_sec) * 1000000ULL +
+                         (now.tv_nsec - c->accepted.tv_nsec) / 1000;
+  metric_inc(&metrics.handshakes);
+
+  c->state = CL_OPEN;
+  c->ktls = ktls_state(c->ssl);
+  if (cfg.ktls && !(c->ktls & 1) && !ktlsWarned) { // report the fallback once, not per connection
+    fprintf(stderr, "server: kTLS not engaged for %s %s, using user space TLS\n",
+            SSL_get_version(c->ssl), SSL_get_cipher(c->ssl));
+    ktlsWarned = 1;
+  }
+
+  #ifdef VERBOSE
+  fprintf(stdout, "server: client %s connected with %s %s encryption (kTLS tx:%s rx:%s)\n",
+          c->addr, SSL_get_version(c->ssl), SSL_get_cipher(c->ssl),
+          (c->ktls & 1) ? "on" : "off", (c->ktls & 2) ? "on" : "off");
+  #endif
+
+  return 1;
+} // client_handshake()
+
+/*
+ * Make whatever progress a client connection allows.
+ * Returns 0 to keep serving it or -1 if it was closed.
+ */
+static int client_service(struct client *c) {
+  int res, closed = 0, done;
+
+  c->wantWrite = 0;
+
+  if (c->state == CL_HANDSHAKE) {
+    res = client_handshake(c);
+    if (res < 0) {
+      client_close(c);
+      return -1;
+    }
+    if (!res) return 0;
+  }
+
+  if (client_flush(c) < 0) {
+    client_close(c);
+    return -1;
+  }
+
+  if (c->state == CL_OPEN && client_read(c) < 0) closed = 1;
+
+  res = client_process(c);
+  if (res < 0) {
+    client_close(c);
+    return -1;
+  }
+  if (res == 1) c->state = CL_CLOSING;
+
+  done = client_flush(c);
+  if (done < 0 || (done && (closed || c->state == CL_CLOSING))) {
+    client_close(c);
+    return -1;
+  }
+  if (closed) c->state = CL_CLOSING; // flush the remaining replies, then close
+
+  return 0;
+} // client_service()
+
+// Render the counters in the prometheus text format.
+// Returns the length, or -1 if out is too short for all of them, never a partial scrape.
+static int http_metrics(char *out, int outsz) {
+  static const char *loops[NUM_LOOPS] = {"panel_io", "msg_io", "predict"};
+  unsigned long n, ms;
+  unsigned long long ns;
+  long rssKb, lckKb;
+  struct rusage ru;
+  struct bus *b;
+  int len = 0, i, j, ncl = 0;
+
+  for (i = 0; i < MAX_CLIENTS; i++) ncl += (clients[i].fd != -1);
+
+  len = append(out, outsz, len,
+               "# HELP kprw_fifo_depth Words waiting in a fifo.\n"
+               "# TYPE kprw_fifo_depth gauge\n");
+  for (i = 0; i < cfg.buses; i++) {
+    b = &buses[i];
+    len = append(out, outsz, len,
+                 "kprw_fifo_depth{bus=\"%d\",fifo=\"panel\"} %d\n"
+                 "kprw_fifo_depth{bus=\"%d\",fifo=\"keypad\"} %d\n",
+                 i, ((b->m_Write1 - b->m_Read1 + FIFO_SIZE) % FIFO_SIZE) / MAX_BITS,
+                 i, key_queue_depth(b));
+  }
+  len = append(out, outsz, len,
+               "# HELP kprw_panel_words_total Words read from the keybus.\n"
+               "# TYPE kprw_panel_words_total counter\n");
+  for (i = 0; i < cfg.buses; i++)
+    len = append(out, outsz, len, "kprw_panel_words_total{bus=\"%d\"} %lu\n",
+                 i, metric_get(&metrics.panelWords[i]));
+  len = append(out, outsz, len,
+               "# HELP kprw_short_words_total Words dropped for having fewer than 20 bits.\n"
+               "# TYPE kprw_short_words_total counter\n");
+  for (i = 0; i < cfg.buses; i++)
+    len = append(out, outsz, len, "kprw_short_words_total{bus=\"%d\"} %lu\n",
+                 i, metric_get(&metrics.shortWords[i]));
+  len = append(out, outsz, len,
+               "# HELP kprw_bus_cpu_seconds_total Time the keybus threads spent on a bus.\n"
+               "# TYPE kprw_bus_cpu_seconds_total counter\n");
+  for (i = 0; i < cfg.buses; i++)
+    for (j = 0; j < 2; j++) {
+      ns = __atomic_load_n(&metrics.busNs[i][j], __ATOMIC_RELAXED);
+      len = append(out, outsz, len,
+                   "kprw_bus_cpu_seconds_total{bus=\"%d\",thread=\"%s\"} %llu.%09llu\n",
+                   i, loops[j], ns / NSEC_PER_SEC, ns % NSEC_PER_SEC);
+    }
+  len = append(out, outsz, len,
+               "# HELP kprw_decoded_total Panel and keypad words decoded, "
+               "by bus and command byte.\n"
+               "# TYPE kprw_decoded_total counter\n");
+  for (i = 0; i < cfg.buses; i++)
+    for (j = 0; j < 256; j++)
+      if ((n = metric_get(&metrics.decoded[i][j])))
+        len = append(out, outsz, len, "kprw_decoded_total{bus=\"%d\",cmd=\"0x%02x\"} %lu\n",
+                     i, j, n);
+  len = append(out, outsz, len,
+               "# HELP kprw_repeated_words_total Words the same as the last, counted not queued, "
+               "by bus and command byte.\n"
+               "# TYPE kprw_repeated_words_total counter\n");
+  for (i = 0; i < cfg.buses; i++)
+    for (j = 0; j < 256; j++)
+      if ((n = metric_get(&metrics.repeats[i][j])))
+        len = append(out, outsz, len,
+                     "kprw_repeated_words_total{bus=\"%d\",cmd=\"0x%02x\"} %lu\n", i, j, n);
+  len = append(out, outsz, len,
+               "# HELP kprw_keybus_idle_seconds Time since the last decoded word, "
+               "over 1 s when the bus is dead.\n"
+               "# TYPE kprw_keybus_idle_seconds gauge\n");
+  for (i = 0; i < cfg.buses; i++)
+    if ((n = metric_get(&metrics.lastWord[i])))
+      len = append(out, outsz, len, "kprw_keybus_idle_seconds{bus=\"%d\"} %ld\n",
+                   i, (long) (mono_sec() - n));
+  ms = metric_get(&metrics.predictMs);
+  len = append(out, outsz, len,
+               "# HELP kprw_prediction_seconds Time spent running the prediction script.\n"
+               "# TYPE kprw_prediction_seconds summary\n"
+               "kprw_prediction_seconds_sum %lu.%03lu\n"
+               "kprw_prediction_seconds_count %lu\n",
+               ms / 1000, ms % 1000, metric_get(&metrics.predictions));
+  len = append(out, outsz, len,
+               "# HELP kprw_tls_handshakes_total TLS handshakes with command clients.\n"
+               "# TYPE kprw_tls_handshakes_total counter\n"
+               "kprw_tls_handshakes_total{result=\"ok\"} %lu\n"
+               "kprw_tls_handshakes_total{result=\"failed\"} %lu\n"
+               "# HELP kprw_tls_handshake_seconds Time from accept to a completed handshake.\n"
+               "# TYPE kprw_tls_handshake_seconds summary\n"
+               "kprw_tls_handshake_seconds_sum %llu.%06llu\n"
+               "kprw_tls_handshake_seconds_count %lu\n",
+               metrics.handshakes, metrics.handshakeFails,
+               metrics.handshakeUs / 1000000, metrics.handshakeUs % 1000000, metrics.handshakes);
+  len = append(out, outsz, len,
+               "# HELP kprw_loop_overruns_total Periodic thread wake ups a period or more late.\n"
+               "# TYPE kprw_loop_overruns_total counter\n");
+  for (i = 0; i < NUM_LOOPS; i++)
+    len = append(out, outsz, len, "kprw_loop_overruns_total{thread=\"%s\"} %lu\n",
+                 loops[i], metric_get(&metrics.overruns[i]));
+  ns = __atomic_load_n(&metrics.spinNs, __ATOMIC_RELAXED);
+  len = append(out, outsz, len,
+               "# HELP kprw_spin_seconds_total Time panel_io spun to place keybus samples.\n"
+               "# TYPE kprw_spin_seconds_total counter\n"
+               "kprw_spin_seconds_total %llu.%09llu\n"
+               "# HELP kprw_spin_waits_total Keybus samples placed by spinning.\n"
+               "# TYPE kprw_spin_waits_total counter\n"
+               "kprw_spin_waits_total %lu\n"
+               "# HELP kprw_spin_late_total Keybus samples woken past their instant.\n"
+               "# TYPE kprw_spin_late_total counter\n"
+               "kprw_spin_late_total %lu\n",
+               ns / NSEC_PER_SEC, ns % NSEC_PER_SEC, metric_get(&metrics.spinWaits),
+               metric_get(&metrics.spinLate));
+  len = append(out, outsz, len,
+               "# HELP kprw_sched_deadline Periodic thread runs under SCHED_DEADLINE.\n"
+               "# TYPE kprw_sched_deadline gauge\n");
+  for (i = 0; i < NUM_LOOPS; i++)
+    len = append(out, outsz, len, "kprw_sched_deadline{thread=\"%s\"} %d\n",
+                 loops[i], __atomic_load_n(&metrics.deadline[i], __ATOMIC_RELAXED));
+  len = append(out, outsz, len,
+               "# HELP kprw_deadline_overruns_total Deadline thread runtime overruns.\n"
+               "# TYPE kprw_deadline_overruns_total counter\n");
+  for (i = 0; i < NUM_LOOPS; i++)
+    len = append(out, outsz, len, "kprw_deadline_overruns_total{thread=\"%s\"} %lu\n",
+                 loops[i], metric_get(&metrics.dlOverruns[i]));
+  len = append(out, outsz, len,
+               "# HELP kprw_keypad_busy_total Keypad commands refused by admission control.\n"
+               "# TYPE kprw_keypad_busy_total counter\n"
+               "kprw_keypad_busy_total %lu\n"
+               "# HELP kprw_clients Open command connections.\n"
+               "# TYPE kprw_clients gauge\n"
+               "kprw_clients %d\n"
+               "# HELP kprw_status_version Current status version.\n"
+               "# TYPE kprw_status_version gauge\n",
+               metrics.keyBusy, ncl);
+  for (i = 0; i < cfg.buses; i++)
+    len = append(out, outsz, len, "kprw_status_version{bus=\"%d\"} %lu\n",
+                 i, status_version(&buses[i].status));
+  mem_usage(&rssKb, &lckKb);
+  getrusage(RUSAGE_SELF, &ru);
+  ms = metric_get(&metrics.firstWordMs);
+  len = append(out, outsz, len,
+               "# HELP kprw_resident_bytes Resident memory of the server.\n"
+               "# TYPE kprw_resident_bytes gauge\n"
+               "kprw_resident_bytes %ld\n"
+               "# HELP kprw_locked_bytes Memory the server holds locked.\n"
+               "# TYPE kprw_locked_bytes gauge\n"
+               "kprw_locked_bytes %ld\n"
+               "# HELP kprw_page_faults_total Page faults taken by the server since start.\n"
+               "# TYPE kprw_page_faults_total counter\n"
+               "kprw_page_faults_total{type=\"minor\"} %ld\n"
+               "kprw_page_faults_total{type=\"major\"} %ld\n",
+               rssKb * 1024, lckKb * 1024, ru.ru_minflt, ru.ru_majflt);
+  if (ms)
+    len = append(out, outsz, len,
+                 "# HELP kprw_first_word_seconds Time from start to the first decoded word.\n"
+                 "# TYPE kprw_first_word_seconds gauge\n"
+                 "kprw_first_word_seconds %lu.%03lu\n",
+                 ms / 1000, ms % 1000);
+  len = append(out, outsz, len,
+               "# HELP kprw_trace_events_total Trace events recorded.\n"
+               "# TYPE kprw_trace_events_total counter\n");
+  for (i = 0; i < NUM_RINGS; i++)
+    len = append(out, outsz, len, "kprw_trace_events_total{thread=\"%s\"} %u\n",
+                 traceRingNames[i], __atomic_load_n(&traceRings[i].head, __ATOMIC_RELAXED));
+  len = append(out, outsz, len,
+               "# HELP kprw_trace_lost_total Trace events overwritten before they were drained.\n"
+               "# TYPE kprw_trace_lost_total counter\n");
+  for (i = 0; i < NUM_RINGS; i++)
+    len = append(out, outsz, len, "kprw_trace_lost_total{thread=\"%s\"} %u\n",
+                 traceRingNames[i], __atomic_load_n(&traceRings[i].lost, __ATOMIC_RELAXED));
+
+  return (len < outsz - 1) ? len : -1;
+} // http_metrics()
+
+// The most recent trace events of every thread that fit in the response, ring by ring.
+static int http_trace(char *out, int outsz) {
+  struct trace_event ev[HTTP_BUF_LEN / TRACE_LINE];
+  uint32_t from;
+  int len = 0, ring, n, i, per = outsz / TRACE_LINE / NUM_RINGS;
+
+  for (ring = 0; ring < NUM_RINGS; ring++) {
+    from = __atomic_load_n(&traceRings[ring].head, __ATOMIC_ACQUIRE);
+    from = (from > per) ? from - per : 0;
+    n = trace_copy(ring, &from, ev, per);
+    for (i = 0; i < n; i++) len += trace_line(out + len, ring, &ev[i]);
+  }
+
+  return len;
+} // http_trace()
+
+static void http_close(struct http_conn *h) {
+  close(h->fd);
+  h->fd = -1;
+} // http_close()
+
+// Accept connections to the local http listener.
+static void http_accept(int httpfd) {
+  int connfd, i;
+
+  while ((connfd = accept(httpfd, NULL, NULL)) != -1) {
+    for (i = 0; i < HTTP_CLIENTS && httpConns[i].fd != -1; i++);
+    if (i == HTTP_CLIENTS ||
+        fcntl(connfd, F_SETFL, fcntl(connfd, F_GETFL) | O_NONBLOCK) == -1) {
+      close(connfd);
+      continue;
+    }
+    httpConns[i].fd = connfd;
+    httpConns[i].opened = mono_sec();
+    httpConns[i].inLen = httpConns[i].outLen = httpConns[i].outOff = 0;
+  }
+} // http_accept()
 
-  listenfd = socket(AF_INET, SOCK_STREAM, 0);
-  if (listenfd == -1) {
-    perror("server: could not open socket\n");
-    exit(EXIT_FAILURE);;
+/*
+ * Serve one request on a local http connection, then close it.
+ * "GET /status" returns the status as JSON, "GET /stats" the zone statistics as JSON and
+ *   "GET /metrics" the counters in the prometheus text format. They only read the status
+ *   and statistics through their sequence locks and the counters with relaxed loads, so a
+ *   scrape never holds up the real-time threads.
+ */
+static void http_service(struct http_conn *h) {
+  char body[HTTP_BUF_LEN];
+  const struct render_cache *rc;
+  const char *type = "text/plain", *code = "200 OK", *q;
+  int res, len, n, id = 0;
+
+  if (!h->outLen) { // still reading the request
+    res = read(h->fd, h->in + h->inLen, sizeof(h->in) - 1 - h->inLen);
+    if (res == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return;
+    if (res <= 0) {
+      http_close(h);
+      return;
+    }
+    h->inLen += res;
+    h->in[h->inLen] = '\0';
+    if (!strstr(h->in, "\r\n\r\n") && !strstr(h->in, "\n\n")) {
+      if (h->inLen == sizeof(h->in) - 1) http_close(h); // header too long
+      return;
+    }
+
+    // /status and /stats take the bus as ?bus=N
+    n = !strncmp(h->in, "GET /status", 11) ? 11 : !strncmp(h->in, "GET /stats", 10) ? 10 : 0;
+    if (n && h->in[n] == '?' && (q = strstr(h->in + n, "bus=")) && q < strpbrk(h->in + n, " \r\n"))
+      id = (isdigit((unsigned char) q[4]) && !isdigit((unsigned char) q[5])) ? q[4] - '0' : -1;
+    if (n && (h->in[n] == ' ' || h->in[n] == '?') && (id < 0 || id >= cfg.buses)) {
+      len = snprintf(body, sizeof(body), "not found\n");
+      code = "404 Not Found";
+    } else if (n == 11 && (h->in[n] == ' ' || h->in[n] == '?')) {
+      rc = status_cache(&buses[id]);
+      len = rc->jsonLen;
+      memcpy(body, rc->json, len);
+      type = "application/json";
+    } else if (n == 10 && (h->in[n] == ' ' || h->in[n] == '?')) {
+      if ((len = stats_json(&buses[id], body, sizeof(body))) < 0) {
+        len = snprintf(body, sizeof(body), "stats too long\n");
+        code = "500 Internal Server Error";
+      } else {
+        type = "application/json";
+      }
+    } else if (!strncmp(h->in, "GET /trace ", 11)) {
+      len = http_trace(body, sizeof(body));
+    } else if (!strncmp(h->in, "GET /metrics ", 13)) {
+      if ((len = http_metrics(body, sizeof(body))) < 0) {
+        len = snprintf(body, sizeof(body), "metrics too long\n");
+        code = "500 Internal Server Error";
+      } else {
+        type = "text/plain; version=0.0.4";
+      }
+    } else {
+      len = snprintf(body, sizeof(body), "not found\n");
+      code = "404 Not Found";
+    }
+    // the body fits after the header, so Content-Length is what is sent
+    if (len > HTTP_BUF_LEN) len = HTTP_BUF_LEN;
+    h->outLen = snprintf(h->out, HTTP_HDR_LEN,
+                         "HTTP/1.0 %s\r\nContent-Type: %s\r\nContent-Length: %d\r\n"
+                         "Connection: close\r\n\r\n", code, type, len);
+    memcpy(h->out + h->outLen, body, len);
+    h->outLen += len;
   }
 
-  memset(&server_addr, 0, sizeof(server_addr));
-  server_addr.sin_family = AF_INET;
-  server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-  server_addr.sin_port = htons(port);
-  res = bind(listenfd, (struct sockaddr *) &server_addr, sizeof(server_addr));
-  if (res) {
-    perror("server: bind() failed\n");
-    exit(EXIT_FAILURE);;
+  while (h->outOff < h->outLen) {
+    res = write(h->fd, h->out + h->outOff, h->outLen - h->outOff);
+    if (res == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return;
+    if (res <= 0) break;
+    h->outOff += res;
   }
+  http_close(h);
+} // http_service()
 
-  res = listen(listenfd, BACKLOG);
-  if (res == -1) {
-    perror("server: listen() failed\n");
-    exit(EXIT_FAILURE);;
+/*
+ * Handoff to a new instance.
+ * A new server started with --takeover connects to the abstract unix socket HANDOFF_NAME of
+ *   the server running on the same port, see takeover(). The running server stops panel_io
+ *   between two words and msg_io, then sends its status, the words waiting in both fifos and
+ *   its listening sockets (SCM_RIGHTS). Once the new server confirms, it takes the keybus
+ *   and the running server exits. Client connections are not handed over, they are closed
+ *   and the clients reconnect to the same listening socket.
+ * If the new server fails to confirm, everything is put back and the running server carries on.
+ */
+
+// Name of the handoff socket for port, in the abstract namespace.
+static socklen_t handoff_addr(struct sockaddr_un *addr, int port) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1, HANDOFF_NAME, port);
+
+  return offsetof(struct sockaddr_un, sun_path) + 1 + strlen(addr->sun_path + 1);
+} // handoff_addr()
+
+// Listen for a new instance on the handoff socket. Returns the socket or -1.
+static int handoff_listen(int port) {
+  struct sockaddr_un addr;
+  socklen_t len = handoff_addr(&addr, port);
+  int fd;
+
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd == -1) return -1;
+  if (bind(fd, (struct sockaddr *) &addr, len) == -1 || listen(fd, 1) == -1) {
+    close(fd); // EADDRINUSE while the server this one took over from is exiting
+    return -1;
   }
 
-  return listenfd;
-} // create_socket()
+  return fd;
+} // handoff_listen()
 
-// openssl - reference: https://wiki.openssl.org/index.php/Simple_TLS_Server
+// Write all of buf, on a blocking socket. Returns 0 or -1.
+static int write_all(int fd, const void *buf, size_t len) {
+  const char *p = buf;
+  ssize_t n;
 
-static void init_openssl() {
-  SSL_library_init();
-  OpenSSL_add_all_algorithms();
-  SSL_load_error_strings();
-} // openssl()
+  while (len) {
+    n = write(fd, p, len);
+    if (n == -1 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    p += n;
+    len -= n;
+  }
 
-static void cleanup_openssl() {
-  EVP_cleanup();
-} // cleanup_openssl()
+  return 0;
+} // write_all()
 
-static SSL_CTX *create_context() {
-  const SSL_METHOD *method;
-  SSL_CTX *ctx;
+// Read all of buf, on a blocking socket. Returns 0 or -1.
+static int read_all(int fd, void *buf, size_t len) {
+  char *p = buf;
+  ssize_t n;
 
-  method = SSLv23_server_method();
+  while (len) {
+    n = read(fd, p, len);
+    if (n == -1 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    p += n;
+    len -= n;
+  }
 
-  ctx = SSL_CTX_new(method);
-  if (!ctx) {
-    perror("Unable to create SSL context");
-    ERR_print_errors_fp(stderr);
-    exit(EXIT_FAILURE);
+  return 0;
+} // read_all()
+
+// Hand the server over to the new instance connecting on hfd. Only returns if it fails.
+static void handoff_serve(int hfd, int listenfd, int httpfd) {
+  const struct timespec poll1ms = {0, 1000000};
+  struct handoff_state *h = &handoff;
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+  char cbuf[CMSG_SPACE(2 * sizeof(int))];
+  struct iovec iov = { .iov_base = h, .iov_len = sizeof(*h) };
+  struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+  struct cmsghdr *cm;
+  struct pollfd pfd;
+  struct timespec now;
+  struct bus *b;
+  int fd, i, j, held[MAX_BUSES], fds[2], nfds = 0, nwords = 0, nkeys = 0;
+  ssize_t n;
+  char ack = 0;
+
+  fd = accept4(hfd, NULL, NULL, SOCK_CLOEXEC);
+  if (fd == -1) return;
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1 || cred.uid != 0) {
+    close(fd);
+    return;
   }
 
-  return ctx;
-} // *create_context()
+  // stop the keybus threads, so the fifos and the status hold still
+  __atomic_store_n(&pioParked, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&mioParked, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&handoffPark, 1, __ATOMIC_RELEASE);
+  for (i = 0; i < HANDOFF_WAIT; i++) {
+    if (__atomic_load_n(&pioParked, __ATOMIC_ACQUIRE) &&
+        __atomic_load_n(&mioParked, __ATOMIC_ACQUIRE)) break;
+    nanosleep(&poll1ms, NULL);
+  }
+  if (i == HANDOFF_WAIT) {
+    fprintf(stderr, "server: keybus threads did not stop, handoff refused\n");
+    goto resume;
+  }
 
-static void configure_context(SSL_CTX *ctx) {
-  //SSL_CTX_set_ecdh_auto(ctx, 1); // supported from openssl 1.0.2, using 1.0.1e
+  // panserv is the only thread left using the fifos, it may take both ends
+  h->magic = HANDOFF_MAGIC;
+  h->size = sizeof(*h);
+  h->parked = pioParkedAt;
+  h->epoch = statusEpoch;
+  h->nbuses = cfg.buses;
+  for (j = 0; j < cfg.buses; j++) {
+    b = &buses[j];
+    memcpy(h->bus[j].pins, cfg.pins[j], sizeof(h->bus[j].pins));
+    status_read(&b->status, &h->bus[j].status);
+    h->bus[j].status.obsTime = __atomic_load_n(&b->status.obsTime, __ATOMIC_RELAXED);
+    stats_read(b, &h->bus[j].stats);
+    for (i = 0; i < MAX_DATA &&
+         popElement1(b, h->bus[j].words[i], MAX_BITS, &h->bus[j].stamps[i]) == MAX_BITS; i++);
+    nwords += h->bus[j].nwords = i;
+    held[j] = memcmp(b->heldKey, IDLE, MAX_BITS) != 0; // a word to send again goes first
+    if (held[j]) memcpy(h->bus[j].keys[0], b->heldKey, MAX_BITS);
+    for (i = held[j]; i < MAX_DATA && popElement2(b, h->bus[j].keys[i], MAX_BITS) == MAX_BITS;
+         i++);
+    nkeys += h->bus[j].nkeys = i;
+  }
 
-  /*
-   * certs and key pairs generated by the steps below
-   *
-   * Step 1. Generate ca private key
-   * $ openssl genrsa -out /home/pi/certs/ca/ca.key 4096
-   * Step 2. Create self-signed ca cert, COMMON_NAME="My CA"
-   * $ openssl req -new -x509 -days 365 -key /home/pi/certs/ca/ca.key \
-   *           -out /home/pi/certs/ca/ca.crt -sha256
-   *
-   * Step 3. Create client private key
-   * $ openssl genrsa -out /home/pi/certs/client/client.key 2048
-   * Step 4. Create client cert signing request, COMMON_NAME="Client 1"
-   * $ openssl req -new -key /home/pi/certs/client/client.key \
-   *           -out /home/pi/certs/client/client.csr -sha256
-   * Step 5. Create signed client cert
-   * $ openssl x509 -req -days 365 -in /home/pi/certs/client/client.csr -CA /home/pi/certs/ca/ca.crt \
-   *           -CAkey /home/pi/certs/ca/ca.key -set_serial 01 \
-   *           -out /home/pi/certs/client/client.crt -sha256
-   *
-   * Step 6. Create server private key
-   * $ openssl genrsa -out /home/pi/certs/server/server.key 2048
-   * Step 7. Create server cert signing request, COMMON_NAME="localhost"
-   * $ openssl req -new -key /home/pi/certs/server/server.key \
-   *           -out /home/pi/certs/server/server.csr -sha256
-   * Step 8. Create signed server cert, where "key.ext" contains "subjectAltName = IP:xxx.xxx.xxx.xxx"
-   * $ openssl x509 -req -days 365 -in /home/pi/certs/server/server.csr -CA /home/pi/certs/ca/ca.crt \
-   *           -CAkey /home/pi/certs/ca/ca.key -set_serial 02 \
-   *           -out /home/pi/certs/server/server.crt -sha256 -extfile /home/pi/certs/server/key.ext
-   *
-   * Step 9. Copy client key pair and CA certificate to Lambda
-   * $ cp /home/pi/certs/client/client.crt /home/pi/all/lambda
-   * $ cp /home/pi/certs/client/client.key /home/pi/all/lambda
-   * $ cp /home/pi/certs/ca/ca.crt /home/pi/all/lambda
-   */
+  fds[nfds++] = listenfd;
+  if (httpfd != -1) fds[nfds++] = httpfd;
+  msg.msg_control = cbuf;
+  msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+  cm = CMSG_FIRSTHDR(&msg);
+  cm->cmsg_level = SOL_SOCKET;
+  cm->cmsg_type = SCM_RIGHTS;
+  cm->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+  memcpy(CMSG_DATA(cm), fds, nfds * sizeof(int));
+
+  n = sendmsg(fd, &msg, 0);
+  if (n > 0 && !write_all(fd, (char *) h + n, sizeof(*h) - n)) {
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, HANDOFF_ACK) == 1 && read(fd, &ack, 1) == 1 && ack == 'K') {
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      fprintf(stdout, "server: handed over to pid %d, %d words and %d keypad words in flight, "
+              "%ld ms after leaving the keybus\n", (int) cred.pid, nwords, nkeys,
+              ts_diff(&now, &h->parked) / 1000000);
+      exit(EXIT_SUCCESS);
+    }
+  }
+  fprintf(stderr, "server: new instance did not confirm the handoff, carrying on\n");
+
+  // put the words back where they were, the held keypad words are still in their buses
+  for (j = 0; j < cfg.buses; j++) {
+    b = &buses[j];
+    for (i = 0; i < h->bus[j].nwords; i++)
+      pushElement1(b, h->bus[j].words[i], MAX_BITS, h->bus[j].stamps[i]);
+    for (i = held[j]; i < h->bus[j].nkeys; i++) pushElement2(b, h->bus[j].keys[i], MAX_BITS);
+  }
 
-  if (SSL_CTX_use_certificate_file(ctx, "/home/pi/certs/server/server.crt", SSL_FILETYPE_PEM) < 0) {
-    ERR_print_errors_fp(stderr);
-    exit(EXIT_FAILURE);
+resume:
+  __atomic_store_n(&handoffPark, 0, __ATOMIC_RELEASE);
+  close(fd);
+} // handoff_serve()
+
+/*
+ * Take over from the server running on port, see handoff_serve().
+ * The status of each bus and the words waiting in its fifos are loaded into the same bus,
+ *   and its listening sockets are kept for panserv(). It has stopped using the keybus when
+ *   this returns, and exits when takeover_done() is called.
+ * Returns the connection to it, or -1 if there is no server to take over from.
+ */
+static int takeover(int port) {
+  struct handoff_state *h = &handoff;
+  struct sockaddr_un addr;
+  socklen_t len = handoff_addr(&addr, port);
+  char cbuf[CMSG_SPACE(2 * sizeof(int))];
+  struct iovec iov = { .iov_base = h, .iov_len = sizeof(*h) };
+  struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = cbuf,
+                        .msg_controllen = sizeof(cbuf) };
+  struct cmsghdr *cm;
+  struct bus *b;
+  int fd, i, j, fds[2], nfds = 0;
+  ssize_t n;
+
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1 || connect(fd, (struct sockaddr *) &addr, len) == -1) {
+    fprintf(stderr, "takeover: no server running on port %d, starting anew\n", port);
+    if (fd != -1) close(fd);
+    return -1;
   }
 
-  if (SSL_CTX_use_PrivateKey_file(ctx, "/home/pi/certs/server/server.key", SSL_FILETYPE_PEM) < 0 ) {
-    ERR_print_errors_fp(stderr);
-    exit(EXIT_FAILURE);
+  n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+  cm = CMSG_FIRSTHDR(&msg);
+  if (cm && cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+    nfds = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    memcpy(fds, CMSG_DATA(cm), nfds * sizeof(int));
   }
+  if (n < (ssize_t) (2 * sizeof(uint32_t)) || h->magic != HANDOFF_MAGIC ||
+      h->size != sizeof(*h) || read_all(fd, (char *) h + n, sizeof(*h) - n) || nfds < 1) {
+    fprintf(stderr, "takeover: running server has another state layout, can't take over\n");
+    exit(EXIT_FAILURE); // closing the connection lets the running server carry on
+  }
+  for (j = 0; j < cfg.buses; j++)
+    if (h->nbuses != cfg.buses || memcmp(h->bus[j].pins, cfg.pins[j], sizeof(cfg.pins[j]))) {
+      fprintf(stderr, "takeover: running server uses other keybus pins, can't take over\n");
+      exit(EXIT_FAILURE);
+    }
 
-  // check if the certificate and private key match
-  if (SSL_CTX_check_private_key(ctx) != 1) {
-    fprintf(stderr, "Private key does not match the certificate public key\n");
-    exit(EXIT_FAILURE);
+  statusEpoch = h->epoch;
+  takenListenFd = fds[0];
+  if (nfds > 1) {
+    if (cfg.httpPort)
+      takenHttpFd = fds[1];
+    else
+      close(fds[1]);
+  }
+  for (j = 0; j < cfg.buses; j++) {
+    b = &buses[j];
+    memcpy(&b->status, &h->bus[j].status, sizeof(b->status));
+    memcpy(&b->stats, &h->bus[j].stats, sizeof(b->stats));
+    for (i = 0; i < h->bus[j].nwords; i++)
+      pushElement1(b, h->bus[j].words[i], MAX_BITS, h->bus[j].stamps[i]);
+    for (i = 0; i < h->bus[j].nkeys; i++) pushElement2(b, h->bus[j].keys[i], MAX_BITS);
   }
 
-  // SSL_VERIFY_PEER is set so server sends a client certificate request.
-  SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+  return fd;
+} // takeover()
 
-  // set the list of trusted CAs
-  if (SSL_CTX_load_verify_locations(ctx, "/home/pi/certs/ca/ca.crt", "/home/pi/certs/ca") < 1) {
-    fprintf(stderr, "Error setting the verify locations.\n");
-    exit(EXIT_FAILURE);
+/*
+ * Tell systemd pid is the service's main process, for the takeover started by its
+ *   ExecReload, see kprw-server.service. Needs NotifyAccess=all.
+ * Then waits up to NOTIFY_WAIT ms for systemd to have processed it: it closes the pipe
+ *   sent with BARRIER=1 once it has read every earlier message (older versions close the
+ *   unexpected fd the same way).
+ */
+static void notify_mainpid(pid_t pid) {
+  const char *path = getenv("NOTIFY_SOCKET");
+  const char barrier[] = "BARRIER=1\n";
+  char cbuf[CMSG_SPACE(sizeof(int))];
+  struct sockaddr_un addr;
+  struct msghdr msg;
+  struct cmsghdr *cm;
+  struct iovec iov;
+  struct pollfd pfd;
+  socklen_t alen;
+  char buf[32];
+  int fd, len, p[2];
+
+  if (path == NULL || (*path != '/' && *path != '@') || strlen(path) >= sizeof(addr.sun_path))
+    return;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  if (*path == '@') addr.sun_path[0] = '\0'; // abstract namespace
+  alen = offsetof(struct sockaddr_un, sun_path) + strlen(path);
+
+  fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (fd == -1) return;
+  len = snprintf(buf, sizeof(buf), "MAINPID=%d\n", (int) pid);
+  if (sendto(fd, buf, len, 0, (struct sockaddr *) &addr, alen) == -1 || pipe2(p, O_CLOEXEC)) {
+    close(fd);
+    return;
   }
-} // configure_context()
 
-static void panserv(struct status * pstat, int port) {
-  char buffer[BUF_LEN]="", wordk[MAX_BITS] = "";
-  char txBuf[1024];
-  char addrStr[ADDRSTRLEN];
-  char host[NI_MAXHOST];
-  char service[NI_MAXSERV];
-  const char *jsonFmt = "{\"obsTime\":%lu,"
-                        "\"zoneAct\":["
-                        "%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,"
-                        "%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu],"
-                        "\"zoneDeAct\":["
-                        "%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,"
-                        "%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu],"
-                        "\"numOcc\":%i,"
-                        "\"lastTruePred\":["
-                        "\"%s\",\"%s\",\"%s\",\"%s\",\"%s\",\"%s\",\"%s\",\"%s\",\"%s\",\"%s\"]}\n";
-  int listenfd= 0, connfd = 0, res, num, i, sendJSON = 0;
-  long chkbuf;
-  socklen_t addrlen;
-  struct sockaddr_in client_addr;
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = (void *) barrier;
+  iov.iov_len = sizeof(barrier) - 1;
+  msg.msg_name = &addr;
+  msg.msg_namelen = alen;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cbuf;
+  msg.msg_controllen = sizeof(cbuf);
+  cm = CMSG_FIRSTHDR(&msg);
+  cm->cmsg_level = SOL_SOCKET;
+  cm->cmsg_type = SCM_RIGHTS;
+  cm->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cm), &p[1], sizeof(int));
+  len = sendmsg(fd, &msg, 0);
+  close(p[1]); // only systemd's copy is left open
+  if (len > 0) {
+    pfd.fd = p[0];
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, NOTIFY_WAIT) != 1)
+      fprintf(stderr, "server: systemd did not confirm MAINPID=%d in time\n", (int) pid);
+  }
+  close(p[0]);
+  close(fd);
+} // notify_mainpid()
+
+/*
+ * Let the server taken over from exit, the keybus is this server's from now on.
+ * systemd is told this process is the main one first. The old server exits on the ack,
+ *   and if systemd saw that exit before the switch it would take it for the service's,
+ *   stop the unit with this process in it and restart it.
+ * Returns -1 if the ack could not be sent, the old server then carries on (or already
+ *   did, having given up waiting) as the main process and this one must not touch the keybus.
+ */
+static int takeover_done(int fd) {
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+  int res, err;
+
+  notify_mainpid(getpid());
+  res = (write(fd, "K", 1) == 1) ? 0 : -1;
+  err = errno;
+  if (res && getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0)
+    notify_mainpid(cred.pid); // give it back
+  close(fd);
+  errno = err; // for the caller's perror()
+
+  return res;
+} // takeover_done()
+
+/*
+ * Server running in the main thread.
+ * Clients are served from a single poll() loop over non-blocking sockets.
+ *
+ * Legacy clients send one text command such as "sendJSON\n" or "1234\n", receive the
+ *   reply and are disconnected, as in earlier versions of the server.
+ * Clients that start with a frame keep the connection open and may pipeline requests.
+ *   Every frame has an 8 byte header: FRAME_MAGIC, frame type, 16-bit payload length
+ *   and 32-bit request id, both big-endian. A FRAME_REQ payload is a text command,
+ *   the FRAME_REPLY (or FRAME_ERROR) frame answering it carries the same request id.
+ * Subscribers receive FRAME_PUSH frames with the id of their subscribe request.
+ * With --http the same loop also serves a plain http listener on localhost, see http_service().
+ * A new instance can take the server over through the handoff socket, see handoff_serve().
+ */
+static void panserv(int port) {
+  struct pollfd pfd[MAX_CLIENTS + HTTP_CLIENTS + 3];
+  int slot[MAX_CLIENTS + HTTP_CLIENTS + 3];
+  int listenfd= 0, httpfd = -1, hfd, res, i, nfds, ncl, timeout, nsubs = 0;
+  time_t now, aclCheck = 0;
+  pthread_t logger;
+  pthread_attr_t attr;
+  struct sched_param param;
+  struct client *c;
   SSL_CTX *ctx;
-  SSL *ssl;
 
   init_openssl();
   ctx = create_context();
   configure_context(ctx);
 
-  listenfd = create_socket(port);
-
-  signal(SIGPIPE, SIG_IGN); // receive EPIPE from a failed write()
+  listenfd = (takenListenFd != -1) ? takenListenFd : create_socket(INADDR_ANY, port);
+  if (fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK) == -1) {
+    perror("server: fcntl failed\n");
+    exit(EXIT_FAILURE);
+  }
 
-  for (;;) {
-    i = 0;
-    memset(&client_addr, 0, sizeof(client_addr));
-    addrlen = sizeof(struct sockaddr_storage);
+  for (i = 0; i < MAX_CLIENTS; i++) clients[i].fd = -1;
 
-    connfd = accept(listenfd, (struct sockaddr *) &client_addr, &addrlen);
-    if (connfd == -1) {
-      perror("server: accept failed\n");
-      continue;
+  for (i = 0; i < HTTP_CLIENTS; i++) httpConns[i].fd = -1;
+  if (cfg.httpPort) { // plain http, so local scrapers only
+    httpfd = (takenHttpFd != -1) ? takenHttpFd : create_socket(INADDR_LOOPBACK, cfg.httpPort);
+    if (fcntl(httpfd, F_SETFL, fcntl(httpfd, F_GETFL) | O_NONBLOCK) == -1) {
+      perror("server: fcntl failed\n");
+      exit(EXIT_FAILURE);
     }
+  }
 
-    if (!getnameinfo ((struct sockaddr *) &client_addr, addrlen,
-        host, NI_MAXHOST, service, NI_MAXSERV, 0))
-      snprintf(addrStr, ADDRSTRLEN, "(%s, %s)", host, service);
-    else
-      snprintf(addrStr, ADDRSTRLEN, "(?UNKNOWN?)");
+  acl_reload(&acl);
+  hfd = handoff_listen(port);
+
+  // host names are only resolved for logging, by a thread of its own at normal priority
+  sem_init(&hostLog.sem, 0, 0);
+  pthread_attr_init(&attr);
+  pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+  pthread_attr_setschedpolicy(&attr, SCHED_OTHER);
+  param.sched_priority = 0;
+  pthread_attr_setschedparam(&attr, &param);
+  pthread_attr_setstacksize(&attr, PTHREAD_STACK_MIN + MY_STACK_SIZE);
+  res = pthread_create(&logger, &attr, host_logger, NULL);
+  if (res) {
+    perror("Host logger thread creation failed\n");
+    exit(EXIT_FAILURE);
+  }
+  pthread_detach(logger);
+  pthread_attr_destroy(&attr);
 
-    #ifdef VERBOSE
-    fprintf(stdout, "server: connection requested from %s\n", addrStr);
-    #endif
+  signal(SIGPIPE, SIG_IGN); // receive EPIPE from a failed write()
 
-    if (!hosts_ctl("kprw-server", STRING_UNKNOWN, host, STRING_UNKNOWN)) {
-      fprintf(stderr, "Client %s connection disallowed\n", inet_ntoa(client_addr.sin_addr));
-      close(connfd);
-      continue;
+  for (;;) {
+    pfd[0].fd = listenfd;
+    pfd[0].events = POLLIN;
+    nfds = 1;
+    for (i = 0; i < MAX_CLIENTS; i++) {
+      c = &clients[i];
+      if (c->fd == -1) continue;
+      pfd[nfds].fd = c->fd;
+      pfd[nfds].events = 0;
+      if (c->rxLen < RX_BUF_LEN && c->state != CL_CLOSING) pfd[nfds].events |= POLLIN;
+      if (c->wantWrite || c->txOff < c->txLen) pfd[nfds].events |= POLLOUT;
+      if (c->state == CL_HANDSHAKE && !c->wantWrite) pfd[nfds].events |= POLLIN;
+      slot[nfds++] = i;
     }
-
-    ssl = SSL_new(ctx);
-    SSL_set_fd(ssl, connfd);
-
-    if (SSL_accept(ssl) <= 0) {
-      ERR_print_errors_fp(stderr);
-      SSL_free(ssl);
-      close(connfd);
-      continue;
+    ncl = nfds;
+    if (httpfd != -1) {
+      pfd[nfds].fd = httpfd;
+      pfd[nfds++].events = POLLIN;
+      for (i = 0; i < HTTP_CLIENTS; i++) {
+        if (httpConns[i].fd == -1) continue;
+        pfd[nfds].fd = httpConns[i].fd;
+        pfd[nfds].events = httpConns[i].outLen ? POLLOUT : POLLIN;
+        slot[nfds++] = i;
+      }
+    }
+    if (hfd != -1) {
+      pfd[nfds].fd = hfd;
+      pfd[nfds++].events = POLLIN;
     }
 
-    #ifdef VERBOSE
-    fprintf(stdout, "server: client %s connected with %s encryption\n",
-            inet_ntoa(client_addr.sin_addr), SSL_get_cipher(ssl));
-    #endif
-
-    memset(&buffer, 0, BUF_LEN);
-    res = SSL_read(ssl, buffer, (BUF_LEN-1)); // read command from socket
-    if (res <= 0) {
-      ERR_print_errors_fp(stderr);
-      SSL_free(ssl);
-      close(connfd);
+    res = poll(pfd, nfds, nsubs ? cfg.pushInterval : POLL_PERIOD);
+    if (res == -1) {
+      if (errno != EINTR) perror("server: poll failed\n");
       continue;
     }
 
-    #ifdef VERBOSE
-    fprintf(stdout, "server: panel received command %s", buffer);
-    #endif
-
-    /*
-     * Decode and process a command sent from client.
-     * Check for bad commands.
-     * Map to keypad data and send to panel.
-     *
-     * todo: this should be a function
-     */
-    // process commands
-    if (!isdigit(buffer[i])) { // not a number, but a command
-      if (!strncmp(buffer, "star", 4))
-        memcpy(wordk, STAR, MAX_BITS);
-      else if (!strncmp(buffer, "pound", 5))
-        memcpy(wordk, POUND, MAX_BITS);
-      else if (!strncmp(buffer, "stay", 4))
-        memcpy(wordk, STAY, MAX_BITS);
-      else if (!strncmp(buffer, "away", 4))
-        memcpy(wordk, AWAY, MAX_BITS);
-      else if (!strncmp(buffer, "idle", 4))
-        memcpy(wordk, IDLE, MAX_BITS);
-      else if (!strncmp(buffer, "sendJSON", 8)) {
-        memcpy(wordk, IDLE, MAX_BITS);
-        sendJSON = 1;
-      } else {
-        fprintf(stderr, "server: invalid panel command\n");
-        memcpy(wordk, IDLE, MAX_BITS);
-      }
-      // send keypad data to panel
-      res = pushElement2(wordk, MAX_BITS);
-      if (res != MAX_BITS) {
-        fprintf(stderr, "server: fifo write error\n");
-        break;
-      }
-    } else { // a number or number(s)
-      chkbuf = strtol(buffer, NULL, 10);
-      if (chkbuf < 0 || chkbuf > 9999) {
-        fprintf(stderr, "server: invalid panel command\n");
+    for (i = 1; i < ncl; i++) {
+      if (!pfd[i].revents) continue;
+      c = &clients[slot[i]];
+      if ((pfd[i].revents & (POLLERR | POLLNVAL)) && !(pfd[i].revents & POLLIN)) {
+        client_close(c);
         continue;
       }
-      while(buffer[i] != '\n') {
-        num = buffer[i] - '0';
-        switch (num) {
-          case 0 :
-            memcpy(wordk, ZERO, MAX_BITS);
-            break;
-          case 1 :
-            memcpy(wordk, ONE, MAX_BITS);
-            break;
-          case 2 :
-            memcpy(wordk, TWO, MAX_BITS);
-            break;
-          case 3 :
-            memcpy(wordk, THREE, MAX_BITS);
-            break;
-          case 4 :
-            memcpy(wordk, FOUR, MAX_BITS);
-            break;
-          case 5 :
-            memcpy(wordk, FIVE, MAX_BITS);
-            break;
-          case 6 :
-            memcpy(wordk, SIX, MAX_BITS);
-            break;
-          case 7 :
-            memcpy(wordk, SEVEN, MAX_BITS);
-            break;
-          case 8 :
-            memcpy(wordk, EIGHT, MAX_BITS);
-            break;
-          case 9 :
-            memcpy(wordk, NINE, MAX_BITS);
-            break;
-          default :
-            fprintf(stderr, "server: invalid panel command\n");
-            memcpy(wordk, IDLE, MAX_BITS);
-        }
-        // send keypad data to panel
-        res = pushElement2(wordk, MAX_BITS);
-        if (res != MAX_BITS) {
-          fprintf(stderr, "server: fifo write error\n");
-          break;
-        }
-        i++;
-        if (i > 4) { // max 4-digit number allowed
-          fprintf(stderr, "server: invalid panel command\n");
-          continue;
-        }
-      }
+      client_service(c);
     }
 
-    // send back zone and system status, either as JSON or text
-    if (sendJSON) { // send zone data as JSON
-      snprintf(txBuf, sizeof(txBuf), jsonFmt,
-               pstat->obsTime,
-               pstat->zoneAct[0],  pstat->zoneAct[1],  pstat->zoneAct[2],  pstat->zoneAct[3],
-               pstat->zoneAct[4],  pstat->zoneAct[5],  pstat->zoneAct[6],  pstat->zoneAct[7],
-               pstat->zoneAct[8],  pstat->zoneAct[9],  pstat->zoneAct[10], pstat->zoneAct[11],
-               pstat->zoneAct[12], pstat->zoneAct[13], pstat->zoneAct[14], pstat->zoneAct[15],
-               pstat->zoneAct[16], pstat->zoneAct[17], pstat->zoneAct[18], pstat->zoneAct[19],
-               pstat->zoneAct[20], pstat->zoneAct[21], pstat->zoneAct[22], pstat->zoneAct[23],
-               pstat->zoneAct[24], pstat->zoneAct[25], pstat->zoneAct[26], pstat->zoneAct[27],
-               pstat->zoneAct[28], pstat->zoneAct[29], pstat->zoneAct[30], pstat->zoneAct[31],
-               pstat->zoneDeAct[0],  pstat->zoneDeAct[1],  pstat->zoneDeAct[2],  pstat->zoneDeAct[3],
-               pstat->zoneDeAct[4],  pstat->zoneDeAct[5],  pstat->zoneDeAct[6],  pstat->zoneDeAct[7],
-               pstat->zoneDeAct[8],  pstat->zoneDeAct[9],  pstat->zoneDeAct[10], pstat->zoneDeAct[11],
-               pstat->zoneDeAct[12], pstat->zoneDeAct[13], pstat->zoneDeAct[14], pstat->zoneDeAct[15],
-               pstat->zoneDeAct[16], pstat->zoneDeAct[17], pstat->zoneDeAct[18], pstat->zoneDeAct[19],
-               pstat->zoneDeAct[20], pstat->zoneDeAct[21], pstat->zoneDeAct[22], pstat->zoneDeAct[23],
-               pstat->zoneDeAct[24], pstat->zoneDeAct[25], pstat->zoneDeAct[26], pstat->zoneDeAct[27],
-               pstat->zoneDeAct[28], pstat->zoneDeAct[29], pstat->zoneDeAct[30], pstat->zoneDeAct[31],
-               pstat->numOcc,
-               pstat->lastTruePred[0],pstat->lastTruePred[1],pstat->lastTruePred[2],pstat->lastTruePred[3],
-               pstat->lastTruePred[4],pstat->lastTruePred[5],pstat->lastTruePred[6],pstat->lastTruePred[7],
-               pstat->lastTruePred[8],pstat->lastTruePred[9]);
-
-      res = SSL_write(ssl, txBuf, strlen(txBuf)); // write json to socket
-      if (res <= 0) {
-        ERR_print_errors_fp(stderr);
-        SSL_free(ssl);
-        close(connfd);
-        continue;
-      }
-
-      sendJSON = 0;
-    } else { // send zone data as text, this is the default format
-      snprintf(txBuf, sizeof(txBuf), "%s, %s, %s, %s, %s,",
-               pstat->ledStatus, pstat->zone1Status, pstat->zone2Status,
-               pstat->zone3Status, pstat->zone4Status);
+    if (pfd[0].revents & POLLIN) accept_clients(listenfd, ctx);
 
-      res = SSL_write(ssl, txBuf, strlen(txBuf)); // write status to socket
-      if (res <= 0) {
-        ERR_print_errors_fp(stderr);
-        SSL_free(ssl);
-        close(connfd);
-        continue;
-      }
+    if (httpfd != -1) {
+      for (i = ncl + 1; i < nfds; i++)
+        if (pfd[i].revents) http_service(&httpConns[slot[i]]);
+      if (pfd[ncl].revents & POLLIN) http_accept(httpfd);
     }
 
-    SSL_free(ssl);
-    res = close(connfd);
-    if (res == -1) {
-      perror("server: error closing connection");
-      continue;
-    }
+    if (hfd != -1 && (pfd[nfds - 1].revents & POLLIN)) handoff_serve(hfd, listenfd, httpfd);
+
+    nsubs = push_status();
 
+    // drop connections that stalled in the handshake or have been idle too long
+    now = mono_sec();
+    if (now != aclCheck) { // pick up edits to the access rules, at most once a second
+      acl_reload(&acl);
+      if (hfd == -1) hfd = handoff_listen(port);
+      aclCheck = now;
+    }
+    for (i = 0; i < MAX_CLIENTS; i++) {
+      c = &clients[i];
+      if (c->fd == -1 || c->subscribed) continue;
+      timeout = (c->mode == CL_FRAMED) ? IDLE_TIMEOUT : HANDSHAKE_TIMEOUT;
+      if (now - c->lastActive > timeout) client_close(c);
+    }
+    for (i = 0; i < HTTP_CLIENTS; i++)
+      if (httpConns[i].fd != -1 && now - httpConns[i].opened > HANDSHAKE_TIMEOUT)
+        http_close(&httpConns[i]);
   }
 
+  for (i = 0; i < MAX_CLIENTS; i++)
+    if (clients[i].fd != -1) client_close(&clients[i]);
   close(listenfd);
+  if (httpfd != -1) close(httpfd);
+  if (hfd != -1) close(hfd);
   SSL_CTX_free(ctx);
   cleanup_openssl();
 
   return;
 } // panserv
 
+// kprw-bench.c builds the server without main() to time its hot paths
+#ifndef KPRW_NO_MAIN
+
+static const struct option long_opts[] = {
+  {"ktls", no_argument, NULL, 'k'},
+  {"push-interval", required_argument, NULL, 'i'},
+  {"key-rate", required_argument, NULL, 'r'},
+  {"key-burst", required_argument, NULL, 'b'},
+  {"key-global-rate", required_argument, NULL, 'g'},
+  {"key-queue", required_argument, NULL, 'q'},
+  {"http", required_argument, NULL, 'h'},
+  {"trace", required_argument, NULL, 't'},
+  {"rlog", required_argument, NULL, 'l'},
+  {"rlog-json", no_argument, NULL, 'j'},
+  {"rlog-max", required_argument, NULL, 'm'},
+  {"rlog-keep", required_argument, NULL, 'n'},
+  {"deadline", no_argument, NULL, 'd'},
+  {"spin-guard", required_argument, NULL, 's'},
+  {"takeover", no_argument, NULL, 'u'},
+  {"bus", required_argument, NULL, 'p'},
+  {"replay", required_argument, NULL, 'v'},
+  {"rules", required_argument, NULL, 'e'},
+  {NULL, 0, NULL, 0}
+};
+
+static void usage(const char *prog) {
+  fprintf(stderr, "usage: %s [options] port<49152–65535>\n"
+                  "  -k, --ktls              use kernel TLS offload after the handshake\n"
+                  "  -i, --push-interval MS  min time between status pushes to a subscriber\n"
+                  "  -r, --key-rate N        key presses per second allowed from one client\n"
+                  "  -b, --key-burst N       key presses one client may send at once (min 4)\n"
+                  "  -g, --key-global-rate N key presses per second allowed from all clients\n"
+                  "  -q, --key-queue N       max keypad words waiting for the panel (min 4)\n"
+                  "  -h, --http PORT         serve /status, /stats and /metrics over http on localhost\n"
+                  "  -t, --trace FILE        append trace events to FILE\n"
+                  "  -l, --rlog FILE         log the output of every Rscript run to FILE\n"
+                  "  -j, --rlog-json         log a JSON record per run instead of the raw output\n"
+                  "  -m, --rlog-max BYTES    R log size that triggers a rotation (default 1 MB)\n"
+                  "  -n, --rlog-keep N       compressed R log segments kept (default 4)\n"
+                  "  -d, --deadline          run panel_io and msg_io under SCHED_DEADLINE\n"
+                  "  -s, --spin-guard US     spin the last US (1-100) before each keybus sample\n"
+                  "  -u, --takeover          take over from a server running on the same port\n"
+                  "  -p, --bus C,DI,DO       serve a keybus on these gpio pins, up to 4 times\n"
+                  "  -v, --replay FILE       replay keybus words from FILE on a virtual clock\n"
+                  "  -e, --rules FILE        zones and actions for predict, reloaded on change\n",
+          prog);
+  exit(EXIT_FAILURE);
+} // usage()
+
+/*
+ * Read the pins of keybus n given as CLOCK,DATA_IN,DATA_OUT into cfg.pins[n].
+ * Returns 0, or -1 if they are not gpio pins or one is already in use.
+ */
+static int bus_pins(const char *arg, int n) {
+  int *pins = cfg.pins[n];
+  char extra;
+  int i, j;
+
+  if (sscanf(arg, "%d,%d,%d%c", &pins[0], &pins[1], &pins[2], &extra) != 3) return -1;
+  for (i = 0; i < 3; i++) {
+    if (pins[i] < 0 || pins[i] > PI_GPIO_MAX) return -1;
+    for (j = 0; j < 3 * n + i; j++)
+      if (cfg.pins[j / 3][j % 3] == pins[i]) return -1;
+  }
+
+  return 0;
+} // bus_pins()
+
 int main(int argc, char *argv[])
 {
-  int res, crit1, crit2, flag, i, port;
-  struct sched_param param_main, param_pio, param_predict;
+  int res, crit1, crit2, flag, i, j, opt, nbuses = 0;
+  struct sched_param param_main, param_pio, param_predict, param_trace;
   struct utsname u;
-  struct status pstat;
-  pthread_t pio_thread, mio_thread, main_thread, predict_thread;
+  struct bus *b;
+  pthread_t pio_thread, mio_thread, main_thread, predict_thread, trace_thread, rlog_thread;
   pthread_attr_t my_attr;
   cpu_set_t cpuset_mio, cpuset_pio, cpuset_main;
   FILE *fd;
+  long rssKb, lckKb;
+  int handoffFd = -1;
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &startTime);
+  clock_gettime(CLOCK_REALTIME, &now);
+  statusEpoch = (unsigned long long) now.tv_sec * 1000000 + now.tv_nsec / 1000;
 
   // Check if user is running program as root. If not, exit.
   if(geteuid() != 0) {
@@ -1426,12 +5245,89 @@ int main(int argc, char *argv[])
   }
 
   // Check program args and get server port number.
-  if (argc != 2) {
-    fprintf(stderr, "usage: %s port<49152–65535>\n", argv[0]);
+  while ((opt = getopt_long(argc, argv, "ki:r:b:g:q:h:t:l:jm:n:ds:up:v:e:", long_opts, NULL)) != -1) {
+    switch (opt) {
+      case 'k':
+        cfg.ktls = 1;
+        break;
+      case 'd':
+        cfg.deadline = 1;
+        break;
+      case 'u':
+        cfg.takeover = 1;
+        break;
+      case 'p': // the first replaces the default bus
+        if (nbuses == MAX_BUSES || bus_pins(optarg, nbuses)) usage(argv[0]);
+        cfg.buses = ++nbuses;
+        break;
+      case 'v':
+        cfg.replayFile = optarg;
+        break;
+      case 'e':
+        cfg.rulesFile = optarg;
+        break;
+      case 'i':
+        cfg.pushInterval = strtol(optarg, NULL, 10);
+        if (cfg.pushInterval < 1) usage(argv[0]);
+        break;
+      case 'r':
+        cfg.keyRate = strtol(optarg, NULL, 10);
+        if (cfg.keyRate < 1) usage(argv[0]);
+        break;
+      case 'b': // a whole 4-digit code must fit in a burst
+        cfg.keyBurst = strtol(optarg, NULL, 10);
+        if (cfg.keyBurst < KEY_MAX) usage(argv[0]);
+        break;
+      case 'g':
+        cfg.keyGlobalRate = strtol(optarg, NULL, 10);
+        if (cfg.keyGlobalRate < 1) usage(argv[0]);
+        break;
+      case 'q':
+        cfg.keyQueue = strtol(optarg, NULL, 10);
+        if (cfg.keyQueue < KEY_MAX || cfg.keyQueue >= MAX_DATA) usage(argv[0]);
+        break;
+      case 'h':
+        cfg.httpPort = strtol(optarg, NULL, 10);
+        if (cfg.httpPort < 1 || cfg.httpPort > 65535) usage(argv[0]);
+        break;
+      case 't':
+        cfg.traceFile = optarg;
+        break;
+      case 'l':
+        cfg.rlogFile = optarg;
+        break;
+      case 'j':
+        cfg.rlogJson = 1;
+        break;
+      case 'm':
+        cfg.rlogMax = strtol(optarg, NULL, 10);
+        if (cfg.rlogMax < RLOG_BATCH) usage(argv[0]);
+        break;
+      case 'n':
+        cfg.rlogKeep = strtol(optarg, NULL, 10);
+        if (cfg.rlogKeep < 1) usage(argv[0]);
+        break;
+      case 's':
+        cfg.spinGuard = strtol(optarg, NULL, 10) * 1000;
+        if (cfg.spinGuard < 1000 || cfg.spinGuard > SPIN_GUARD_MAX) usage(argv[0]);
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (cfg.deadline && cfg.spinGuard) { // a spin would use up panel_io's deadline runtime
+    fprintf(stderr, "--spin-guard can't be used with --deadline\n");
+    exit(EXIT_FAILURE);
+  }
+  if (cfg.replayFile && (cfg.deadline || cfg.takeover)) { // no keybus to share or hand over
+    fprintf(stderr, "--replay can't be used with --deadline or --takeover\n");
     exit(EXIT_FAILURE);
+  }
+  if (argc - optind != 1) {
+    usage(argv[0]);
   } else {
-    port = strtol(argv[1], NULL, 10);
-    if (port < 49152 || port > 65535) {
+    cfg.port = strtol(argv[optind], NULL, 10);
+    if (cfg.port < 49152 || cfg.port > 65535) {
       fprintf(stderr, "Port number must be in the range of 49152 to 65535\n");
       exit(EXIT_FAILURE);
     }
@@ -1444,7 +5340,7 @@ int main(int argc, char *argv[])
     crit2 = ((fscanf(fd, "%d", &flag) == 1) && (flag == 1));
     fclose(fd);
   }
-  if (!(crit1 && crit2)) {
+  if (!(crit1 && crit2) && !cfg.replayFile) {
     fprintf(stderr, "Can't run under a vanilla kernel. Must be patched with PREEMPT RT.\n");
     exit(EXIT_FAILURE);
   }
@@ -1489,8 +5385,9 @@ int main(int argc, char *argv[])
   // Turn off mmap usage.
   mallopt(M_MMAP_MAX, 0);
 
-  // Pre-fault our stack
-  reserve_process_memory(MAX_SAFE_STACK);
+  // Pre-fault the heap and the stack panserv will use
+  reserve_process_memory(heap_size());
+  prefault_stack();
 
   #ifdef TESTRT
   // display page fault status after pre-fault
@@ -1499,37 +5396,102 @@ int main(int argc, char *argv[])
 
   // Now allocate the memory for the 2nd time
   // number of pagefaults should be zero
-  reserve_process_memory(MAX_SAFE_STACK);
+  reserve_process_memory(heap_size());
   show_new_pagefault_count("2nd malloc() and use generated", "0", "0");
 
   // test that threads are safe
   prove_thread_stack_use_is_safe(100*1024);
   #endif
 
-  // Set up gpio pointer for direct register access
-  setup_io();
+  // Set up gpio pointer for direct register access, or the clock for a replay without it
+  if (cfg.replayFile)
+    clk_virtual();
+  else
+    setup_io();
+
+  // Set up the buses, each with empty FIFOs and panel status indicators
+  for (i = 0; i < cfg.buses; i++) {
+    b = &buses[i];
+    memset(b, 0, sizeof(*b));
+    b->id = i;
+    b->clockIn = cfg.pins[i][0];
+    b->dataIn = cfg.pins[i][1];
+    b->dataOut = cfg.pins[i][2];
+    for (j = 0; j < MAX_DATA; j++) {
+      b->m_Data1[j] = '0';
+      b->m_Data2[j] = '0';
+    }
+  }
+
+  // or carry on from the running server, which stops using the keybus here
+  if (cfg.takeover) handoffFd = takeover(cfg.port);
 
-  // Set up FIFOs
-  m_Read1 = 0;
-  m_Read2 = 0;
-  m_Write1 = 0;
-  m_Write2 = 0;
-  for (i = 0; i < MAX_DATA; i++) {
-    m_Data1[i] = '0';
-    m_Data2[i] = '0';
+  // publish the status of the first bus for local readers
+  shm_init(&buses[0].status);
+
+  // create trace drainer thread, at normal priority since it does all the stdio for the others
+  sem_init(&traceWake, 0, 0);
+  pthread_attr_init(&my_attr);
+  pthread_attr_setinheritsched(&my_attr, PTHREAD_EXPLICIT_SCHED);
+  pthread_attr_setaffinity_np(&my_attr, sizeof(cpuset_mio), &cpuset_mio);
+  pthread_attr_setschedpolicy(&my_attr, SCHED_OTHER);
+  param_trace.sched_priority = 0;
+  pthread_attr_setschedparam(&my_attr, &param_trace);
+  pthread_attr_setstacksize(&my_attr, PTHREAD_STACK_MIN + MY_STACK_SIZE);
+  res = pthread_create(&trace_thread, &my_attr, trace_drainer, NULL);
+  if (res) {
+    perror("Trace drainer thread creation failed\n");
+    exit(EXIT_FAILURE);
   }
+  pthread_detach(trace_thread);
+  pthread_attr_destroy(&my_attr);
 
-  // init panel status indicators
-  memset(&pstat, 0, sizeof(pstat));
+  // create R log writer thread, also at normal priority so file i/o never holds up predict
+  if (cfg.rlogFile) {
+    sem_init(&rlog.sem, 0, 0);
+    pthread_attr_init(&my_attr);
+    pthread_attr_setinheritsched(&my_attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setaffinity_np(&my_attr, sizeof(cpuset_mio), &cpuset_mio);
+    pthread_attr_setschedpolicy(&my_attr, SCHED_OTHER);
+    pthread_attr_setschedparam(&my_attr, &param_trace);
+    pthread_attr_setstacksize(&my_attr, PTHREAD_STACK_MIN + MY_STACK_SIZE);
+    res = pthread_create(&rlog_thread, &my_attr, rlog_writer, NULL);
+    if (res) {
+      perror("R log writer thread creation failed\n");
+      exit(EXIT_FAILURE);
+    }
+    pthread_detach(rlog_thread);
+    pthread_attr_destroy(&my_attr);
+  }
 
-  // Set pin direction
-  INP_GPIO(PI_DATA_OUT); // must use INP_GPIO before we can use OUT_GPIO
-  OUT_GPIO(PI_DATA_OUT);
-  INP_GPIO(PI_DATA_IN);
-  INP_GPIO(PI_CLOCK_IN);
+  // dump the trace on request and when the server crashes
+  signal(SIGUSR1, trace_sigusr1);
+  signal(SIGSEGV, trace_fault);
+  signal(SIGBUS, trace_fault);
+  signal(SIGILL, trace_fault);
+  signal(SIGFPE, trace_fault);
+  signal(SIGABRT, trace_fault);
+
+  // count deadline threads running over their runtime
+  if (cfg.deadline) signal(SIGXCPU, dl_overrun);
+
+  // the keybus is ours, let the server taken over from go
+  if (handoffFd != -1) {
+    if (takeover_done(handoffFd)) {
+      perror("takeover: can't confirm the handoff, leaving the keybus to the running server");
+      exit(EXIT_FAILURE);
+    }
+  }
 
-  // Set PI_DATA_OUT pin low.
-  GPIO_CLR = 1<<PI_DATA_OUT;
+  // Set pin direction and data out pins low
+  for (i = 0; i < cfg.buses && !cfg.replayFile; i++) {
+    b = &buses[i];
+    INP_GPIO(b->dataOut); // must use INP_GPIO before we can use OUT_GPIO
+    OUT_GPIO(b->dataOut);
+    INP_GPIO(b->dataIn);
+    INP_GPIO(b->clockIn);
+    GPIO_CLR = 1<<b->dataOut;
+  }
 
   // create panel input / output thread
   pthread_attr_init(&my_attr);
@@ -1544,12 +5506,17 @@ int main(int argc, char *argv[])
   }
   param_pio.sched_priority = PANEL_IO_PRI;
   pthread_attr_setschedparam(&my_attr, &param_pio);
-  res = pthread_create(&pio_thread, &my_attr, panel_io, NULL);
+  res = pthread_create(&pio_thread, &my_attr, cfg.replayFile ? replay_io : panel_io, NULL);
   if (res) {
     perror("Panel i/o thread creation failed\n");
     exit(EXIT_FAILURE);
   }
   pthread_attr_destroy(&my_attr);
+  if (handoffFd != -1) {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    fprintf(stdout, "kprw-server: took over, keybus unattended for %ld ms\n",
+            ts_diff(&now, &handoff.parked) / 1000000);
+  }
 
   // create message input / output thread
   pthread_attr_init(&my_attr);
@@ -1564,7 +5531,7 @@ int main(int argc, char *argv[])
   }
   param_pio.sched_priority = MSG_IO_PRI;
   pthread_attr_setschedparam(&my_attr, &param_pio);
-  res = pthread_create(&mio_thread, &my_attr, msg_io, (void *) &pstat);
+  res = pthread_create(&mio_thread, &my_attr, msg_io, NULL);
   if (res) {
     perror("Message i/o thread creation failed\n");
     exit(EXIT_FAILURE);
@@ -1584,15 +5551,20 @@ int main(int argc, char *argv[])
   }
   param_predict.sched_priority = PREDICT_PRI;
   pthread_attr_setschedparam(&my_attr, &param_predict);
-  res = pthread_create(&predict_thread, &my_attr, predict, (void *) &pstat);
+  res = pthread_create(&predict_thread, &my_attr, predict, (void *) &buses[0]);
   if (res) {
     perror("Predict thread creation failed\n");
     exit(EXIT_FAILURE);
   }
   pthread_attr_destroy(&my_attr);
 
+  // report what the server holds in memory once all threads are running
+  mem_usage(&rssKb, &lckKb);
+  fprintf(stdout, "kprw-server: %ld kB resident, %ld kB locked, %d kB heap reserved\n",
+          rssKb, lckKb, heap_size() / 1024);
+
   // start server
-  panserv(&pstat, port);
+  panserv(cfg.port);
 
   // cleanup - unlock memory
   if(munlockall() == -1) {
@@ -1601,4 +5573,6 @@ int main(int argc, char *argv[])
   }
 
   return(0);
-} // main
\ No newline at end of file
+} // main
+
+#endif // KPRW_NO_MAIN
@@ -0,0 +1,145 @@
+/*
+ *
+ * kprw-shm.h
+ *
+ * Layout of the status snapshot kprw-server publishes in POSIX shared memory, and a small
+ * reader for local processes that want the status without a TLS connection to the server.
+ *
+ * The server creates the segment KPRW_SHM_NAME (/dev/shm/kprw-status) at startup and rewrites
+ * it every time the status changes. The status is in three blocks (zone times, lights and
+ * predictions) that different server threads update, each under a sequence lock of its own.
+ * A reader maps the segment read-only with kprw_shm_open() and takes consistent copies with
+ * kprw_shm_read(), which makes no system calls, so a local read costs about as much as
+ * copying the snapshot.
+ *
+ * All fields are fixed-width so the layout is the same for every reader on the Pi.
+ * Anything that changes the layout must bump KPRW_SHM_LAYOUT.
+ *
+ * Copyright (c) 2016 - 2019 by Lindo St. Angel.
+ *
+ */
+
+#ifndef KPRW_SHM_H
+#define KPRW_SHM_H
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>		// Needed for O_RDONLY
+#include <sys/mman.h>		// Needed for shm_open() and mmap()
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define KPRW_SHM_NAME	"/kprw-status"
+#define KPRW_SHM_MAGIC	0x4b505257 // "KPRW"
+#define KPRW_SHM_LAYOUT	2    // version of struct kprw_shm
+#define KPRW_SHM_ZONES	32   // number of zones in system
+#define KPRW_SHM_PRED	10   // max number of predictions
+#define KPRW_SHM_STR	64   // led and zone status strings, incl '\0'
+#define KPRW_SHM_TS	24   // prediction timestamps, "2016-05-22T12:15:22Z" incl '\0'
+#define KPRW_SHM_TRIES	1000000 // attempts at a consistent copy before giving up
+
+// status blocks, each with its own sequence number
+#define KPRW_BLK_ZONE	0    // zoneAct, zoneDeAct
+#define KPRW_BLK_LED	1    // ledBits, ledStatus, zoneStatus
+#define KPRW_BLK_PRED	2    // numOcc, lastTruePredTime, lastTruePred
+#define KPRW_SHM_BLOCKS	3
+
+// panel status, sensor observations and predictions, see struct status in kprw-server.c
+struct kprw_status {
+  uint32_t version;                          // server status version, set by kprw_shm_read()
+  int32_t numOcc;                            // estimated number of occupants in house
+  uint32_t ledBits;                          // panel main led status lights as LED_ flags
+  uint32_t pad;
+  uint64_t zoneAct[KPRW_SHM_ZONES];          // zone sensor activation times, monotonic seconds
+  uint64_t zoneDeAct[KPRW_SHM_ZONES];        // zone sensor deactivation times, monotonic seconds
+  uint64_t lastTruePredTime[KPRW_SHM_PRED];  // time of last true predictions, seconds since epoch
+  char lastTruePred[KPRW_SHM_PRED][KPRW_SHM_TS]; // same as text
+  char ledStatus[KPRW_SHM_STR];              // panel main led status lights
+  char zoneStatus[4][KPRW_SHM_STR];          // panel zone 1 - 4 status lights
+};
+
+struct kprw_shm {
+  uint32_t magic;      // KPRW_SHM_MAGIC once the server has initialized the segment
+  uint32_t layout;     // KPRW_SHM_LAYOUT
+  uint32_t size;       // sizeof(struct kprw_shm)
+  uint32_t obsTime;    // zone sensor observation time, monotonic seconds, not covered by seq
+  uint32_t seq[KPRW_SHM_BLOCKS]; // per block, odd while the server is updating it
+  uint32_t pad;
+  struct kprw_status status;
+};
+
+/*
+ * Map the published status read-only.
+ * Returns NULL with errno set on failure, EPROTO if the segment has an unknown layout.
+ */
+static inline const struct kprw_shm * kprw_shm_open(const char *name) {
+  struct kprw_shm *m;
+  struct stat st;
+  int fd;
+
+  fd = shm_open(name ? name : KPRW_SHM_NAME, O_RDONLY, 0);
+  if (fd == -1) return NULL;
+  if (fstat(fd, &st) == -1 || st.st_size < (off_t) sizeof(*m)) {
+    close(fd);
+    errno = EPROTO;
+    return NULL;
+  }
+  m = mmap(NULL, sizeof(*m), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (m == MAP_FAILED) return NULL;
+
+  if (m->magic != KPRW_SHM_MAGIC || m->layout != KPRW_SHM_LAYOUT || m->size != sizeof(*m)) {
+    munmap(m, sizeof(*m));
+    errno = EPROTO;
+    return NULL;
+  }
+
+  return m;
+}
+
+static inline void kprw_shm_close(const struct kprw_shm *m) {
+  munmap((void *) m, sizeof(*m));
+}
+
+/*
+ * Take a consistent copy of the status and its observation time.
+ * All blocks are copied as of one moment, and the copy's version is that of the server.
+ * Returns 0, or -1 with errno EAGAIN if the server stayed in the middle of an update
+ *   for KPRW_SHM_TRIES attempts (it died or was stopped while writing).
+ */
+static inline int kprw_shm_read(const struct kprw_shm *m, struct kprw_status *copy,
+                                uint32_t *obsTime) {
+  uint32_t seq1[KPRW_SHM_BLOCKS], seq2, odd;
+  long tries;
+  int i, same;
+
+  for (tries = 0; tries < KPRW_SHM_TRIES; tries++) {
+    for (i = 0, odd = 0; i < KPRW_SHM_BLOCKS; i++)
+      odd |= seq1[i] = __atomic_load_n(&m->seq[i], __ATOMIC_ACQUIRE);
+    if (odd & 1) continue;
+    memcpy(copy, &m->status, sizeof(*copy));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    for (i = 0, same = 1; i < KPRW_SHM_BLOCKS; i++) {
+      seq2 = __atomic_load_n(&m->seq[i], __ATOMIC_RELAXED);
+      same &= (seq1[i] == seq2);
+    }
+    if (same) {
+      copy->version = (seq1[KPRW_BLK_ZONE] + seq1[KPRW_BLK_LED] + seq1[KPRW_BLK_PRED]) >> 1;
+      if (obsTime) *obsTime = __atomic_load_n(&m->obsTime, __ATOMIC_RELAXED);
+      return 0;
+    }
+  }
+
+  errno = EAGAIN;
+  return -1;
+}
+
+// Current status version, to check for a change without copying the status.
+static inline uint32_t kprw_shm_version(const struct kprw_shm *m) {
+  return (__atomic_load_n(&m->seq[KPRW_BLK_ZONE], __ATOMIC_ACQUIRE) +
+          __atomic_load_n(&m->seq[KPRW_BLK_LED], __ATOMIC_ACQUIRE) +
+          __atomic_load_n(&m->seq[KPRW_BLK_PRED], __ATOMIC_ACQUIRE)) >> 1;
+}
+
+#endif // KPRW_SHM_H
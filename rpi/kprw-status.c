@@ -0,0 +1,103 @@
+/*
+ *
+ * kprw-status.c
+ *
+ * Prints the status kprw-server publishes in shared memory, see kprw-shm.h.
+ * Needs no certificates and no connection to the server, only read access to /dev/shm.
+ *
+ * Compile with "gcc -Wall -o kprw-status kprw-status.c -lrt".
+ *
+ * Usage: kprw-status [options]
+ *  -j, --json      print the status as JSON, in the same form as the server's sendJSON reply.
+ *  -w, --watch     keep printing the status each time its version changes.
+ *
+ * Copyright (c) 2016 - 2019 by Lindo St. Angel.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>		// Needed for getopt_long()
+#include <inttypes.h>		// Needed for PRIu64
+#include "kprw-shm.h"
+
+#define WATCH_PERIOD	100000000L // 100 ms between checks for a new version in nanoseconds
+
+static void print_text(const struct kprw_status *s) {
+  printf("%s, %s, %s, %s, %s,\n", s->ledStatus, s->zoneStatus[0], s->zoneStatus[1],
+         s->zoneStatus[2], s->zoneStatus[3]);
+} // print_text()
+
+static void print_json(const struct kprw_status *s, uint32_t obsTime) {
+  int i;
+
+  printf("{\"version\":%" PRIu32 ",\"obsTime\":%" PRIu32 ",\"zoneAct\":[", s->version, obsTime);
+  for (i = 0; i < KPRW_SHM_ZONES; i++)
+    printf(i ? ",%" PRIu64 : "%" PRIu64, s->zoneAct[i]);
+  printf("],\"zoneDeAct\":[");
+  for (i = 0; i < KPRW_SHM_ZONES; i++)
+    printf(i ? ",%" PRIu64 : "%" PRIu64, s->zoneDeAct[i]);
+  printf("],\"numOcc\":%" PRIi32 ",\"lastTruePred\":[", s->numOcc);
+  for (i = 0; i < KPRW_SHM_PRED; i++)
+    printf(i ? ",\"%s\"" : "\"%s\"", s->lastTruePred[i]);
+  printf("],\"ledStatus\":\"%s\",\"zoneStatus\":[\"%s\",\"%s\",\"%s\",\"%s\"]}\n",
+         s->ledStatus, s->zoneStatus[0], s->zoneStatus[1], s->zoneStatus[2], s->zoneStatus[3]);
+} // print_json()
+
+static const struct option long_opts[] = {
+  {"json", no_argument, NULL, 'j'},
+  {"watch", no_argument, NULL, 'w'},
+  {NULL, 0, NULL, 0}
+};
+
+int main(int argc, char *argv[])
+{
+  const struct timespec period = {0, WATCH_PERIOD};
+  const struct kprw_shm *m;
+  struct kprw_status s;
+  uint32_t obsTime, ver = 0;
+  int opt, json = 0, watch = 0, first = 1;
+
+  while ((opt = getopt_long(argc, argv, "jw", long_opts, NULL)) != -1) {
+    switch (opt) {
+      case 'j':
+        json = 1;
+        break;
+      case 'w':
+        watch = 1;
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-j|--json] [-w|--watch]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+  }
+
+  m = kprw_shm_open(NULL);
+  if (m == NULL) {
+    perror("kprw-status: can't map " KPRW_SHM_NAME ", is kprw-server running?");
+    exit(EXIT_FAILURE);
+  }
+
+  do {
+    if (first || kprw_shm_version(m) != ver) {
+      if (kprw_shm_read(m, &s, &obsTime)) {
+        perror("kprw-status: no consistent status");
+        exit(EXIT_FAILURE);
+      }
+      if (json)
+        print_json(&s, obsTime);
+      else
+        print_text(&s);
+      fflush(stdout);
+      ver = s.version;
+      first = 0;
+    }
+    if (watch) nanosleep(&period, NULL);
+  } while (watch);
+
+  kprw_shm_close(m);
+
+  return 0;
+} // main